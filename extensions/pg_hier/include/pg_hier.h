@@ -3,10 +3,32 @@
 
 #include "pg_hier_dependencies.h"
 #include "pg_hier_helper.h"
+#include "pg_hier_exec.h"
+#include "pg_hier_memory.h"
+#include "pg_hier_materialize.h"
+#include "pg_hier_result_cache.h"
+#include "pg_hier_page.h"
+#include "pg_hier_tree.h"
+#include "pg_hier_binary.h"
+#include "pg_hier_export.h"
+#include "pg_hier_format.h"
 
 extern Datum pg_hier(PG_FUNCTION_ARGS);
+extern Datum pg_hier_rows(PG_FUNCTION_ARGS);
+extern Datum pg_hier_binary(PG_FUNCTION_ARGS);
+extern Datum pg_hier_columnar(PG_FUNCTION_ARGS);
+extern Datum pg_hier_export(PG_FUNCTION_ARGS);
+extern Datum pg_hier_export_rows(PG_FUNCTION_ARGS);
 extern Datum pg_hier_parse(PG_FUNCTION_ARGS);
 extern Datum pg_hier_join(PG_FUNCTION_ARGS);
 extern Datum pg_hier_format(PG_FUNCTION_ARGS);
+extern Datum pg_hier_format_rows(PG_FUNCTION_ARGS);
+extern Datum pg_hier_catalog_changed(PG_FUNCTION_ARGS);
+extern Datum pg_hier_page(PG_FUNCTION_ARGS);
+extern Datum pg_hier_materialize(PG_FUNCTION_ARGS);
+extern Datum pg_hier_refresh(PG_FUNCTION_ARGS);
+extern Datum pg_hier_materialized_changed(PG_FUNCTION_ARGS);
+extern Datum pg_hier_tree_index(PG_FUNCTION_ARGS);
+extern Datum pg_hier_tree_changed(PG_FUNCTION_ARGS);
 
 #endif /* PG_HIER_H */
@@ -0,0 +1,25 @@
+#ifndef PG_HIER_BINARY_H
+#define PG_HIER_BINARY_H
+
+#include "pg_hier_dependencies.h"
+#include "pg_hier_structs.h"
+
+/**************************************
+ * MessagePack output
+ *
+ * The result is one array of root
+ * documents. Each root row is encoded
+ * straight from its jsonb container as
+ * it comes off the cursor, so neither
+ * the aggregated jsonb nor its text is
+ * ever built. Integral numbers become
+ * msgpack ints, other numbers float64
+ * when that keeps their value exactly,
+ * otherwise decimal strings.
+ * With lz4 the array is wrapped in an
+ * LZ4 frame (needs a server built with
+ * --with-lz4).
+ **************************************/
+bytea *pg_hier_binary_encode(const char *input, hier_params *params, bool lz4);
+
+#endif /* PG_HIER_BINARY_H */
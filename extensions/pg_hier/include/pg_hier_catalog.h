@@ -0,0 +1,115 @@
+#ifndef PG_HIER_CATALOG_H
+#define PG_HIER_CATALOG_H
+
+#include "pg_hier_dependencies.h"
+#include "pg_hier_structs.h"
+
+/**************************************
+ * Compiled hierarchy catalog
+ *
+ * pg_hier_header and pg_hier_detail
+ * are loaded once per backend into a
+ * single pointer-free image. Strings
+ * and key lists are referenced by
+ * offset so the image can be copied
+ * around as one block.
+ **************************************/
+typedef struct hier_cat_level
+{
+    int32 name;        // string offset
+    int32 parent_name; // string offset, -1 on the top level
+    int32 level;
+    int32 nkeys;
+    int32 parent_keys; // index of first entry in the key table
+    int32 child_keys;  // index of first entry in the key table
+    int32 join_clause; // "name.child_key = parent_name.parent_key AND ..."
+} hier_cat_level;
+
+typedef struct hier_cat_hier
+{
+    int32 id;
+    int32 table_path;  // string offset
+    int32 first_level; // index into the level table, ordered by level
+    int32 nlevels;
+} hier_cat_hier;
+
+/**************************************
+ * Inverted index entry, one per table
+ * name, sorted by name. The postings
+ * are ascending hierarchy indexes.
+ **************************************/
+typedef struct hier_cat_member
+{
+    int32 name;  // string offset
+    int32 first; // index of first entry in the posting table
+    int32 count;
+} hier_cat_member;
+
+typedef struct hier_catalog
+{
+    Size size;
+    int32 nhiers;
+    int32 nlevels;
+    int32 nkeys;
+    int32 nmembers;
+    int32 npostings;
+    int32 hiers_off;
+    int32 levels_off;
+    int32 keys_off;
+    int32 members_off;
+    int32 postings_off;
+    int32 strings_off;
+} hier_catalog;
+
+#define HIER_CAT_HIERS(cat) \
+    ((hier_cat_hier *) ((char *) (cat) + (cat)->hiers_off))
+#define HIER_CAT_LEVELS(cat) \
+    ((hier_cat_level *) ((char *) (cat) + (cat)->levels_off))
+#define HIER_CAT_KEYS(cat) \
+    ((int32 *) ((char *) (cat) + (cat)->keys_off))
+#define HIER_CAT_MEMBERS(cat) \
+    ((hier_cat_member *) ((char *) (cat) + (cat)->members_off))
+#define HIER_CAT_POSTINGS(cat) \
+    ((int32 *) ((char *) (cat) + (cat)->postings_off))
+#define HIER_CAT_STR(cat, off) \
+    ((const char *) (cat) + (cat)->strings_off + (off))
+#define HIER_CAT_KEY(cat, idx) \
+    HIER_CAT_STR(cat, HIER_CAT_KEYS(cat)[idx])
+
+/**************************************
+ * Resolved join path between two
+ * tables of one hierarchy, copied out
+ * of the catalog. Hops are ordered from
+ * the child upwards, hops[nhops - 1]
+ * links to the requested parent.
+ **************************************/
+typedef struct hier_hop
+{
+    char *name;
+    char *parent_name;
+    int nkeys;
+    char **parent_keys;
+    char **child_keys;
+    char *join_clause;
+    char *exists_clause; // semi-joins standing in for dropped intermediates, or NULL
+} hier_hop;
+
+typedef struct hier_path
+{
+    int nhops;
+    hier_hop *hops;
+} hier_path;
+
+extern bool pg_hier_shared_catalog;
+
+void pg_hier_catalog_shmem_init(void);
+void pg_hier_catalog_bump(void);
+const hier_catalog *pg_hier_catalog(void);
+uint64 pg_hier_catalog_generation(void);
+bool pg_hier_catalog_find(string_array *tables, hier_header *hh);
+hier_path *pg_hier_catalog_path(int hier_id, const char *parent, const char *child);
+hier_path *pg_hier_catalog_route(const char *parent, const char *child);
+bool pg_hier_catalog_tree(const char *table, char ***id_keys, char ***parent_keys,
+                          int *nkeys, bool *closure);
+
+#endif /* PG_HIER_CATALOG_H */
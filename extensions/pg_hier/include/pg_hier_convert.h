@@ -0,0 +1,56 @@
+#ifndef PG_HIER_CONVERT_H
+#define PG_HIER_CONVERT_H
+
+#include "pg_hier_dependencies.h"
+
+/**************************************
+ * Datum to JsonbValue conversion plan
+ *
+ * Built once per result TupleDesc for
+ * the columns a level outputs. Each
+ * column's type is resolved up front to
+ * a converter: integers and floats are
+ * written as numerics without a text
+ * round trip, dates and timestamps use
+ * the JSON datetime format, arrays,
+ * rows, ranges and user types go
+ * through a cached to_jsonb call and
+ * other types through their cached
+ * output function. Values match
+ * to_jsonb.
+ **************************************/
+struct hier_convert_column;
+
+typedef void (*hier_convert_fn)(struct hier_convert_column *col, Datum value,
+                                JsonbValue *result);
+
+typedef struct hier_convert_column
+{
+    hier_convert_fn convert;
+    Oid typid;     // base type, domains resolved
+    FmgrInfo out;  // output function or to_jsonb, fallbacks only
+} hier_convert_column;
+
+typedef struct hier_convert_plan
+{
+    int ncolumns;
+    hier_convert_column *columns;
+} hier_convert_plan;
+
+hier_convert_plan *pg_hier_convert_plan(TupleDesc desc, int ncolumns, const int *attnos);
+
+/**************************************
+ * Converts a non-NULL value of the
+ * plan's column-th column. Strings may
+ * point into value, which must outlive
+ * result.
+ **************************************/
+static inline void
+pg_hier_convert(hier_convert_plan *plan, int column, Datum value, JsonbValue *result)
+{
+    hier_convert_column *col = &plan->columns[column];
+
+    col->convert(col, value, result);
+}
+
+#endif /* PG_HIER_CONVERT_H */
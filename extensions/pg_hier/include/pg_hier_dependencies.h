@@ -16,5 +16,45 @@
 #include <executor/spi.h>        // Server Programming Interface
 #include <executor/executor.h>   // Executor definitions
 #include <utils/datum.h>         //Datum SPIs
+#include <utils/memutils.h>      // Memory contexts
+#include <utils/inval.h>         // Relcache invalidation callbacks
+#include <catalog/namespace.h>   // Relation name lookups
+#include <commands/trigger.h>    // Trigger data
+#include <common/hashfn.h>       // Hash functions
+#include <utils/hsearch.h>       // Dynamic hash tables
+#include <utils/guc.h>           // Custom GUC variables
+#include <miscadmin.h>           // GetUserId, interrupts
+#include <access/table.h>        // Table open/close
+#include <access/tableam.h>      // Table scans
+#include <utils/rel.h>           // Relation descriptors
+#include <nodes/makefuncs.h>     // makeRangeVar
+#include <parser/scansup.h>      // Identifier downcasing
+#include <utils/acl.h>           // Privilege checks
+#include <utils/rls.h>           // Row level security checks
+#include <utils/snapmgr.h>       // Active snapshot
+#include <catalog/pg_class.h>    // reltuples
+#include <catalog/pg_inherits.h> // Partitions of a table
+#include <catalog/pg_statistic.h> // Column n_distinct
+#include <catalog/pg_constraint.h> // Primary key columns
+#include <catalog/pg_index.h>    // Primary key column order
+#include <access/sysattr.h>      // System attribute numbers
+#include <access/xact.h>         // Transaction callbacks, isolation level
+#include <storage/ipc.h>         // Shared memory startup hook
+#include <storage/shmem.h>       // Shared memory allocation
+#include <storage/lwlock.h>      // Lightweight locks
+#include <port/atomics.h>        // Shared change counters
+#include <utils/dsa.h>           // Dynamic shared memory areas
+#include <lib/dshash.h>          // Shared hash tables
+#include <lib/ilist.h>           // Plan cache recency list
+#include <tcop/utility.h>        // ProcessUtility hook
+#include <parser/parsetree.h>    // rt_fetch
+#include <common/base64.h>       // Page tokens
+#include <storage/fd.h>          // AllocateFile for exports
+#include <catalog/pg_authid.h>   // pg_write_server_files
+#include <utils/numeric.h>       // int64_to_numeric
+#include <utils/float.h>         // isnan, isinf
+#include <common/shortest_dec.h> // Shortest float digits
+#include <utils/fmgroids.h>      // F_TO_JSONB
+#include <access/transam.h>      // FirstNormalObjectId
 
 #endif /* PG_HIER_DEPENDENCIES_H */
\ No newline at end of file
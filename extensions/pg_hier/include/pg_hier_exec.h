@@ -0,0 +1,107 @@
+#ifndef PG_HIER_EXEC_H
+#define PG_HIER_EXEC_H
+
+#include "pg_hier_dependencies.h"
+#include "pg_hier_structs.h"
+#include "pg_hier_catalog.h"
+#include "pg_hier_tree.h"
+#include "pg_hier_jsonb.h"
+#include "pg_hier_convert.h"
+
+typedef enum hier_executor
+{
+    HIER_EXECUTOR_SQL,     // generated correlated SQL
+    HIER_EXECUTOR_NATIVE,  // table scans assembled in C
+    HIER_EXECUTOR_BATCHED  // one key-set query per level, assembled in C
+} hier_executor;
+
+extern int pg_hier_executor;
+extern const struct config_enum_entry pg_hier_executor_options[];
+
+/**************************************
+ * Columns of a deformed tuple that
+ * make up a join key, formatted to
+ * text to probe the per-level hashes.
+ **************************************/
+typedef struct hier_keymap
+{
+    int nkeys;
+    int *idx;     // 0-based positions in the deformed tuple
+    FmgrInfo *out; // output functions of the key columns
+} hier_keymap;
+
+/**************************************
+ * Per DSL node execution state. docs
+ * maps the link key shared with the
+ * parent level to the List of hier_jb
+ * documents built for that parent.
+ **************************************/
+typedef struct hier_exec_node
+{
+    hier_node *node;
+    hier_path *path;        // node up to its parent, NULL at the root
+    int ncolumns;
+    int *col_idx;
+    hier_convert_plan *convert; // per DSL column
+    hier_keymap link;       // own columns matching the parent
+    hier_keymap *child_keys; // per child, columns the child links to
+    struct hier_exec_node **children;
+    HTAB *docs;
+    List *root_docs;
+    SPITupleTable *tuptable; // batched executor, rows of this level
+    uint64 ntuples;
+} hier_exec_node;
+
+typedef struct hier_doc_bucket
+{
+    char *key;
+    List *docs;
+} hier_doc_bucket;
+
+/**************************************
+ * Self-referential table, read once.
+ * Rows are deformed up front, children
+ * maps a parent key to the List of row
+ * numbers pointing at it.
+ **************************************/
+typedef struct hier_tree_state
+{
+    hier_node *node;
+    uint64 ntuples;
+    int natts;
+    Datum *values;       // ntuples * natts
+    bool *nulls;
+    hier_convert_plan *convert; // per DSL column
+    hier_keymap id;      // own key, probes children
+    HTAB *children;
+} hier_tree_state;
+
+/**************************************
+ * Columnar output of one DSL node. Rows
+ * are numbered in emission order, which
+ * groups them by parent; parents holds
+ * each row's position in the level
+ * above. rows maps the link key to the
+ * List of fetched row numbers.
+ **************************************/
+typedef struct hier_columnar_level
+{
+    hier_exec_node *en;
+    ColumnArrayState columns;
+    int *sources;        // per column, first DSL column naming it
+    HTAB *rows;
+    List *emitted;       // fetched row number of every output row
+    hier_jb *parents;
+    struct hier_columnar_level **children;
+} hier_columnar_level;
+
+extern int pg_hier_tree_max_depth;
+
+bool pg_hier_exec_native(const char *input, Datum *result, bool *is_null);
+bool pg_hier_exec_batched(const char *input, hier_params *params,
+                          Datum *result, bool *is_null);
+bool pg_hier_exec_tree(const char *input, hier_params *params,
+                       Datum *result, bool *is_null);
+Datum pg_hier_exec_columnar(const char *input, hier_params *params);
+
+#endif /* PG_HIER_EXEC_H */
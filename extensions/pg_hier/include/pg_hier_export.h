@@ -0,0 +1,34 @@
+#ifndef PG_HIER_EXPORT_H
+#define PG_HIER_EXPORT_H
+
+#include "pg_hier_dependencies.h"
+#include "pg_hier_structs.h"
+
+/**************************************
+ * Streaming export
+ *
+ * Root documents are read from a
+ * cursor in pg_hier.fetch_size batches
+ * and written out one line at a time,
+ * memory stays flat whatever the size
+ * of the result.
+ *
+ * ndjson: one document per line.
+ * csv: one row per leaf record, with a
+ * "table.column" header in DSL order.
+ * A row repeats the fields of its
+ * ancestors; the columns of sibling
+ * branches are left empty.
+ **************************************/
+typedef enum hier_export_format
+{
+    HIER_EXPORT_NDJSON,
+    HIER_EXPORT_CSV
+} hier_export_format;
+
+hier_export_format pg_hier_export_format(const char *name);
+int64 pg_hier_export_file(const char *input, hier_export_format format, const char *path);
+void pg_hier_export_store(const char *input, hier_export_format format,
+                          ReturnSetInfo *rsinfo);
+
+#endif /* PG_HIER_EXPORT_H */
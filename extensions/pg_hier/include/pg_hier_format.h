@@ -0,0 +1,21 @@
+#ifndef PG_HIER_FORMAT_H
+#define PG_HIER_FORMAT_H
+
+#include "pg_hier_dependencies.h"
+#include "pg_hier_convert.h"
+#include "pg_hier_jsonb.h"
+
+/**************************************
+ * Query results as jsonb
+ *
+ * Runs any read-only query through a
+ * cursor in pg_hier.fetch_size batches
+ * and turns each row into an object
+ * keyed by column name. Values are
+ * converted by one plan built from the
+ * first batch's TupleDesc.
+ **************************************/
+Jsonb *pg_hier_format_array(const char *query);
+void pg_hier_format_store(const char *query, ReturnSetInfo *rsinfo);
+
+#endif /* PG_HIER_FORMAT_H */
@@ -4,24 +4,33 @@
 #include "pg_hier_dependencies.h"
 #include "pg_hier_structs.h"
 #include "pg_hier_sql.h"
+#include "pg_hier_catalog.h"
+#include "pg_hier_parser.h"
+#include "pg_hier_plan_cache.h"
+#include "pg_hier_sqlgen.h"
+#include "pg_hier_memory.h"
+#include "pg_hier_jsonb.h"
 
-void parse_input(StringInfo buf, const char *input, string_array **tables);
-static char *trim_whitespace(char *str);
-void pg_hier_get_hier(string_array *tables, hier_header *hh);
+extern int pg_hier_fetch_size;
+
+RangeVar *pg_hier_rangevar(const char *table);
 void pg_hier_find_hier(string_array *tables, hier_header *hh);
-void pg_hier_from_clause(StringInfo buf, hier_header *hh, char *parent, char *child);
-Datum pg_hier_return_one(const char *sql);
+char **pg_hier_primary_key(const char *table, int *nkeys);
+hier_path *pg_hier_path(hier_header *hh, const char *parent, const char *child);
+hier_path *pg_hier_join_path(hier_header *hh, const char *parent, const char *child,
+                             const char *where);
+uint64 pg_hier_join_generation(void);
+bool pg_hier_where_mentions(const char *where, const char *table);
+bool pg_hier_tree_keys(const char *table, bool for_update, char ***id_keys,
+                       char ***parent_keys, int *nkeys, bool *closure);
+bool pg_hier_from_clause(StringInfo buf, hier_header *hh, char *parent, char *child,
+                         const char *where);
+void pg_hier_build_sql(StringInfo buf, const char *input, hier_output_mode mode);
+Datum pg_hier_return_one(const char *input, hier_params *params, bool *is_null);
 string_array *reorder_tables(string_array *tables, char *hierarchy_string);
 static int compare_string_positions(const void *a, const void *b);
-JsonbValue datum_to_jsonb_value(Datum value_datum, Oid value_type);
-Jsonb *get_or_create_array(Jsonb *existing_jsonb, char *key_str);
+void column_array_init(ColumnArrayState *state, int allocated);
+int column_array_add(ColumnArrayState *state, text *column_name, Oid column_type);
 int find_column_index(ColumnArrayState *state, text *column_name);
-void datum_to_jsonb(Datum val, Oid val_type, JsonbValue *result);
-
-// Macros
-#define GET_TOKEN_1(saveptr) trim_whitespace(strtok_r(NULL, ", \n\r\t", saveptr))
-#define GET_TOKEN_2(inp, saveptr) trim_whitespace(strtok_r(inp, ", \n\r\t", saveptr))
-#define GET_TOKEN_SELECT(_1, _2, NAME, ...) NAME
-#define GET_TOKEN(...) GET_TOKEN_SELECT(__VA_ARGS__, GET_TOKEN_2, GET_TOKEN_1)(__VA_ARGS__)
 
 #endif /* PG_HIER_HELPER_H */
\ No newline at end of file
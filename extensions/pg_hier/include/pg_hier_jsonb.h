@@ -0,0 +1,45 @@
+#ifndef PG_HIER_JSONB_H
+#define PG_HIER_JSONB_H
+
+#include "pg_hier_dependencies.h"
+
+/**************************************
+ * Append-only document builder
+ *
+ * Objects and arrays stay a mutable
+ * tree of hier_jb nodes whose item
+ * arrays double as they fill, so every
+ * put or append is amortized O(1) and
+ * nothing is copied when a child is
+ * attached. hier_jb_finish serializes
+ * the whole tree to Jsonb once. A node
+ * may be attached to several parents.
+ * Nodes live in the memory context
+ * current when they are created.
+ **************************************/
+typedef enum hier_jb_kind
+{
+    HIER_JB_SCALAR, // scalar or jbvBinary container, owned copy
+    HIER_JB_OBJECT,
+    HIER_JB_ARRAY
+} hier_jb_kind;
+
+typedef struct hier_jb
+{
+    hier_jb_kind kind;
+    JsonbValue scalar;
+    int count;
+    int capacity;
+    JsonbValue *keys;       // objects only, key strings are not copied
+    struct hier_jb **items;
+} hier_jb;
+
+hier_jb *hier_jb_object(void);
+hier_jb *hier_jb_array(void);
+hier_jb *hier_jb_value(const JsonbValue *v);
+hier_jb *hier_jb_null(void);
+void hier_jb_put(hier_jb *obj, const char *key, hier_jb *value);
+void hier_jb_append(hier_jb *arr, hier_jb *value);
+Jsonb *hier_jb_finish(hier_jb *root);
+
+#endif /* PG_HIER_JSONB_H */
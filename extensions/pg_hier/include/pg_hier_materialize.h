@@ -0,0 +1,24 @@
+#ifndef PG_HIER_MATERIALIZE_H
+#define PG_HIER_MATERIALIZE_H
+
+#include "pg_hier_dependencies.h"
+#include "pg_hier_structs.h"
+#include "pg_hier_catalog.h"
+#include "pg_hier_parser.h"
+
+/**************************************
+ * Materialized hierarchies
+ *
+ * pg_hier_materialized_doc keeps one
+ * document per root key. Row triggers
+ * on every table the hierarchy reads
+ * walk the parent_key/child_key chain
+ * up to the root and record its key in
+ * pg_hier_materialized_dirty; a refresh
+ * rebuilds only those documents.
+ **************************************/
+int64 pg_hier_materialize_create(const char *name, const char *dsl);
+int64 pg_hier_materialize_refresh(const char *name);
+void pg_hier_materialize_mark(TriggerData *trigdata);
+
+#endif /* PG_HIER_MATERIALIZE_H */
@@ -0,0 +1,30 @@
+#ifndef PG_HIER_MEMORY_H
+#define PG_HIER_MEMORY_H
+
+#include "pg_hier_dependencies.h"
+
+/**************************************
+ * Per-call arena. Every SQL-callable
+ * entry point allocates its working
+ * memory in one child context that is
+ * released in bulk when the call ends.
+ * Executors create their per-level and
+ * per-row contexts underneath it.
+ **************************************/
+typedef struct hier_call_arena
+{
+    MemoryContext cxt;
+    MemoryContext oldcxt;
+    const char *name; // entry point, for the log line
+    // State of an enclosing arena, restored at the end
+    MemoryContext outer_cxt;
+    Size outer_peak;
+} hier_call_arena;
+
+extern bool pg_hier_log_memory_usage;
+
+void pg_hier_arena_begin(hier_call_arena *arena, const char *name);
+void pg_hier_arena_sample(void);
+Datum pg_hier_arena_end(hier_call_arena *arena, Datum result, bool is_null);
+
+#endif /* PG_HIER_MEMORY_H */
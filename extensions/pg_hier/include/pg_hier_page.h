@@ -0,0 +1,15 @@
+#ifndef PG_HIER_PAGE_H
+#define PG_HIER_PAGE_H
+
+#include "pg_hier_dependencies.h"
+
+/**************************************
+ * Keyset pagination over root rows.
+ * Pages follow the root's primary key;
+ * the continuation token carries the
+ * last key of a page, base64 encoded.
+ **************************************/
+void pg_hier_page_fetch(const char *input, int64 page_size, const char *token,
+                        Datum *documents, char **next_token);
+
+#endif /* PG_HIER_PAGE_H */
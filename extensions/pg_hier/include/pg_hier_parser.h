@@ -0,0 +1,54 @@
+#ifndef PG_HIER_PARSER_H
+#define PG_HIER_PARSER_H
+
+#include "pg_hier_dependencies.h"
+#include "pg_hier_structs.h"
+
+typedef enum hier_token_type
+{
+    HIER_TOKEN_END,   // end of input
+    HIER_TOKEN_WORD,  // name or WHERE clause element, quotes kept
+    HIER_TOKEN_OPEN,  // {
+    HIER_TOKEN_CLOSE, // }
+    HIER_TOKEN_SEMI   // ;
+} hier_token_type;
+
+/**************************************
+ * Tokens point into the original input
+ * by offset and length, the lexer never
+ * copies or modifies it.
+ **************************************/
+typedef struct hier_token
+{
+    hier_token_type type;
+    int offset;
+    int length;
+} hier_token;
+
+typedef struct hier_lexer
+{
+    const char *input;
+    int pos;
+} hier_lexer;
+
+/**************************************
+ * Parsed DSL. Every node, name and
+ * WHERE clause is allocated from arena
+ * so the whole tree goes away with one
+ * MemoryContextDelete.
+ **************************************/
+typedef struct hier_ast
+{
+    MemoryContext arena;
+    hier_node *root;
+    string_array *tables; // DSL order, shares the node names
+} hier_ast;
+
+void hier_lexer_init(hier_lexer *lex, const char *input);
+hier_token hier_lexer_next(hier_lexer *lex);
+
+hier_ast *pg_hier_parse_dsl(const char *input);
+char *pg_hier_ast_normalize(hier_ast *ast);
+void pg_hier_free_ast(hier_ast *ast);
+
+#endif /* PG_HIER_PARSER_H */
@@ -0,0 +1,33 @@
+#ifndef PG_HIER_PLAN_CACHE_H
+#define PG_HIER_PLAN_CACHE_H
+
+#include "pg_hier_dependencies.h"
+#include "pg_hier_structs.h"
+
+/**************************************
+ * Backend-local cache of prepared
+ * hierarchy queries, keyed by a hash
+ * of the normalized DSL AST. Past
+ * pg_hier.plan_cache_size entries the
+ * least recently used plan is dropped.
+ **************************************/
+typedef struct hier_plan_entry
+{
+    uint64 key;        // hash of the normalized DSL, mode, shape and argument types
+    char *dsl;         // normalized DSL, compared on lookup
+    hier_output_mode mode;
+    int shape;         // pg_hier.sql_shape the SQL was built under
+    int nargs;
+    Oid *argtypes;     // bind parameter types, compared on lookup
+    SPIPlanPtr plan;   // kept with SPI_keepplan
+    uint64 generation; // catalog generation the SQL was built from
+    dlist_node lru;    // position in the recency list
+} hier_plan_entry;
+
+extern int pg_hier_plan_cache_size;
+
+SPIPlanPtr pg_hier_plan_get(const char *input, hier_params *params,
+                            hier_output_mode mode);
+void pg_hier_plan_cache_reset(void);
+
+#endif /* PG_HIER_PLAN_CACHE_H */
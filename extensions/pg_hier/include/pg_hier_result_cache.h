@@ -0,0 +1,53 @@
+#ifndef PG_HIER_RESULT_CACHE_H
+#define PG_HIER_RESULT_CACHE_H
+
+#include "pg_hier_dependencies.h"
+#include "pg_hier_structs.h"
+
+/**************************************
+ * Cross-backend result cache
+ *
+ * Only available when pg_hier is in
+ * shared_preload_libraries. Documents
+ * live in a DSA area indexed by a
+ * dshash table, keyed by database,
+ * user, normalized DSL, the resolved
+ * relids and the bound parameters.
+ *
+ * Every table has a shared change
+ * counter (hashed into a fixed slot
+ * array). Writers bump it after commit,
+ * readers stamp an entry with the
+ * counters read before computing it
+ * under a fresh snapshot, so a stamp is
+ * never newer than the data it covers.
+ * Only READ COMMITTED transactions that
+ * have not written use the cache.
+ **************************************/
+#define HIER_RC_SLOTS 4096
+
+typedef struct hier_rc_stamp
+{
+    uint32 slot;
+    uint64 counter;
+} hier_rc_stamp;
+
+// One lookup, carried from the probe to the store
+typedef struct hier_rc_probe
+{
+    bool usable;
+    uint64 hash;
+    StringInfoData key;   // full key bytes, compared on hit
+    int nstamps;
+    hier_rc_stamp *stamps;
+} hier_rc_probe;
+
+extern int pg_hier_result_cache_size;
+extern bool pg_hier_result_cache;
+
+void pg_hier_result_cache_init(void);
+bool pg_hier_result_cache_get(hier_rc_probe *probe, const char *input,
+                              hier_params *params, Datum *result, bool *is_null);
+void pg_hier_result_cache_put(hier_rc_probe *probe, Datum result, bool is_null);
+
+#endif /* PG_HIER_RESULT_CACHE_H */
@@ -1,11 +1,13 @@
 #ifndef PG_HIER_SQL_H
 #define PG_HIER_SQL_H
 
-#define PG_HIER_SQL_GET_HIER_BY_ID \
-        "SELECT parent_name, parent_key, name, child_key FROM pg_hier_detail " \
-        "WHERE HIERARCHY_ID = $1 " \
-        "    AND LEVEL >= (SELECT LEVEL FROM PG_HIER_DETAIL WHERE PARENT_NAME = $2) " \
-        "    AND LEVEL <= (SELECT LEVEL FROM PG_HIER_DETAIL WHERE NAME = $3) " \
-        "ORDER BY LEVEL DESC" 
+#define PG_HIER_SQL_LOAD_HEADER \
+        "SELECT id, table_path FROM pg_hier_header " \
+        "ORDER BY id"
 
-#endif
\ No newline at end of file
+#define PG_HIER_SQL_LOAD_DETAIL \
+        "SELECT hierarchy_id, level, name, parent_name, parent_key, child_key " \
+        "FROM pg_hier_detail " \
+        "ORDER BY hierarchy_id, level"
+
+#endif
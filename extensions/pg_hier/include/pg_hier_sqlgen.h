@@ -0,0 +1,36 @@
+#ifndef PG_HIER_SQLGEN_H
+#define PG_HIER_SQLGEN_H
+
+#include "pg_hier_dependencies.h"
+#include "pg_hier_structs.h"
+#include "pg_hier_catalog.h"
+#include "pg_hier_parser.h"
+
+/**************************************
+ * Shape of the generated SQL. The
+ * correlated shape runs one subquery
+ * per parent row, the grouped shape
+ * aggregates each level once in a
+ * derived table grouped by the link key
+ * and LEFT JOINs it to the parent.
+ **************************************/
+typedef enum hier_sql_shape
+{
+    HIER_SQL_SHAPE_AUTO,       // chosen from table statistics
+    HIER_SQL_SHAPE_CORRELATED, // correlated jsonb_agg subqueries
+    HIER_SQL_SHAPE_GROUPED     // pre-aggregated derived tables
+} hier_sql_shape;
+
+extern int pg_hier_sql_shape;
+extern const struct config_enum_entry pg_hier_sql_shape_options[];
+
+void pg_hier_ast_sql(StringInfo buf, hier_ast *ast, hier_output_mode mode);
+void pg_hier_keyed_sql(StringInfo buf, hier_ast *ast, hier_header *hh,
+                       char **keys, int nkeys, bool by_key, int first_param);
+void pg_hier_page_sql(StringInfo buf, hier_ast *ast, hier_header *hh,
+                      char **keys, int nkeys, bool after);
+hier_sql_shape pg_hier_choose_shape(hier_node *tree, hier_header *hh);
+bool pg_hier_grouped_sql(StringInfo buf, hier_node *tree, hier_header *hh,
+                         hier_output_mode mode);
+
+#endif /* PG_HIER_SQLGEN_H */
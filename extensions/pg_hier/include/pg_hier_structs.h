@@ -10,11 +10,16 @@ typedef struct string_array
     int capacity;
 } string_array;
 
-typedef struct table_stack
+typedef struct hier_node
 {
-    char *table_name;
-    struct table_stack *next;
-} table_stack;
+    char *table;
+    char *where;           // raw WHERE condition, NULL if absent
+    bool required;         // inner block, parents without a match are dropped
+    string_array *columns; // scalar fields in DSL order
+    int nchildren;
+    int capacity;
+    struct hier_node **children;
+} hier_node;
 
 typedef struct hier_header
 {
@@ -29,16 +34,36 @@ typedef struct table_position
     int hierarchy_position;
 } table_position;
 
+/**************************************
+ * One value array per distinct column
+ * name. column_index maps a name to its
+ * position, so a lookup costs the same
+ * however many columns there are.
+ **************************************/
 typedef struct ColumnArrayState
 {
     int allocated;
     int num_columns;
     text **column_names;
-    List **column_values;
-    List **column_nulls;
+    struct hier_jb **column_values; // array nodes, JSON null for NULL
     Oid *column_types;
+    HTAB *column_index;
 } ColumnArrayState;
 
+typedef enum hier_output_mode
+{
+    HIER_OUTPUT_AGGREGATE, // one jsonb array holding every root row
+    HIER_OUTPUT_ROWS       // one jsonb object per root row
+} hier_output_mode;
+
+typedef struct hier_params
+{
+    int nargs;
+    Oid *types;
+    Datum *values;
+    char *nulls; // SPI convention, 'n' marks NULL
+} hier_params;
+
 typedef struct
 {
     int num_keys;
@@ -48,14 +73,14 @@ typedef struct
 
 string_array *create_string_array(void);
 void add_string_to_array(string_array *arr, char *value);
+void push_string_array(string_array *arr, char *value);
 void copy_string_array(string_array *to, string_array *from);
 void free_string_array(string_array *arr);
 
-// No need for a init, table_stack *next is NULL on first call
-table_stack *create_table_stack_entry(char *table_name, table_stack *next);
-char *peek_table_stack(table_stack **stack);
-char *pop_table_stack(table_stack **stack);
-void free_table_stack(table_stack **stack);
+hier_node *create_hier_node(const char *table, int length);
+void add_hier_node_child(hier_node *parent, hier_node *child);
+
+hier_params *create_hier_params(FunctionCallInfo fcinfo, int first_arg);
 
 hier_header *create_hier_header0(void);
 hier_header *create_hier_header2(char *hier, int hier_id);
@@ -0,0 +1,23 @@
+#ifndef PG_HIER_TREE_H
+#define PG_HIER_TREE_H
+
+#include "pg_hier_dependencies.h"
+
+/**************************************
+ * Closure index of self-referential
+ * trees
+ *
+ * pg_hier_tree_closure holds one row
+ * per ancestor/descendant pair of an
+ * indexed tree, keys as text[]. Row
+ * triggers on the tree keep it in step
+ * with inserts, deletes and subtree
+ * moves, so subtree and ancestor
+ * lookups are one index range scan.
+ **************************************/
+int64 pg_hier_tree_build(const char *table);
+void pg_hier_tree_mark(TriggerData *trigdata);
+void pg_hier_tree_subtree(StringInfo buf, const char *table, char **id_keys,
+                          int nkeys, const char *where, int max_depth);
+
+#endif /* PG_HIER_TREE_H */
@@ -0,0 +1,438 @@
+/**************************************
+ * Define scehma and set search path
+ **************************************/
+-- CREATE SCHEMA hier;
+-- SET search_path TO hier, public;
+
+/**************************************
+ * Define necessary tables
+ **************************************/
+CREATE TABLE IF NOT EXISTS pg_hier_header (
+    id SERIAL PRIMARY KEY,
+    table_path TEXT NOT NULL,
+    tables TEXT[] NOT NULL DEFAULT '{}' -- level names, root first
+);
+
+CREATE TABLE IF NOT EXISTS pg_hier_detail (
+    id SERIAL PRIMARY KEY,
+    hierarchy_id INT NOT NULL REFERENCES pg_hier_header(id) ON DELETE CASCADE, 
+    name TEXT NOT NULL,
+    parent_id INT REFERENCES pg_hier_detail(id),
+    parent_name TEXT, 
+    child_id INT REFERENCES pg_hier_detail(id),
+    level INT,
+    parent_key TEXT[],
+    child_key TEXT[]
+);
+
+/**************************************
+ * Self-referential trees, one table
+ * whose parent key points at its own
+ * id key (org charts, categories).
+ **************************************/
+CREATE TABLE IF NOT EXISTS pg_hier_tree (
+    table_name TEXT PRIMARY KEY,
+    id_key TEXT[] NOT NULL,
+    parent_key TEXT[] NOT NULL, -- same length as id_key
+    closure BOOLEAN NOT NULL DEFAULT false -- set by pg_hier_tree_index
+);
+
+-- Ancestor/descendant pairs of indexed trees, keys as text
+CREATE TABLE IF NOT EXISTS pg_hier_tree_closure (
+    table_name TEXT NOT NULL REFERENCES pg_hier_tree(table_name) ON DELETE CASCADE,
+    ancestor TEXT[] NOT NULL,
+    descendant TEXT[] NOT NULL,
+    depth INT NOT NULL, -- 0 pairs a node with itself
+    PRIMARY KEY (table_name, ancestor, descendant)
+);
+
+/**************************************
+ * Materialized hierarchies, one
+ * document per root key. Change
+ * triggers queue root keys in
+ * pg_hier_materialized_dirty.
+ **************************************/
+CREATE TABLE IF NOT EXISTS pg_hier_materialized (
+    name TEXT PRIMARY KEY,
+    dsl TEXT NOT NULL,
+    root_table TEXT NOT NULL,
+    root_key TEXT[] NOT NULL, -- root columns identifying a document
+    tables TEXT[] NOT NULL,   -- table of trigger pg_hier_<name>_<n> at n
+    stale BOOLEAN NOT NULL DEFAULT false -- set by TRUNCATE, rebuild all
+);
+
+CREATE TABLE IF NOT EXISTS pg_hier_materialized_doc (
+    name TEXT NOT NULL REFERENCES pg_hier_materialized(name) ON DELETE CASCADE,
+    root_key TEXT[] NOT NULL,
+    document JSONB NOT NULL,
+    PRIMARY KEY (name, root_key)
+);
+
+CREATE TABLE IF NOT EXISTS pg_hier_materialized_dirty (
+    name TEXT NOT NULL REFERENCES pg_hier_materialized(name) ON DELETE CASCADE,
+    root_key TEXT[] NOT NULL,
+    PRIMARY KEY (name, root_key)
+);
+
+ /**************************************
+ * Table indexes
+ **************************************/
+CREATE INDEX IF NOT EXISTS idx_pg_hier_detail_hierarchy ON pg_hier_detail(hierarchy_id);
+CREATE INDEX IF NOT EXISTS idx_pg_hier_detail_hierarchy ON pg_hier_detail(hierarchy_id, name);
+CREATE INDEX IF NOT EXISTS idx_pg_hier_detail_parent ON pg_hier_detail(parent_id);
+CREATE INDEX IF NOT EXISTS idx_pg_hier_detail_child ON pg_hier_detail(child_id);
+CREATE UNIQUE INDEX IF NOT EXISTS idx_pg_hier_detail_unique ON pg_hier_detail(parent_id, child_id);
+CREATE INDEX IF NOT EXISTS idx_pg_hier_detail_name ON pg_hier_detail(name);
+CREATE INDEX IF NOT EXISTS idx_pg_hier_header_tables ON pg_hier_header USING gin (tables);
+CREATE INDEX IF NOT EXISTS idx_pg_hier_tree_closure_descendant ON pg_hier_tree_closure(table_name, descendant, depth);
+
+/**************************************
+ * Define C source code functions
+ **************************************/
+CREATE FUNCTION pg_hier(text) 
+RETURNS JSONB
+AS 'MODULE_PATHNAME', 'pg_hier'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier(text, VARIADIC "any") 
+RETURNS JSONB
+AS 'MODULE_PATHNAME', 'pg_hier'
+LANGUAGE C;
+
+CREATE FUNCTION pg_hier_rows(text) 
+RETURNS SETOF JSONB
+AS 'MODULE_PATHNAME', 'pg_hier_rows'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_rows(text, VARIADIC "any") 
+RETURNS SETOF JSONB
+AS 'MODULE_PATHNAME', 'pg_hier_rows'
+LANGUAGE C;
+
+CREATE FUNCTION pg_hier_binary(text, lz4 boolean DEFAULT false)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_hier_binary'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_columnar(text)
+RETURNS jsonb
+AS 'MODULE_PATHNAME', 'pg_hier_columnar'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_columnar(text, VARIADIC "any")
+RETURNS jsonb
+AS 'MODULE_PATHNAME', 'pg_hier_columnar'
+LANGUAGE C;
+
+CREATE FUNCTION pg_hier_export(text, format text, target text)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_hier_export'
+LANGUAGE C STRICT;
+
+-- COPY (SELECT * FROM pg_hier_export_rows(..)) TO STDOUT
+CREATE FUNCTION pg_hier_export_rows(text, format text)
+RETURNS SETOF text
+AS 'MODULE_PATHNAME', 'pg_hier_export_rows'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_page(text, bigint, text DEFAULT NULL,
+                             OUT documents JSONB, OUT next_token text)
+AS 'MODULE_PATHNAME', 'pg_hier_page'
+LANGUAGE C;
+
+CREATE FUNCTION pg_hier_parse(text) 
+RETURNS text
+AS 'MODULE_PATHNAME', 'pg_hier_parse'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_join(TEXT, TEXT)
+RETURNS text
+AS 'MODULE_PATHNAME', 'pg_hier_join'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_format(TEXT)
+RETURNS jsonb
+AS 'MODULE_PATHNAME', 'pg_hier_format'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_format_rows(TEXT)
+RETURNS SETOF jsonb
+AS 'MODULE_PATHNAME', 'pg_hier_format_rows'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_catalog_changed()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'pg_hier_catalog_changed'
+LANGUAGE C;
+
+CREATE FUNCTION pg_hier_materialize(TEXT, TEXT)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_hier_materialize'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_refresh(TEXT)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_hier_refresh'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_materialized_changed()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'pg_hier_materialized_changed'
+LANGUAGE C;
+
+CREATE FUNCTION pg_hier_tree_index(TEXT)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_hier_tree_index'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_hier_tree_changed()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'pg_hier_tree_changed'
+LANGUAGE C;
+
+/**************************************
+ * Invalidate backend catalog caches
+ **************************************/
+CREATE TRIGGER pg_hier_header_changed
+AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON pg_hier_header
+FOR EACH STATEMENT EXECUTE FUNCTION pg_hier_catalog_changed();
+
+CREATE TRIGGER pg_hier_detail_changed
+AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON pg_hier_detail
+FOR EACH STATEMENT EXECUTE FUNCTION pg_hier_catalog_changed();
+
+CREATE TRIGGER pg_hier_tree_registered
+AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON pg_hier_tree
+FOR EACH STATEMENT EXECUTE FUNCTION pg_hier_catalog_changed();
+
+/**************************************
+ * Define SQL source code functions
+ **************************************/
+CREATE OR REPLACE FUNCTION pg_hier_create_hier(
+    path_names text[],
+    parent_path_keys text[],
+    child_path_keys text[]
+)
+RETURNS VOID AS
+$$
+DECLARE
+    i INT;
+    hier_id INT;
+    curr_id INT;
+    v_parent_id INT;
+    v_child_id INT;
+    table_path_string TEXT;
+    re_raise_exception BOOLEAN := TRUE; 
+BEGIN
+    BEGIN  
+        IF array_length(path_names, 1) IS NULL OR array_length(path_names, 1) < 2 THEN
+            RAISE EXCEPTION 'Path names must contain at least two elements';
+        END IF;
+
+        IF array_length(path_names, 1) != array_length(parent_path_keys, 1) THEN
+            RAISE EXCEPTION 'parent_path_keys must have the same number of elements as path_names';
+        END IF;
+
+        IF array_length(path_names, 1) != array_length(child_path_keys, 1) THEN
+            RAISE EXCEPTION 'child_path_keys must have the same number of elements as path_names';
+        END IF;
+
+        SELECT COALESCE(max(id) + 1, 1) INTO hier_id FROM pg_hier_header;
+
+        table_path_string := array_to_string(path_names, '.');
+
+        IF EXISTS (SELECT 1 FROM pg_hier_header WHERE table_path = table_path_string) THEN
+            RAISE NOTICE 'Hierarchy % already exists. Skipping creation.', table_path_string;
+            RETURN;
+        END IF;
+
+        INSERT INTO pg_hier_header (id, table_path, tables)
+        VALUES (hier_id, table_path_string, path_names);
+
+        FOR i IN 1 .. array_length(path_names, 1) LOOP
+            INSERT INTO pg_hier_detail (hierarchy_id, level, name, parent_key, child_key)
+            VALUES (
+                hier_id,
+                i,
+                path_names[i],
+                CASE WHEN i = 1 THEN '{}'::text[] ELSE string_to_array(parent_path_keys[i], ':') END, 
+                CASE WHEN i = 1 THEN '{}'::text[] ELSE string_to_array(child_path_keys[i], ':') END 
+            );
+        END LOOP;
+
+        RAISE NOTICE 'Hierarchy % created with ID %', table_path_string, hier_id;
+
+        FOR i IN 1 .. array_length(path_names, 1) LOOP
+            SELECT id INTO curr_id FROM pg_hier_detail WHERE hierarchy_id = hier_id AND name = path_names[i];
+            IF NOT FOUND THEN
+                RAISE EXCEPTION 'Could not find pg_hier_detail record for level % and name %', i, path_names[i];
+            END IF;
+
+            IF i > 1 THEN
+                SELECT id INTO v_parent_id FROM pg_hier_detail WHERE hierarchy_id = hier_id AND name = path_names[i-1];
+                IF NOT FOUND THEN
+                   RAISE EXCEPTION 'Could not find pg_hier_detail record for parent level % and name %', i-1, path_names[i-1];
+                END IF;
+                UPDATE pg_hier_detail 
+                SET 
+                    parent_id = v_parent_id, 
+                    parent_name = (SELECT name FROM pg_hier_detail WHERE id = v_parent_id)
+                WHERE id = curr_id;
+            END IF;
+
+            IF i < array_length(path_names, 1) THEN
+                SELECT id INTO v_child_id FROM pg_hier_detail WHERE hierarchy_id = hier_id AND name = path_names[i+1];
+                IF NOT FOUND THEN
+                    RAISE EXCEPTION 'Could not find pg_hier_detail record for child level % and name %', i+1, path_names[i+1];
+                END IF;
+
+                UPDATE pg_hier_detail SET child_id = v_child_id WHERE id = curr_id;
+            END IF;
+        END LOOP;
+
+    EXCEPTION
+        WHEN OTHERS THEN
+            IF re_raise_exception THEN
+                RAISE; 
+            ELSE
+               RAISE NOTICE 'Exception caught, but not re-raised.';
+            END IF;
+    END;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Keys are ':' separated, as in pg_hier_create_hier.
+-- Redefining an indexed tree rebuilds its closure and triggers.
+CREATE OR REPLACE FUNCTION pg_hier_create_tree(
+    tree_table TEXT,
+    id_keys TEXT,
+    parent_keys TEXT
+)
+RETURNS VOID AS
+$$
+DECLARE
+    new_id_key TEXT[] := string_to_array(id_keys, ':');
+    new_parent_key TEXT[] := string_to_array(parent_keys, ':');
+    old pg_hier_tree%ROWTYPE;
+BEGIN
+    IF array_length(new_id_key, 1) IS DISTINCT FROM array_length(new_parent_key, 1) THEN
+        RAISE EXCEPTION 'parent_keys must have the same number of columns as id_keys';
+    END IF;
+
+    SELECT * INTO old FROM pg_hier_tree WHERE table_name = tree_table FOR UPDATE;
+
+    INSERT INTO pg_hier_tree (table_name, id_key, parent_key)
+    VALUES (tree_table, new_id_key, new_parent_key)
+    ON CONFLICT (table_name) DO UPDATE
+    SET id_key = EXCLUDED.id_key, parent_key = EXCLUDED.parent_key;
+
+    IF old.closure AND (old.id_key IS DISTINCT FROM new_id_key OR
+                        old.parent_key IS DISTINCT FROM new_parent_key) THEN
+        PERFORM pg_hier_tree_index(tree_table);
+    END IF;
+
+    RAISE NOTICE 'Tree % created', tree_table;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION quote_ident(input text) 
+RETURNS text AS $$
+BEGIN
+  RETURN quote_ident(input);
+END;
+$$ LANGUAGE plpgsql IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION pg_hier_find_hier(
+    table_names TEXT[]
+)
+RETURNS INT AS $$
+DECLARE
+    hier_id INT;
+BEGIN
+    IF array_length(table_names, 1) IS NULL OR array_length(table_names, 1) < 2 THEN
+        RAISE EXCEPTION 'Table names must contain at least two elements';
+    END IF;
+    -- Exact membership through the GIN index, the first
+    -- table must be the shallowest, fewest levels wins
+    SELECT h.id INTO hier_id FROM pg_hier_header h
+    WHERE h.tables @> table_names
+      AND array_position(h.tables, table_names[1]) <= ALL (
+          SELECT array_position(h.tables, t) FROM unnest(table_names) AS t)
+    ORDER BY cardinality(h.tables), h.id
+    LIMIT 1;
+
+    RETURN hier_id;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION pg_hier_make_key_step(parent_keys text[], child_keys text[])
+RETURNS text[] AS $$
+BEGIN
+    IF parent_keys IS NULL OR array_length(parent_keys, 1) IS NULL THEN
+        RETURN '{[]}'::text[];
+    END IF;
+    RETURN ARRAY[
+        COALESCE(
+            to_json(
+                ARRAY(
+                    SELECT parent_keys[i]::text || ':' || child_keys[i]::text
+                    FROM generate_subscripts(parent_keys, 1) AS i
+                )
+            ), '[]'
+        )
+    ];
+END;
+$$ LANGUAGE plpgsql IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION pg_hier_drop_materialized(mat_name TEXT)
+RETURNS VOID AS $$
+DECLARE
+    trigger_tables TEXT[];
+BEGIN
+    SELECT tables INTO trigger_tables FROM pg_hier_materialized WHERE name = mat_name;
+    IF NOT FOUND THEN
+        RETURN;
+    END IF;
+    FOR i IN 1 .. coalesce(array_length(trigger_tables, 1), 0) LOOP
+        EXECUTE format('DROP TRIGGER IF EXISTS %I ON %s',
+                       'pg_hier_' || mat_name || '_' || i, trigger_tables[i]);
+        EXECUTE format('DROP TRIGGER IF EXISTS %I ON %s',
+                       'pg_hier_' || mat_name || '_' || i || '_truncate', trigger_tables[i]);
+    END LOOP;
+    -- Documents and dirty keys go with it
+    DELETE FROM pg_hier_materialized WHERE name = mat_name;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Primary key lookup of one materialized document
+CREATE OR REPLACE FUNCTION pg_hier_document(mat_name TEXT, key TEXT[])
+RETURNS JSONB AS $$
+    SELECT document FROM pg_hier_materialized_doc WHERE name = $1 AND root_key = $2;
+$$ LANGUAGE sql STABLE;
+
+CREATE OR REPLACE FUNCTION pg_hier_drop_tree(tree_table TEXT)
+RETURNS VOID AS $$
+BEGIN
+    IF EXISTS (SELECT 1 FROM pg_hier_tree WHERE table_name = tree_table AND closure) THEN
+        EXECUTE format('DROP TRIGGER IF EXISTS pg_hier_tree ON %s', tree_table);
+        EXECUTE format('DROP TRIGGER IF EXISTS pg_hier_tree_truncate ON %s', tree_table);
+    END IF;
+    -- Closure pairs go with it
+    DELETE FROM pg_hier_tree WHERE table_name = tree_table;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Ancestors of one node of an indexed tree, nearest first
+CREATE OR REPLACE FUNCTION pg_hier_ancestors(tree_table TEXT, key TEXT[])
+RETURNS TABLE (ancestor TEXT[], depth INT) AS $$
+    SELECT c.ancestor, c.depth FROM pg_hier_tree_closure c
+    WHERE c.table_name = $1 AND c.descendant = $2 AND c.depth > 0
+    ORDER BY c.depth;
+$$ LANGUAGE sql STABLE;
+
+-- Descendants of one node of an indexed tree
+CREATE OR REPLACE FUNCTION pg_hier_descendants(tree_table TEXT, key TEXT[])
+RETURNS TABLE (descendant TEXT[], depth INT) AS $$
+    SELECT c.descendant, c.depth FROM pg_hier_tree_closure c
+    WHERE c.table_name = $1 AND c.ancestor = $2 AND c.depth > 0;
+$$ LANGUAGE sql STABLE;
@@ -4,6 +4,99 @@
 PG_MODULE_MAGIC;
 #endif
 
+void _PG_init(void);
+
+/**************************************
+ * Module load, registers GUCs
+ **************************************/
+void
+_PG_init(void)
+{
+    DefineCustomIntVariable("pg_hier.plan_cache_size",
+                            "Maximum number of prepared hierarchy queries kept per backend.",
+                            "0 disables the plan cache.",
+                            &pg_hier_plan_cache_size,
+                            128, 0, INT_MAX,
+                            PGC_USERSET, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_hier.fetch_size",
+                            "Rows fetched per batch by the streaming pg_hier functions.",
+                            NULL,
+                            &pg_hier_fetch_size,
+                            100, 1, INT_MAX,
+                            PGC_USERSET, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomEnumVariable("pg_hier.executor",
+                             "Selects how pg_hier evaluates a hierarchy.",
+                             "sql runs the generated query, native scans each level once in C, "
+                             "batched runs one key-set query per level.",
+                             &pg_hier_executor,
+                             HIER_EXECUTOR_SQL,
+                             pg_hier_executor_options,
+                             PGC_USERSET, 0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_hier.tree_max_depth",
+                            "Deepest level nested for self-referential trees.",
+                            "Rows below it are left out, which also stops cycles.",
+                            &pg_hier_tree_max_depth,
+                            100, 1, INT_MAX,
+                            PGC_USERSET, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomEnumVariable("pg_hier.sql_shape",
+                             "Selects the shape of the generated hierarchy SQL.",
+                             "correlated runs a subquery per parent row, grouped aggregates "
+                             "each level once and joins it by key, auto picks from table statistics.",
+                             &pg_hier_sql_shape,
+                             HIER_SQL_SHAPE_CORRELATED,
+                             pg_hier_sql_shape_options,
+                             PGC_USERSET, 0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_hier.log_memory_usage",
+                             "Logs the peak memory of every pg_hier call.",
+                             NULL,
+                             &pg_hier_log_memory_usage,
+                             false,
+                             PGC_SUSET, 0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_hier.result_cache_size",
+                            "Shared memory for the cross-backend pg_hier result cache.",
+                            "Needs pg_hier in shared_preload_libraries, 0 disables the cache.",
+                            &pg_hier_result_cache_size,
+                            64, 0, MAX_KILOBYTES / 1024,
+                            PGC_POSTMASTER, GUC_UNIT_MB,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_hier.result_cache",
+                             "Serves pg_hier results from the shared result cache.",
+                             NULL,
+                             &pg_hier_result_cache,
+                             false,
+                             PGC_USERSET, 0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_hier.shared_catalog",
+                             "Keeps one compiled hierarchy catalog per database in shared memory.",
+                             "Needs pg_hier in shared_preload_libraries.",
+                             &pg_hier_shared_catalog,
+                             true,
+                             PGC_POSTMASTER, 0,
+                             NULL, NULL, NULL);
+
+    if (process_shared_preload_libraries_in_progress)
+    {
+        pg_hier_result_cache_init();
+        pg_hier_catalog_shmem_init();
+    }
+
+    MarkGUCPrefixReserved("pg_hier");
+}
+
 PG_FUNCTION_INFO_V1(pg_hier);
 /**************************************
  * function pg_hier builds and
@@ -12,10 +105,26 @@ PG_FUNCTION_INFO_V1(pg_hier);
  * Relies on pg_hier_parse
  * and pg_hier_join.
  *
+ * Extra arguments are bound to the
+ * $1..$n placeholders of the DSL.
+ *
+ * A DSL naming one table registered by
+ * pg_hier_create_tree nests that table
+ * into itself.
+ *
+ * With pg_hier preloaded, results are
+ * shared between backends until a
+ * table they read changes.
+ *
  * CREATE FUNCTION pg_hier(text)
- * RETURNS text
+ * RETURNS jsonb
  * AS 'MODULE_PATHNAME', 'pg_hier'
  * LANGUAGE C STRICT;
+ *
+ * CREATE FUNCTION pg_hier(text, VARIADIC "any")
+ * RETURNS jsonb
+ * AS 'MODULE_PATHNAME', 'pg_hier'
+ * LANGUAGE C;
  ****************************/
 Datum 
 pg_hier(PG_FUNCTION_ARGS)
@@ -23,41 +132,282 @@ pg_hier(PG_FUNCTION_ARGS)
     if (PG_ARGISNULL(0))
         PG_RETURN_NULL();
     
-    text *input_text = PG_GETARG_TEXT_PP(0);
-    char *input = text_to_cstring(input_text);
-    StringInfoData parse_buf;
-    initStringInfo(&parse_buf);
-    string_array *tables = NULL;
-    Datum result = (Datum) NULL;
-    
-    appendStringInfoString(&parse_buf, "SELECT ");
-    parse_input(&parse_buf, input, &tables);
+    hier_call_arena arena;
+    pg_hier_arena_begin(&arena, "pg_hier");
+
+    char *input = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    hier_params *params = create_hier_params(fcinfo, 1);
+    hier_rc_probe probe;
+    Datum result;
+    bool is_null;
     
-    if (tables == NULL || tables->size < 2)
+    if (!pg_hier_result_cache_get(&probe, input, params, &result, &is_null))
     {
-        if (tables == NULL)
-        {
-            pfree(input);
-            pfree(parse_buf.data);
-            ereport(ERROR, (errmsg("No tables found in input string.")));
-        }
-        else
+        // A cached result must not predate its stamps
+        if (probe.usable)
+            PushActiveSnapshot(GetTransactionSnapshot());
+
+        // The native executor falls back to SQL
+        // for anything it cannot run directly,
+        // single-table trees are always nested in C
+        if (!pg_hier_exec_tree(input, params, &result, &is_null) &&
+            !(pg_hier_executor == HIER_EXECUTOR_NATIVE && params->nargs == 0 &&
+              pg_hier_exec_native(input, &result, &is_null)) &&
+            !(pg_hier_executor == HIER_EXECUTOR_BATCHED &&
+              pg_hier_exec_batched(input, params, &result, &is_null)))
+            result = pg_hier_return_one(input, params, &is_null);
+
+        if (probe.usable)
+            PopActiveSnapshot();
+        pg_hier_result_cache_put(&probe, result, is_null);
+    }
+
+    result = pg_hier_arena_end(&arena, result, is_null);
+    if (is_null)
+        PG_RETURN_NULL();
+    PG_RETURN_DATUM(result);
+}
+
+PG_FUNCTION_INFO_V1(pg_hier_rows);
+/**************************************
+ * function pg_hier_rows streams one
+ * document per root row. Rows are read
+ * from a cursor in pg_hier.fetch_size
+ * batches into the result tuplestore,
+ * which spills to disk past work_mem.
+ *
+ * CREATE FUNCTION pg_hier_rows(text)
+ * RETURNS SETOF jsonb
+ * AS 'MODULE_PATHNAME', 'pg_hier_rows'
+ * LANGUAGE C STRICT;
+ *
+ * CREATE FUNCTION pg_hier_rows(text, VARIADIC "any")
+ * RETURNS SETOF jsonb
+ * AS 'MODULE_PATHNAME', 'pg_hier_rows'
+ * LANGUAGE C;
+ **************************************/
+Datum
+pg_hier_rows(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    hier_call_arena arena;
+    char *input;
+    hier_params *params;
+    SPIPlanPtr plan;
+    Portal portal;
+    int ret;
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    if (PG_ARGISNULL(0))
+        return (Datum) 0;
+
+    // The tuplestore lives in the per-query context,
+    // only the working memory goes in the arena
+    pg_hier_arena_begin(&arena, "pg_hier_rows");
+    input = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    params = create_hier_params(fcinfo, 1);
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    plan = pg_hier_plan_get(input, params, HIER_OUTPUT_ROWS);
+    portal = SPI_cursor_open(NULL, plan, params->values, params->nulls, true);
+
+    for (;;)
+    {
+        SPI_cursor_fetch(portal, true, pg_hier_fetch_size);
+        if (SPI_processed == 0)
+            break;
+
+        for (uint64 i = 0; i < SPI_processed; i++)
         {
-            pfree(input);
-            pfree(parse_buf.data);
-            free_string_array(tables);
-            ereport(ERROR, (errmsg("At least two tables are needed for hierarchical query.")));
+            bool isnull;
+            Datum val = SPI_getbinval(SPI_tuptable->vals[i],
+                                      SPI_tuptable->tupdesc, 1, &isnull);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+                                 &val, &isnull);
         }
+        SPI_freetuptable(SPI_tuptable);
     }
-    
-    free_string_array(tables);
-    pfree(input);
-    
-    result = pg_hier_return_one(parse_buf.data);
 
-    pfree(parse_buf.data);
-    
-    PG_RETURN_DATUM(result);
+    SPI_cursor_close(portal);
+    pg_hier_arena_sample();
+    SPI_finish();
+
+    return pg_hier_arena_end(&arena, (Datum) 0, true);
+}
+
+PG_FUNCTION_INFO_V1(pg_hier_binary);
+/**************************************
+ * function pg_hier_binary returns the
+ * root documents as one MessagePack
+ * array, optionally in an LZ4 frame.
+ * Rows are encoded as they are fetched,
+ * no jsonb array or JSON text is built.
+ *
+ * CREATE FUNCTION pg_hier_binary(text, lz4 boolean DEFAULT false)
+ * RETURNS bytea
+ * AS 'MODULE_PATHNAME', 'pg_hier_binary'
+ * LANGUAGE C STRICT;
+ **************************************/
+Datum
+pg_hier_binary(PG_FUNCTION_ARGS)
+{
+    hier_call_arena arena;
+    char *input;
+    hier_params *params;
+    bytea *result;
+
+    pg_hier_arena_begin(&arena, "pg_hier_binary");
+    input = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    params = create_hier_params(fcinfo, 2);
+    result = pg_hier_binary_encode(input, params, PG_GETARG_BOOL(1));
+
+    PG_RETURN_DATUM(pg_hier_arena_end(&arena, PointerGetDatum(result), false));
+}
+
+PG_FUNCTION_INFO_V1(pg_hier_columnar);
+/**************************************
+ * function pg_hier_columnar returns the
+ * hierarchy as one typed value array
+ * per column and level, rows linked to
+ * their parent by position. Levels are
+ * fetched as the batched executor does.
+ *
+ * CREATE FUNCTION pg_hier_columnar(text)
+ * RETURNS jsonb
+ * AS 'MODULE_PATHNAME', 'pg_hier_columnar'
+ * LANGUAGE C STRICT;
+ *
+ * CREATE FUNCTION pg_hier_columnar(text, VARIADIC "any")
+ * RETURNS jsonb
+ * AS 'MODULE_PATHNAME', 'pg_hier_columnar'
+ * LANGUAGE C;
+ **************************************/
+Datum
+pg_hier_columnar(PG_FUNCTION_ARGS)
+{
+    hier_call_arena arena;
+    char *input;
+    hier_params *params;
+    Datum result;
+
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+
+    pg_hier_arena_begin(&arena, "pg_hier_columnar");
+    input = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    params = create_hier_params(fcinfo, 1);
+    result = pg_hier_exec_columnar(input, params);
+
+    PG_RETURN_DATUM(pg_hier_arena_end(&arena, result, false));
+}
+
+PG_FUNCTION_INFO_V1(pg_hier_export);
+/**************************************
+ * function pg_hier_export writes every
+ * root document to a server file as
+ * ndjson or flattened csv, streaming
+ * from a cursor. Returns the documents
+ * written.
+ *
+ * CREATE FUNCTION pg_hier_export(text, format text, target text)
+ * RETURNS bigint
+ * AS 'MODULE_PATHNAME', 'pg_hier_export'
+ * LANGUAGE C STRICT;
+ **************************************/
+Datum
+pg_hier_export(PG_FUNCTION_ARGS)
+{
+    hier_call_arena arena;
+    char *input;
+    hier_export_format format;
+    int64 count;
+
+    pg_hier_arena_begin(&arena, "pg_hier_export");
+    input = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    format = pg_hier_export_format(text_to_cstring(PG_GETARG_TEXT_PP(1)));
+    count = pg_hier_export_file(input, format, text_to_cstring(PG_GETARG_TEXT_PP(2)));
+
+    pg_hier_arena_end(&arena, (Datum) 0, true);
+    PG_RETURN_INT64(count);
+}
+
+PG_FUNCTION_INFO_V1(pg_hier_export_rows);
+/**************************************
+ * function pg_hier_export_rows returns
+ * the export one line per row, for
+ * COPY (SELECT ..) TO STDOUT. csv
+ * starts with the header line.
+ *
+ * CREATE FUNCTION pg_hier_export_rows(text, format text)
+ * RETURNS SETOF text
+ * AS 'MODULE_PATHNAME', 'pg_hier_export_rows'
+ * LANGUAGE C STRICT;
+ **************************************/
+Datum
+pg_hier_export_rows(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    hier_call_arena arena;
+    hier_export_format format;
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    pg_hier_arena_begin(&arena, "pg_hier_export_rows");
+    format = pg_hier_export_format(text_to_cstring(PG_GETARG_TEXT_PP(1)));
+    pg_hier_export_store(text_to_cstring(PG_GETARG_TEXT_PP(0)), format, rsinfo);
+
+    return pg_hier_arena_end(&arena, (Datum) 0, true);
+}
+
+PG_FUNCTION_INFO_V1(pg_hier_page);
+/**************************************
+ * function pg_hier_page returns one
+ * page of root documents in primary
+ * key order and the token for the next
+ * page, NULL after the last one. Pass
+ * NULL as the token for the first page.
+ * Cost follows page_size, not the
+ * depth of the page.
+ *
+ * CREATE FUNCTION pg_hier_page(text, bigint, text DEFAULT NULL,
+ *                              OUT documents jsonb, OUT next_token text)
+ * AS 'MODULE_PATHNAME', 'pg_hier_page'
+ * LANGUAGE C;
+ **************************************/
+Datum
+pg_hier_page(PG_FUNCTION_ARGS)
+{
+    hier_call_arena arena;
+    TupleDesc tupdesc;
+    Datum values[2];
+    bool nulls[2] = {false, false};
+    char *input;
+    char *token;
+    char *next_token;
+
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+        PG_RETURN_NULL();
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "pg_hier_page: return type must be a row type");
+
+    pg_hier_arena_begin(&arena, "pg_hier_page");
+    input = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    token = PG_ARGISNULL(2) ? NULL : text_to_cstring(PG_GETARG_TEXT_PP(2));
+
+    pg_hier_page_fetch(input, PG_GETARG_INT64(1), token, &values[0], &next_token);
+    if (next_token != NULL)
+        values[1] = PointerGetDatum(cstring_to_text(next_token));
+    else
+        nulls[1] = true;
+
+    tupdesc = BlessTupleDesc(tupdesc);
+    PG_RETURN_DATUM(pg_hier_arena_end(&arena,
+                                      HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)),
+                                      false));
 }
 
 PG_FUNCTION_INFO_V1(pg_hier_parse);
@@ -72,40 +422,27 @@ Datum pg_hier_parse(PG_FUNCTION_ARGS)
     if (PG_ARGISNULL(0))
         PG_RETURN_NULL();
 
-    text *input_text = PG_GETARG_TEXT_PP(0);
-    char *input = text_to_cstring(input_text);
+    hier_call_arena arena;
+    pg_hier_arena_begin(&arena, "pg_hier_parse");
+
+    char *input = text_to_cstring(PG_GETARG_TEXT_PP(0));
     StringInfoData parse_buf;
     initStringInfo(&parse_buf);
 
-    string_array *tables = NULL;
-
-    appendStringInfoString(&parse_buf, "SELECT ");
-    parse_input(&parse_buf, input, &tables);
-
-    if (tables == NULL || tables->size < 2)
-    {
-        if (tables == NULL)
-        {
-            pfree(input);
-            pfree(parse_buf.data);
-            ereport(ERROR, (errmsg("No tables found in input string.")));
-        }
-        else
-        {
-            pfree(input);
-            pfree(parse_buf.data);
-            free_string_array(tables);
-            ereport(ERROR, (errmsg("At least two tables are needed for hierarchical query.")));
-        }
-    }
-    free_string_array(tables);
-    pfree(input);
+    pg_hier_build_sql(&parse_buf, input, HIER_OUTPUT_AGGREGATE);
 
-    PG_RETURN_TEXT_P(cstring_to_text(parse_buf.data));
+    PG_RETURN_DATUM(pg_hier_arena_end(&arena,
+                                      PointerGetDatum(cstring_to_text(parse_buf.data)),
+                                      false));
 }
 
 PG_FUNCTION_INFO_V1(pg_hier_join);
 /**************************************
+ * Returns the FROM/JOIN clause linking
+ * parent down to child. The path comes
+ * from the backend's join-path graph
+ * and may cross hierarchies.
+ *
  * CREATE FUNCTION pg_hier_join(TEXT, TEXT)
  * RETURNS text
  * AS 'MODULE_PATHNAME', 'pg_hier_join'
@@ -113,245 +450,222 @@ PG_FUNCTION_INFO_V1(pg_hier_join);
  **************************************/
 Datum pg_hier_join(PG_FUNCTION_ARGS)
 {
-    bool isnull;
-
-    text *parent_name_text = PG_GETARG_TEXT_PP(0);
-    text *child_name_text = PG_GETARG_TEXT_PP(1);
+    hier_call_arena arena;
+    pg_hier_arena_begin(&arena, "pg_hier_join");
 
-    char *parent_name = text_to_cstring(parent_name_text);
-    char *child_name = text_to_cstring(child_name_text);
+    char *parent_name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    char *child_name = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    hier_path *path = pg_hier_catalog_route(parent_name, child_name);
+    StringInfoData join_sql;
 
-    Datum *name_path_elems;
-    bool *name_path_nulls;
-    int name_path_count;
+    if (path->nhops == 0)
+        elog(ERROR, "No path found from %s to %s", parent_name, child_name);
 
-    Datum *key_path_elems;
-    bool *key_path_nulls;
-    int key_path_count;
+    initStringInfo(&join_sql);
+    appendStringInfo(&join_sql, "FROM %s", parent_name);
 
-    char *parent_table = NULL;
-    char *join_table = NULL;
-    char *key_json = NULL;
-    char *key_array = NULL;
-    char *end_array = NULL;
-    int key_idx;
+    // Hops run child upwards, join top down
+    for (int i = path->nhops - 1; i >= 0; i--)
+        appendStringInfo(&join_sql, " JOIN %s ON %s", path->hops[i].name,
+                         path->hops[i].join_clause ? path->hops[i].join_clause : "true");
 
-    char *saveptr = NULL;
+    PG_RETURN_DATUM(pg_hier_arena_end(&arena,
+                                      PointerGetDatum(cstring_to_text(join_sql.data)),
+                                      false));
+}
 
-    StringInfoData join_sql;
-    initStringInfo(&join_sql);
+PG_FUNCTION_INFO_V1(pg_hier_format);
+/**************************************
+ * function pg_hier_format runs a query
+ * and returns its rows as a jsonb array
+ * of objects keyed by column name, the
+ * values typed as to_jsonb types them.
+ * Rows are read from a cursor in
+ * pg_hier.fetch_size batches.
+ *
+ * CREATE FUNCTION pg_hier_format(TEXT)
+ * RETURNS jsonb
+ * AS 'MODULE_PATHNAME', 'pg_hier_format'
+ * LANGUAGE C STRICT;
+ **************************************/
+Datum
+pg_hier_format(PG_FUNCTION_ARGS)
+{
+    hier_call_arena arena;
+    Jsonb *result;
 
-    int ret = SPI_connect();
-    if (ret != SPI_OK_CONNECT)
-        elog(ERROR, "SPI_connect failed: %d", ret);
+    pg_hier_arena_begin(&arena, "pg_hier_format");
+    result = pg_hier_format_array(text_to_cstring(PG_GETARG_TEXT_PP(0)));
 
-    const char *fetch_hier =
-        "WITH RECURSIVE path AS ( "
-        "    SELECT "
-        "        id, name, parent_id, child_id, parent_key, child_key, "
-        "        ARRAY[name] AS name_path, "
-        "        COALESCE(pg_hier_make_key_step(parent_key, child_key), '{[]}') AS key_path, "
-        "        pg_typeof(pg_hier_make_key_step(parent_key, child_key)) AS ty1, "
-        "        pg_typeof('') AS ty2 "
-        "    FROM pg_hier_detail "
-        "    WHERE name = $1 "
-        "    UNION ALL "
-        "    SELECT "
-        "        h.id, h.name, h.parent_id, h.child_id, h.parent_key, h.child_key, "
-        "        p.name_path || h.name, "
-        "        p.key_path || pg_hier_make_key_step(h.parent_key, h.child_key), "
-        "        pg_typeof(pg_hier_make_key_step(h.parent_key, h.child_key)), "
-        "        pg_typeof(p.key_path) "
-        "    FROM pg_hier_detail h "
-        "    JOIN path p ON h.parent_id = p.id "
-        ") "
-        "SELECT name_path, key_path "
-        "FROM path "
-        "WHERE name = $2;";
-
-    Oid argtypes[2] = {TEXTOID, TEXTOID};
-    Datum values[2] = {PointerGetDatum(parent_name_text), PointerGetDatum(child_name_text)};
-    ret = SPI_execute_with_args(fetch_hier, 2, argtypes, values, NULL, true, 0);
-    if (ret != SPI_OK_SELECT)
-    {
-        SPI_finish();
-        elog(ERROR, "SPI_execute_with_args failed: %d", ret);
-    }
+    PG_RETURN_DATUM(pg_hier_arena_end(&arena, JsonbPGetDatum(result), false));
+}
 
-    if (SPI_processed == 0)
-    {
-        SPI_finish();
-        elog(ERROR, "No path found from %s to %s", parent_name, child_name);
-    }
+PG_FUNCTION_INFO_V1(pg_hier_format_rows);
+/**************************************
+ * function pg_hier_format_rows streams
+ * the rows of a query as one jsonb
+ * object each, in bounded memory
+ * whatever the size of the result.
+ *
+ * CREATE FUNCTION pg_hier_format_rows(TEXT)
+ * RETURNS SETOF jsonb
+ * AS 'MODULE_PATHNAME', 'pg_hier_format_rows'
+ * LANGUAGE C STRICT;
+ **************************************/
+Datum
+pg_hier_format_rows(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    hier_call_arena arena;
 
-    HeapTuple tuple = SPI_tuptable->vals[0];
-    TupleDesc tupdesc = SPI_tuptable->tupdesc;
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
 
-    Datum name_path_datum = SPI_getbinval(tuple, tupdesc, 1, &isnull);
-    Datum key_path_datum = SPI_getbinval(tuple, tupdesc, 2, &isnull);
+    pg_hier_arena_begin(&arena, "pg_hier_format_rows");
+    pg_hier_format_store(text_to_cstring(PG_GETARG_TEXT_PP(0)), rsinfo);
 
-    ArrayType *name_path_arr = DatumGetArrayTypeP(name_path_datum);
-    ArrayType *key_path_arr = DatumGetArrayTypeP(key_path_datum);
+    return pg_hier_arena_end(&arena, (Datum) 0, true);
+}
 
-    int name_path_len = ArrayGetNItems(ARR_NDIM(name_path_arr), ARR_DIMS(name_path_arr));
-    int key_path_len = ArrayGetNItems(ARR_NDIM(key_path_arr), ARR_DIMS(key_path_arr));
+PG_FUNCTION_INFO_V1(pg_hier_catalog_changed);
+/**************************************
+ * Statement trigger on pg_hier_header
+ * and pg_hier_detail. Queues a relcache
+ * invalidation so every backend drops
+ * its compiled catalog at commit, and
+ * bumps the shared catalog version.
+ *
+ * CREATE FUNCTION pg_hier_catalog_changed()
+ * RETURNS trigger
+ * AS 'MODULE_PATHNAME', 'pg_hier_catalog_changed'
+ * LANGUAGE C;
+ **************************************/
+Datum pg_hier_catalog_changed(PG_FUNCTION_ARGS)
+{
+    TriggerData *trigdata = (TriggerData *) fcinfo->context;
 
-    if (name_path_len < 2)
-    {
-        SPI_finish();
-        elog(ERROR, "No path found from %s to %s", parent_name, child_name);
-    }
+    if (!CALLED_AS_TRIGGER(fcinfo))
+        elog(ERROR, "pg_hier_catalog_changed: not called by trigger manager");
 
-    deconstruct_array(name_path_arr, TEXTOID, -1, false, 'i',
-                      &name_path_elems, &name_path_nulls, &name_path_count);
+    CacheInvalidateRelcache(trigdata->tg_relation);
+    pg_hier_catalog_bump();
 
-    deconstruct_array(key_path_arr, TEXTOID, -1, false, 'i',
-                      &key_path_elems, &key_path_nulls, &key_path_count);
+    return PointerGetDatum(NULL);
+}
 
-    resetStringInfo(&join_sql);
-    appendStringInfo(&join_sql, "FROM %s", TextDatumGetCString(name_path_elems[0]));
+PG_FUNCTION_INFO_V1(pg_hier_materialize);
+/**************************************
+ * Stores one document per root key of
+ * the DSL in pg_hier_materialized_doc
+ * and keeps track of the roots changed
+ * since. Returns the documents built.
+ *
+ * CREATE FUNCTION pg_hier_materialize(TEXT, TEXT)
+ * RETURNS bigint
+ * AS 'MODULE_PATHNAME', 'pg_hier_materialize'
+ * LANGUAGE C STRICT;
+ **************************************/
+Datum pg_hier_materialize(PG_FUNCTION_ARGS)
+{
+    hier_call_arena arena;
+    pg_hier_arena_begin(&arena, "pg_hier_materialize");
 
-    for (int i = 1; i < name_path_count; i++)
-    {
-        parent_table = pstrdup(TextDatumGetCString(name_path_elems[i - 1]));
-        join_table = pstrdup(TextDatumGetCString(name_path_elems[i]));
-        key_json = TextDatumGetCString(key_path_elems[i]);
-        key_array = key_json;
-        while (*key_array && (*key_array == '[' || *key_array == ' '))
-            key_array++;
-
-        end_array = key_array + strlen(key_array) - 1;
-        while (end_array > key_array && (*end_array == ']' || *end_array == ' '))
-        {
-            *end_array = '\0';
-            end_array--;
-        }
+    char *name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    char *dsl = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    int64 count = pg_hier_materialize_create(name, dsl);
 
-        char *pair = strtok_r(key_array, ",", &saveptr);
-        appendStringInfo(&join_sql, " JOIN %s ON ", join_table);
-        key_idx = 0;
-        while (pair)
-        {
-            while (*pair && (*pair == '"' || *pair == ' '))
-                pair++;
-
-            char *end_quote = strchr(pair, '"');
-            if (end_quote)
-                *end_quote = '\0';
-
-            char *colon = strchr(pair, ':');
-            if (!colon)
-            {
-                SPI_finish();
-                elog(ERROR, "Invalid key format: %s", pair);
-            }
-            *colon = '\0';
-            char *left_key = pair;
-            char *right_key = colon + 1;
-
-            if (key_idx > 0)
-                appendStringInfoString(&join_sql, " AND ");
-
-            elog(INFO, "Current table check 2: %s",
-                 TextDatumGetCString(name_path_elems[i]));
-
-            appendStringInfo(&join_sql, "%s.%s = %s.%s",
-                             parent_table, left_key,
-                             join_table, right_key);
-
-            key_idx++;
-            pair = strtok_r(NULL, ",", &saveptr);
-        }
-    }
-    SPI_finish();
-    PG_RETURN_TEXT_P(cstring_to_text(join_sql.data));
+    pg_hier_arena_end(&arena, (Datum) 0, true);
+    PG_RETURN_INT64(count);
 }
 
-PG_FUNCTION_INFO_V1(pg_hier_format);
-
+PG_FUNCTION_INFO_V1(pg_hier_refresh);
 /**************************************
- * CREATE FUNCTION pg_hier_format(TEXT)
- * RETURNS text
- * AS 'MODULE_PATHNAME', 'pg_hier_format'
+ * Rebuilds only the documents whose
+ * roots were touched since the last
+ * refresh. Returns the documents built.
+ *
+ * CREATE FUNCTION pg_hier_refresh(TEXT)
+ * RETURNS bigint
+ * AS 'MODULE_PATHNAME', 'pg_hier_refresh'
  * LANGUAGE C STRICT;
  **************************************/
-Datum pg_hier_format(PG_FUNCTION_ARGS)
+Datum pg_hier_refresh(PG_FUNCTION_ARGS)
 {
-    if (PG_ARGISNULL(0))
-        PG_RETURN_NULL();
+    hier_call_arena arena;
+    pg_hier_arena_begin(&arena, "pg_hier_refresh");
 
-    text *sql = PG_GETARG_TEXT_PP(0);
-    char *query = text_to_cstring(sql);
+    char *name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    int64 count = pg_hier_materialize_refresh(name);
 
-    StringInfoData buf;
-    initStringInfo(&buf);
-    appendStringInfoChar(&buf, '{');
+    pg_hier_arena_end(&arena, (Datum) 0, true);
+    PG_RETURN_INT64(count);
+}
 
-    int ret = SPI_connect();
-    if (ret != SPI_OK_CONNECT)
-        elog(ERROR, "SPI_connect failed: %d", ret);
+PG_FUNCTION_INFO_V1(pg_hier_materialized_changed);
+/**************************************
+ * Row and TRUNCATE trigger installed by
+ * pg_hier_materialize on the tables a
+ * materialized hierarchy reads.
+ *
+ * CREATE FUNCTION pg_hier_materialized_changed()
+ * RETURNS trigger
+ * AS 'MODULE_PATHNAME', 'pg_hier_materialized_changed'
+ * LANGUAGE C;
+ **************************************/
+Datum pg_hier_materialized_changed(PG_FUNCTION_ARGS)
+{
+    TriggerData *trigdata = (TriggerData *) fcinfo->context;
 
-    ret = SPI_execute(query, true, 0);
-    if (ret != SPI_OK_SELECT)
-    {
-        SPI_finish();
-        elog(ERROR, "SPI_execute failed: %d", ret);
-    }
+    if (!CALLED_AS_TRIGGER(fcinfo))
+        elog(ERROR, "pg_hier_materialized_changed: not called by trigger manager");
 
-    /*
-        appendStringInfoString(&buf, "\"header\": { ");
-        for (int col = 0; col < SPI_tuptable->tupdesc->natts; col++)
-        {
-            if (col > 0)
-                appendStringInfoString(&buf, ", ");
-            const char *colname = SPI_tuptable->tupdesc->attrs[col].attname.data;
-            Oid typid = SPI_gettypeid(SPI_tuptable->tupdesc, col + 1);
+    pg_hier_materialize_mark(trigdata);
 
-            // Get type name
-            char *typename = format_type_be(typid);
+    return PointerGetDatum(NULL);
+}
 
-            appendStringInfo(&buf, "\"%s\": \"%s\"", colname, typename);
-        }
-        appendStringInfoString(&buf, " }, ");
-    */
+PG_FUNCTION_INFO_V1(pg_hier_tree_index);
+/**************************************
+ * Builds the closure index of a tree
+ * registered by pg_hier_create_tree
+ * and keeps it up to date from then
+ * on. Returns the pairs stored.
+ *
+ * CREATE FUNCTION pg_hier_tree_index(TEXT)
+ * RETURNS bigint
+ * AS 'MODULE_PATHNAME', 'pg_hier_tree_index'
+ * LANGUAGE C STRICT;
+ **************************************/
+Datum pg_hier_tree_index(PG_FUNCTION_ARGS)
+{
+    hier_call_arena arena;
+    pg_hier_arena_begin(&arena, "pg_hier_tree_index");
 
-    for (uint64 rowno = 0; rowno < SPI_processed; rowno++)
-    {
-        if (rowno > 0)
-            appendStringInfoString(&buf, ",\n");
+    char *table = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    int64 count = pg_hier_tree_build(table);
 
-        appendStringInfo(&buf, "\"row%llu\": { ", (unsigned long long)(rowno + 1));
+    pg_hier_arena_end(&arena, (Datum) 0, true);
+    PG_RETURN_INT64(count);
+}
 
-        for (int col = 0; col < SPI_tuptable->tupdesc->natts; col++)
-        {
-            if (col > 0)
-                appendStringInfoString(&buf, ", ");
+PG_FUNCTION_INFO_V1(pg_hier_tree_changed);
+/**************************************
+ * Row and TRUNCATE trigger installed by
+ * pg_hier_tree_index on an indexed
+ * tree.
+ *
+ * CREATE FUNCTION pg_hier_tree_changed()
+ * RETURNS trigger
+ * AS 'MODULE_PATHNAME', 'pg_hier_tree_changed'
+ * LANGUAGE C;
+ **************************************/
+Datum pg_hier_tree_changed(PG_FUNCTION_ARGS)
+{
+    TriggerData *trigdata = (TriggerData *) fcinfo->context;
 
-            bool isnull;
-            Datum val = SPI_getbinval(SPI_tuptable->vals[rowno],
-                                      SPI_tuptable->tupdesc, col + 1, &isnull);
-
-            const char *colname = SPI_tuptable->tupdesc->attrs[col].attname.data;
-
-            if (isnull)
-            {
-                appendStringInfo(&buf, "\"%s\": NULL", colname);
-            }
-            else
-            {
-                Oid typid = SPI_gettypeid(SPI_tuptable->tupdesc, col + 1);
-                Oid outFuncOid;
-                bool isVarlen;
-                getTypeOutputInfo(typid, &outFuncOid, &isVarlen);
-
-                char *outstr = OidOutputFunctionCall(outFuncOid, val);
-                appendStringInfo(&buf, "\"%s\": \"%s\"", colname, outstr);
-            }
-        }
-        appendStringInfoString(&buf, " }");
-    }
+    if (!CALLED_AS_TRIGGER(fcinfo))
+        elog(ERROR, "pg_hier_tree_changed: not called by trigger manager");
 
-    appendStringInfoChar(&buf, '}');
-    SPI_finish();
-    PG_RETURN_TEXT_P(cstring_to_text(buf.data));
+    pg_hier_tree_mark(trigdata);
+
+    return PointerGetDatum(NULL);
 }
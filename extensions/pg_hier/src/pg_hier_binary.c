@@ -0,0 +1,281 @@
+#include "pg_hier_binary.h"
+#include "pg_hier_helper.h"
+
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+
+static void mp_byte(StringInfo buf, uint8 b);
+static void mp_be(StringInfo buf, uint64 value, int nbytes);
+static void mp_header(StringInfo buf, uint32 n, uint8 fix, uint8 fix_max, uint8 op16);
+static void mp_int(StringInfo buf, int64 value);
+static void mp_str(StringInfo buf, const char *str, int len);
+static void mp_numeric(StringInfo buf, Numeric num);
+static void mp_scalar(StringInfo buf, JsonbValue *v);
+static void mp_jsonb(StringInfo buf, Jsonb *jb);
+static bytea *lz4_frame(StringInfo raw);
+
+/**************************************
+ * MessagePack writers, big endian
+ **************************************/
+static void
+mp_byte(StringInfo buf, uint8 b)
+{
+    appendStringInfoCharMacro(buf, (char) b);
+}
+
+static void
+mp_be(StringInfo buf, uint64 value, int nbytes)
+{
+    for (int i = nbytes - 1; i >= 0; i--)
+        mp_byte(buf, (uint8) (value >> (i * 8)));
+}
+
+// fix form up to fix_max, then the 16 and 32 bit forms at op16, op16 + 1
+static void
+mp_header(StringInfo buf, uint32 n, uint8 fix, uint8 fix_max, uint8 op16)
+{
+    if (n <= fix_max)
+        mp_byte(buf, fix | (uint8) n);
+    else if (n <= PG_UINT16_MAX)
+    {
+        mp_byte(buf, op16);
+        mp_be(buf, n, 2);
+    }
+    else
+    {
+        mp_byte(buf, op16 + 1);
+        mp_be(buf, n, 4);
+    }
+}
+
+static void
+mp_int(StringInfo buf, int64 value)
+{
+    if (value >= 0 && value <= 0x7f)
+        mp_byte(buf, (uint8) value);
+    else if (value < 0 && value >= -32)
+        mp_byte(buf, (uint8) (int8) value);
+    else if (value >= PG_INT32_MIN && value <= PG_INT32_MAX)
+    {
+        mp_byte(buf, 0xd2);
+        mp_be(buf, (uint32) (int32) value, 4);
+    }
+    else
+    {
+        mp_byte(buf, 0xd3);
+        mp_be(buf, (uint64) value, 8);
+    }
+}
+
+static void
+mp_str(StringInfo buf, const char *str, int len)
+{
+    if (len <= 31)
+        mp_byte(buf, 0xa0 | (uint8) len);
+    else if (len <= PG_UINT8_MAX)
+    {
+        mp_byte(buf, 0xd9);
+        mp_byte(buf, (uint8) len);
+    }
+    else
+        mp_header(buf, len, 0xa0, 31, 0xda);
+    appendBinaryStringInfo(buf, str, len);
+}
+
+/**************************************
+ * Integral numbers that fit an int64
+ * become ints, others float64 when the
+ * double reads back as the same value.
+ * Anything float64 would round, such as
+ * NUMERIC(38,10) amounts or integers
+ * past int64, is sent as its decimal
+ * string.
+ **************************************/
+static void
+mp_numeric(StringInfo buf, Numeric num)
+{
+    char *text = DatumGetCString(DirectFunctionCall1(numeric_out, NumericGetDatum(num)));
+    const char *digits = text[0] == '-' ? text + 1 : text;
+    char shortest[DOUBLE_SHORTEST_DECIMAL_LEN];
+    Datum back;
+    union
+    {
+        float8 f;
+        uint64 i;
+    } swap;
+
+    if (strspn(digits, "0123456789") == strlen(digits))
+    {
+        int64 value;
+
+        errno = 0;
+        value = strtoi64(text, NULL, 10);
+        if (errno == 0)
+        {
+            mp_int(buf, value);
+            return;
+        }
+    }
+
+    swap.f = DatumGetFloat8(DirectFunctionCall1(numeric_float8, NumericGetDatum(num)));
+    double_to_shortest_decimal_buf(swap.f, shortest);
+    back = DirectFunctionCall3(numeric_in, CStringGetDatum(shortest),
+                               ObjectIdGetDatum(InvalidOid), Int32GetDatum(-1));
+    if (!DatumGetBool(DirectFunctionCall2(numeric_eq, NumericGetDatum(num), back)))
+    {
+        mp_str(buf, text, strlen(text));
+        return;
+    }
+
+    mp_byte(buf, 0xcb);
+    mp_be(buf, swap.i, 8);
+}
+
+static void
+mp_scalar(StringInfo buf, JsonbValue *v)
+{
+    switch (v->type)
+    {
+    case jbvNull:
+        mp_byte(buf, 0xc0);
+        break;
+    case jbvBool:
+        mp_byte(buf, v->val.boolean ? 0xc3 : 0xc2);
+        break;
+    case jbvString:
+        mp_str(buf, v->val.string.val, v->val.string.len);
+        break;
+    case jbvNumeric:
+        mp_numeric(buf, v->val.numeric);
+        break;
+    default:
+        elog(ERROR, "unexpected jsonb value type: %d", (int) v->type);
+    }
+}
+
+/**************************************
+ * Walks the jsonb container in place,
+ * the iterator reports array and object
+ * sizes up front so headers need no
+ * back-patching.
+ **************************************/
+static void
+mp_jsonb(StringInfo buf, Jsonb *jb)
+{
+    JsonbIterator *it = JsonbIteratorInit(&jb->root);
+    JsonbIteratorToken token;
+    JsonbValue v;
+
+    while ((token = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
+    {
+        switch (token)
+        {
+        case WJB_BEGIN_ARRAY:
+            // A bare scalar is stored as a one element raw array
+            if (!v.val.array.rawScalar)
+                mp_header(buf, v.val.array.nElems, 0x90, 15, 0xdc);
+            break;
+        case WJB_BEGIN_OBJECT:
+            mp_header(buf, v.val.object.nPairs, 0x80, 15, 0xde);
+            break;
+        case WJB_KEY:
+        case WJB_VALUE:
+        case WJB_ELEM:
+            mp_scalar(buf, &v);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+#ifdef USE_LZ4
+static bytea *
+lz4_frame(StringInfo raw)
+{
+    size_t bound = LZ4F_compressFrameBound(raw->len, NULL);
+    bytea *result = palloc(VARHDRSZ + bound);
+    size_t len = LZ4F_compressFrame(VARDATA(result), bound, raw->data, raw->len, NULL);
+
+    if (LZ4F_isError(len))
+        elog(ERROR, "could not compress pg_hier_binary result: %s", LZ4F_getErrorName(len));
+    SET_VARSIZE(result, VARHDRSZ + len);
+    return result;
+}
+#else
+static bytea *
+lz4_frame(StringInfo raw)
+{
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("LZ4 compression is not supported by this build")));
+    return NULL;
+}
+#endif
+
+/**************************************
+ * Runs the DSL in rows mode through a
+ * cursor, pg_hier.fetch_size rows at a
+ * time, appending each root document to
+ * one msgpack array. The array32 header
+ * is reserved first and its count
+ * filled in at the end.
+ **************************************/
+bytea *
+pg_hier_binary_encode(const char *input, hier_params *params, bool lz4)
+{
+    StringInfoData raw;
+    SPIPlanPtr plan;
+    Portal portal;
+    uint32 count = 0;
+    bytea *result;
+    int ret;
+
+    // Allocated before SPI_connect, it outlives SPI_finish
+    initStringInfo(&raw);
+    appendBinaryStringInfo(&raw, "\xdd\0\0\0\0", 5);
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    plan = pg_hier_plan_get(input, params, HIER_OUTPUT_ROWS);
+    portal = SPI_cursor_open(NULL, plan, params->values, params->nulls, true);
+
+    for (;;)
+    {
+        SPI_cursor_fetch(portal, true, pg_hier_fetch_size);
+        if (SPI_processed == 0)
+            break;
+
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            bool isnull;
+            Datum val = SPI_getbinval(SPI_tuptable->vals[i],
+                                      SPI_tuptable->tupdesc, 1, &isnull);
+
+            CHECK_FOR_INTERRUPTS();
+            if (isnull)
+                mp_byte(&raw, 0xc0);
+            else
+                mp_jsonb(&raw, DatumGetJsonbP(val));
+            count++;
+        }
+        SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(portal);
+    pg_hier_arena_sample();
+    SPI_finish();
+
+    for (int i = 0; i < 4; i++)
+        raw.data[1 + i] = (char) (count >> ((3 - i) * 8));
+
+    if (lz4)
+        return lz4_frame(&raw);
+
+    result = palloc(VARHDRSZ + raw.len);
+    SET_VARSIZE(result, VARHDRSZ + raw.len);
+    memcpy(VARDATA(result), raw.data, raw.len);
+    return result;
+}
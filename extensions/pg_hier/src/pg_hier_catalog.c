@@ -0,0 +1,1159 @@
+#include "pg_hier_catalog.h"
+#include "pg_hier_sql.h"
+#include "pg_hier_helper.h"
+
+static MemoryContext catalog_cxt = NULL;
+static hier_catalog *catalog = NULL;
+static bool catalog_valid = false;
+static bool callback_registered = false;
+static uint64 catalog_generation = 0;
+static Oid header_relid = InvalidOid;
+static Oid detail_relid = InvalidOid;
+static Oid tree_relid = InvalidOid;
+
+// Join-path graph and memoized routes, built on demand
+// in catalog_cxt and dropped with the catalog
+static int32 *route_edge_first = NULL;
+static int32 *route_edge_level = NULL;
+static int32 *route_level_node = NULL;   // member of each level's table
+static int32 *route_level_parent = NULL; // member of each level's parent, -1 at the top
+static HTAB *route_memo = NULL;
+static HTAB *tree_memo = NULL; // pg_hier_tree rows by table name, misses included
+
+bool pg_hier_shared_catalog = true;
+
+/**************************************
+ * Shared catalog, one slot per
+ * database. The image is the same
+ * pointer-free block a backend builds
+ * for itself, kept in a DSA area and
+ * used in place. Backends holding an
+ * image keep a reference on it, the
+ * slot holds one more until replaced.
+ **************************************/
+#define HIER_CAT_SLOTS 32
+
+typedef struct hier_cat_slot
+{
+    Oid dbid;
+    Oid header_relid;
+    Oid detail_relid;
+    pg_atomic_uint64 version; // bumped after a metadata change commits
+    uint64 loaded;            // version the image was built at, 0 for none
+    dsa_pointer image;
+} hier_cat_slot;
+
+typedef struct hier_cat_shared
+{
+    LWLock *lock; // guards the slots and creation of the area
+    int tranche;
+    dsa_handle area;
+    hier_cat_slot slots[HIER_CAT_SLOTS];
+} hier_cat_shared;
+
+// Shared image header, the catalog follows
+typedef struct hier_cat_image
+{
+    pg_atomic_uint32 refcount;
+} hier_cat_image;
+
+#define HIER_CAT_IMAGE_CATALOG(img) \
+    ((hier_catalog *) ((char *) (img) + MAXALIGN(sizeof(hier_cat_image))))
+
+static hier_cat_shared *cat_shared = NULL;
+static dsa_area *cat_area = NULL;
+static hier_cat_slot *cat_slot = NULL;
+static dsa_pointer cat_image = InvalidDsaPointer; // image this backend holds
+static uint64 cat_version = 0;
+static bool cat_bump_pending = false; // this transaction changed the metadata
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+typedef struct member_pair
+{
+    int32 name;
+    int32 hier;
+} member_pair;
+
+static void pg_hier_catalog_callback(Datum arg, Oid relid);
+static hier_catalog *pg_hier_catalog_load(void);
+static int32 pool_add(StringInfo pool, const char *str);
+static int deconstruct_keys(HeapTuple tuple, TupleDesc tupdesc, int col,
+                            Datum **elems);
+static int member_pair_cmp(const void *a, const void *b, void *arg);
+static const hier_cat_member *member_lookup(const hier_catalog *cat, const char *table);
+static bool posting_contains(const hier_catalog *cat, const hier_cat_member *member,
+                             int32 hier);
+static int level_of(const hier_catalog *cat, const hier_cat_hier *hier,
+                    const char *table);
+static void copy_hop(const hier_catalog *cat, const hier_cat_level *lvl, hier_hop *hop);
+static hier_path *copy_path(const hier_path *from);
+static void route_graph_build(const hier_catalog *cat);
+static hier_path *route_search(const hier_catalog *cat, const char *parent,
+                               const char *child);
+static void cat_shmem_request(void);
+static void cat_shmem_startup(void);
+static void cat_xact_callback(XactEvent event, void *arg);
+static void cat_exit(int code, Datum arg);
+static hier_cat_slot *cat_find_slot(bool claim);
+static bool cat_attach(void);
+static void cat_hold(dsa_pointer image, uint64 version);
+static void cat_unref(dsa_pointer image);
+static void cat_release(void);
+static hier_catalog *catalog_shared_acquire(void);
+
+typedef struct hier_route_entry
+{
+    uint64 key;   // hash of parent and child
+    char *parent;
+    char *child;
+    hier_path *path;
+} hier_route_entry;
+
+typedef struct hier_tree_entry
+{
+    char table[2 * NAMEDATALEN];
+    bool registered;
+    bool closure;
+    int nkeys;
+    char **id_keys;
+    char **parent_keys;
+} hier_tree_entry;
+
+static void tree_load(const char *table, hier_tree_entry *entry);
+
+/**************************************
+ * Relcache callback, fired for DDL on
+ * the metadata tables and by the
+ * pg_hier_catalog_changed trigger.
+ **************************************/
+static void
+pg_hier_catalog_callback(Datum arg, Oid relid)
+{
+    if (relid == InvalidOid || relid == header_relid || relid == detail_relid ||
+        relid == tree_relid)
+        catalog_valid = false;
+}
+
+/**************************************
+ * Returns the compiled catalog,
+ * (re)loading it when it was
+ * invalidated. The image stays valid
+ * until the next call that reloads it.
+ **************************************/
+const hier_catalog *
+pg_hier_catalog(void)
+{
+    if (!callback_registered)
+    {
+        CacheRegisterRelcacheCallback(pg_hier_catalog_callback, (Datum) 0);
+        callback_registered = true;
+    }
+
+    // A shared image also goes stale when another
+    // backend commits a change, checked without a lock
+    if (catalog_valid && catalog != NULL &&
+        (!DsaPointerIsValid(cat_image) ||
+         pg_atomic_read_u64(&cat_slot->version) == cat_version))
+        return catalog;
+
+    if (catalog_cxt == NULL)
+    {
+        if (CacheMemoryContext == NULL)
+            CreateCacheMemoryContext();
+        catalog_cxt = AllocSetContextCreate(CacheMemoryContext,
+                                            "pg_hier catalog",
+                                            ALLOCSET_SMALL_SIZES);
+    }
+    else
+        MemoryContextReset(catalog_cxt);
+
+    catalog = NULL;
+    cat_release();
+    route_edge_first = NULL;
+    route_edge_level = NULL;
+    route_level_node = NULL;
+    route_level_parent = NULL;
+    route_memo = NULL;
+    tree_memo = NULL;
+
+    // Set before loading so an invalidation
+    // arriving mid-load forces another reload
+    catalog_valid = true;
+    PG_TRY();
+    {
+        tree_relid = RelnameGetRelid("pg_hier_tree");
+        catalog = catalog_shared_acquire();
+        if (catalog == NULL)
+            catalog = pg_hier_catalog_load();
+    }
+    PG_CATCH();
+    {
+        catalog_valid = false;
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    catalog_generation++;
+    return catalog;
+}
+
+uint64
+pg_hier_catalog_generation(void)
+{
+    pg_hier_catalog();
+    return catalog_generation;
+}
+
+/**************************************
+ * Shared catalog hooks, installed from
+ * _PG_init while shared_preload_libraries
+ * is processed.
+ **************************************/
+void
+pg_hier_catalog_shmem_init(void)
+{
+    if (!pg_hier_shared_catalog)
+        return;
+
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = cat_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = cat_shmem_startup;
+    RegisterXactCallback(cat_xact_callback, NULL);
+}
+
+static void
+cat_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(MAXALIGN(sizeof(hier_cat_shared)));
+    RequestNamedLWLockTranche("pg_hier_catalog", 1);
+}
+
+static void
+cat_shmem_startup(void)
+{
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    cat_shared = ShmemInitStruct("pg_hier catalog", sizeof(hier_cat_shared), &found);
+    if (!found)
+    {
+        cat_shared->lock = &(GetNamedLWLockTranche("pg_hier_catalog"))->lock;
+        cat_shared->tranche = LWLockNewTrancheId();
+        cat_shared->area = DSA_HANDLE_INVALID;
+        for (int i = 0; i < HIER_CAT_SLOTS; i++)
+        {
+            cat_shared->slots[i].dbid = InvalidOid;
+            pg_atomic_init_u64(&cat_shared->slots[i].version, 1);
+            cat_shared->slots[i].loaded = 0;
+            cat_shared->slots[i].image = InvalidDsaPointer;
+        }
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/**************************************
+ * Called by the pg_hier_catalog_changed
+ * trigger. The shared version is bumped
+ * once the change is visible, until
+ * then this transaction reads its own
+ * private catalog.
+ **************************************/
+void
+pg_hier_catalog_bump(void)
+{
+    if (cat_shared != NULL)
+        cat_bump_pending = true;
+}
+
+static void
+cat_xact_callback(XactEvent event, void *arg)
+{
+    hier_cat_slot *slot;
+
+    if (!cat_bump_pending)
+        return;
+
+    switch (event)
+    {
+        case XACT_EVENT_PRE_PREPARE:
+            // Nothing would bump the version at COMMIT PREPARED
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("cannot PREPARE a transaction that has changed pg_hier metadata")));
+            break;
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_PARALLEL_COMMIT:
+            if ((slot = cat_find_slot(false)) != NULL)
+                pg_atomic_fetch_add_u64(&slot->version, 1);
+            /* FALLTHROUGH */
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PARALLEL_ABORT:
+            // Go back to the shared image on the next call
+            cat_bump_pending = false;
+            catalog_valid = false;
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+cat_exit(int code, Datum arg)
+{
+    cat_release();
+}
+
+static hier_cat_slot *
+cat_find_slot(bool claim)
+{
+    hier_cat_slot *slot = NULL;
+
+    if (cat_slot != NULL)
+        return cat_slot;
+
+    LWLockAcquire(cat_shared->lock, claim ? LW_EXCLUSIVE : LW_SHARED);
+    for (int i = 0; i < HIER_CAT_SLOTS && slot == NULL; i++)
+        if (cat_shared->slots[i].dbid == MyDatabaseId)
+            slot = &cat_shared->slots[i];
+    for (int i = 0; i < HIER_CAT_SLOTS && slot == NULL && claim; i++)
+        if (!OidIsValid(cat_shared->slots[i].dbid))
+        {
+            slot = &cat_shared->slots[i];
+            slot->dbid = MyDatabaseId;
+        }
+    LWLockRelease(cat_shared->lock);
+
+    if (claim)
+        cat_slot = slot;
+    return slot;
+}
+
+// First backend creates the area, the others attach
+static bool
+cat_attach(void)
+{
+    MemoryContext oldcxt;
+
+    if (cat_area != NULL)
+        return true;
+
+    LWLockRegisterTranche(cat_shared->tranche, "pg_hier_catalog");
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    LWLockAcquire(cat_shared->lock, LW_EXCLUSIVE);
+    if (cat_shared->area == DSA_HANDLE_INVALID)
+    {
+        cat_area = dsa_create(cat_shared->tranche);
+        dsa_pin(cat_area);
+        cat_shared->area = dsa_get_handle(cat_area);
+    }
+    else
+        cat_area = dsa_attach(cat_shared->area);
+    dsa_pin_mapping(cat_area);
+    LWLockRelease(cat_shared->lock);
+    MemoryContextSwitchTo(oldcxt);
+
+    before_shmem_exit(cat_exit, (Datum) 0);
+    return true;
+}
+
+static void
+cat_hold(dsa_pointer image, uint64 version)
+{
+    hier_cat_image *img = dsa_get_address(cat_area, image);
+
+    pg_atomic_fetch_add_u32(&img->refcount, 1);
+    cat_image = image;
+    cat_version = version;
+}
+
+static void
+cat_unref(dsa_pointer image)
+{
+    hier_cat_image *img = dsa_get_address(cat_area, image);
+
+    if (pg_atomic_sub_fetch_u32(&img->refcount, 1) == 0)
+        dsa_free(cat_area, image);
+}
+
+static void
+cat_release(void)
+{
+    if (!DsaPointerIsValid(cat_image))
+        return;
+    cat_unref(cat_image);
+    cat_image = InvalidDsaPointer;
+}
+
+/**************************************
+ * Returns the database's shared image,
+ * building and publishing it when it
+ * is missing or older than the slot
+ * version. NULL means load privately:
+ * no shared memory, a metadata change
+ * in flight, or no free slot.
+ **************************************/
+static hier_catalog *
+catalog_shared_acquire(void)
+{
+    hier_catalog *local;
+    hier_cat_image *img;
+    dsa_pointer image;
+    uint64 version;
+
+    if (cat_shared == NULL || cat_bump_pending || !cat_attach() ||
+        cat_find_slot(true) == NULL)
+        return NULL;
+
+    header_relid = RelnameGetRelid("pg_hier_header");
+    detail_relid = RelnameGetRelid("pg_hier_detail");
+
+    LWLockAcquire(cat_shared->lock, LW_SHARED);
+    version = pg_atomic_read_u64(&cat_slot->version);
+    // Relids change when the extension is recreated
+    if (cat_slot->loaded == version && DsaPointerIsValid(cat_slot->image) &&
+        cat_slot->header_relid == header_relid && cat_slot->detail_relid == detail_relid)
+    {
+        cat_hold(cat_slot->image, version);
+        LWLockRelease(cat_shared->lock);
+        return HIER_CAT_IMAGE_CATALOG(dsa_get_address(cat_area, cat_image));
+    }
+    LWLockRelease(cat_shared->lock);
+
+    // Read with a snapshot taken after the version; a change
+    // committing meanwhile bumps the version past this image
+    PushActiveSnapshot(GetLatestSnapshot());
+    local = pg_hier_catalog_load();
+    PopActiveSnapshot();
+
+    image = dsa_allocate_extended(cat_area, MAXALIGN(sizeof(hier_cat_image)) + local->size,
+                                  DSA_ALLOC_NO_OOM);
+    if (!DsaPointerIsValid(image))
+        return local;
+    img = dsa_get_address(cat_area, image);
+    pg_atomic_init_u32(&img->refcount, 1); // the slot's reference
+    memcpy(HIER_CAT_IMAGE_CATALOG(img), local, local->size);
+    pfree(local);
+
+    LWLockAcquire(cat_shared->lock, LW_EXCLUSIVE);
+    if (cat_slot->loaded <= version)
+    {
+        if (DsaPointerIsValid(cat_slot->image))
+            cat_unref(cat_slot->image);
+        cat_slot->image = image;
+        cat_slot->loaded = version;
+        cat_slot->header_relid = header_relid;
+        cat_slot->detail_relid = detail_relid;
+    }
+    else
+        dsa_free(cat_area, image); // a newer one was published meanwhile
+    cat_hold(cat_slot->image, cat_slot->loaded);
+    LWLockRelease(cat_shared->lock);
+
+    return HIER_CAT_IMAGE_CATALOG(dsa_get_address(cat_area, cat_image));
+}
+
+static hier_catalog *
+pg_hier_catalog_load(void)
+{
+    hier_catalog *cat = NULL;
+    int ret;
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    PG_TRY();
+    {
+        StringInfoData pool;
+        hier_cat_hier *hiers;
+        hier_cat_level *levels;
+        int32 *keys;
+        member_pair *pairs;
+        hier_cat_member *members;
+        int32 *postings;
+        int nhiers;
+        int nlevels = 0;
+        int nkeys = 0;
+        int npairs = 0;
+        int nmembers = 0;
+        int npostings = 0;
+        int keys_capacity = 16;
+        int h = 0;
+        Size hiers_size, levels_size, keys_size, members_size, postings_size, size;
+        char *image;
+
+        header_relid = RelnameGetRelid("pg_hier_header");
+        detail_relid = RelnameGetRelid("pg_hier_detail");
+
+        initStringInfo(&pool);
+        keys = palloc(keys_capacity * sizeof(int32));
+
+        if ((ret = SPI_execute(PG_HIER_SQL_LOAD_HEADER, true, 0)) != SPI_OK_SELECT)
+            elog(ERROR, "SPI_execute failed: %d", ret);
+
+        nhiers = (int) SPI_processed;
+        hiers = palloc0(Max(nhiers, 1) * sizeof(hier_cat_hier));
+        for (int i = 0; i < nhiers; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            bool isnull;
+            char *path;
+
+            hiers[i].id = DatumGetInt32(
+                SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull));
+            path = SPI_getvalue(tuple, SPI_tuptable->tupdesc, 2);
+            hiers[i].table_path = pool_add(&pool, path ? path : "");
+        }
+        SPI_freetuptable(SPI_tuptable);
+
+        if ((ret = SPI_execute(PG_HIER_SQL_LOAD_DETAIL, true, 0)) != SPI_OK_SELECT)
+            elog(ERROR, "SPI_execute failed: %d", ret);
+
+        levels = palloc0(Max(SPI_processed, 1) * sizeof(hier_cat_level));
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            hier_cat_level *lvl = &levels[nlevels];
+            bool isnull;
+            int hier_id;
+            char *name;
+            char *parent_name;
+            Datum *parent_keys;
+            Datum *child_keys;
+            int nparent, nchild;
+
+            hier_id = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+            while (h < nhiers && hiers[h].id < hier_id)
+                h++;
+            if (h == nhiers || hiers[h].id != hier_id)
+                continue;
+
+            if (hiers[h].nlevels == 0)
+                hiers[h].first_level = nlevels;
+            hiers[h].nlevels++;
+            nlevels++;
+
+            lvl->level = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+            if (isnull)
+                lvl->level = hiers[h].nlevels;
+            name = SPI_getvalue(tuple, tupdesc, 3);
+            parent_name = SPI_getvalue(tuple, tupdesc, 4);
+            lvl->name = pool_add(&pool, name ? name : "");
+            lvl->parent_name = parent_name ? pool_add(&pool, parent_name) : -1;
+
+            nparent = deconstruct_keys(tuple, tupdesc, 5, &parent_keys);
+            nchild = deconstruct_keys(tuple, tupdesc, 6, &child_keys);
+            lvl->nkeys = Min(nparent, nchild);
+            lvl->join_clause = -1;
+
+            if (nkeys + 2 * lvl->nkeys > keys_capacity)
+            {
+                while (nkeys + 2 * lvl->nkeys > keys_capacity)
+                    keys_capacity *= 2;
+                keys = repalloc(keys, keys_capacity * sizeof(int32));
+            }
+
+            lvl->parent_keys = nkeys;
+            for (int j = 0; j < lvl->nkeys; j++)
+                keys[nkeys++] = pool_add(&pool, TextDatumGetCString(parent_keys[j]));
+            lvl->child_keys = nkeys;
+            for (int j = 0; j < lvl->nkeys; j++)
+                keys[nkeys++] = pool_add(&pool, TextDatumGetCString(child_keys[j]));
+
+            // Precompute the join fragment used by every FROM clause
+            if (parent_name && lvl->nkeys > 0)
+            {
+                StringInfoData clause;
+                initStringInfo(&clause);
+                for (int j = 0; j < lvl->nkeys; j++)
+                {
+                    if (j > 0)
+                        appendStringInfoString(&clause, " AND ");
+                    appendStringInfo(&clause, "%s.%s = %s.%s",
+                                     name, TextDatumGetCString(child_keys[j]),
+                                     parent_name, TextDatumGetCString(parent_keys[j]));
+                }
+                lvl->join_clause = pool_add(&pool, clause.data);
+            }
+        }
+
+        // Inverted index from table name to the hierarchies naming it
+        pairs = palloc(Max(nlevels, 1) * sizeof(member_pair));
+        for (int i = 0; i < nhiers; i++)
+            for (int l = 0; l < hiers[i].nlevels; l++)
+            {
+                pairs[npairs].name = levels[hiers[i].first_level + l].name;
+                pairs[npairs].hier = i;
+                npairs++;
+            }
+        qsort_arg(pairs, npairs, sizeof(member_pair), member_pair_cmp, pool.data);
+
+        members = palloc(Max(npairs, 1) * sizeof(hier_cat_member));
+        postings = palloc(Max(npairs, 1) * sizeof(int32));
+        for (int i = 0; i < npairs; i++)
+        {
+            if (nmembers == 0 ||
+                strcmp(pool.data + members[nmembers - 1].name, pool.data + pairs[i].name) != 0)
+            {
+                members[nmembers].name = pairs[i].name;
+                members[nmembers].first = npostings;
+                members[nmembers].count = 0;
+                nmembers++;
+            }
+            // Same table listed twice in one hierarchy
+            else if (postings[npostings - 1] == pairs[i].hier)
+                continue;
+
+            postings[npostings++] = pairs[i].hier;
+            members[nmembers - 1].count++;
+        }
+
+        hiers_size = MAXALIGN(Max(nhiers, 1) * sizeof(hier_cat_hier));
+        levels_size = MAXALIGN(Max(nlevels, 1) * sizeof(hier_cat_level));
+        keys_size = MAXALIGN(Max(nkeys, 1) * sizeof(int32));
+        members_size = MAXALIGN(Max(nmembers, 1) * sizeof(hier_cat_member));
+        postings_size = MAXALIGN(Max(npostings, 1) * sizeof(int32));
+        size = MAXALIGN(sizeof(hier_catalog)) + hiers_size + levels_size +
+               keys_size + members_size + postings_size + pool.len;
+
+        image = MemoryContextAllocZero(catalog_cxt, size);
+        cat = (hier_catalog *) image;
+        cat->size = size;
+        cat->nhiers = nhiers;
+        cat->nlevels = nlevels;
+        cat->nkeys = nkeys;
+        cat->nmembers = nmembers;
+        cat->npostings = npostings;
+        cat->hiers_off = MAXALIGN(sizeof(hier_catalog));
+        cat->levels_off = cat->hiers_off + hiers_size;
+        cat->keys_off = cat->levels_off + levels_size;
+        cat->members_off = cat->keys_off + keys_size;
+        cat->postings_off = cat->members_off + members_size;
+        cat->strings_off = cat->postings_off + postings_size;
+
+        memcpy(HIER_CAT_HIERS(cat), hiers, nhiers * sizeof(hier_cat_hier));
+        memcpy(HIER_CAT_LEVELS(cat), levels, nlevels * sizeof(hier_cat_level));
+        memcpy(HIER_CAT_KEYS(cat), keys, nkeys * sizeof(int32));
+        memcpy(HIER_CAT_MEMBERS(cat), members, nmembers * sizeof(hier_cat_member));
+        memcpy(HIER_CAT_POSTINGS(cat), postings, npostings * sizeof(int32));
+        memcpy(image + cat->strings_off, pool.data, pool.len);
+    }
+    PG_FINALLY();
+    {
+        SPI_finish();
+    }
+    PG_END_TRY();
+
+    return cat;
+}
+
+/**************************************
+ * Looks up the hierarchy holding every
+ * table, by exact name, with the first
+ * (root) table shallower than the
+ * rest. The shortest posting list is
+ * probed against the others, so the
+ * cost follows the rarest table rather
+ * than the number of hierarchies.
+ * Prefers the fewest levels, then the
+ * lowest id.
+ **************************************/
+bool
+pg_hier_catalog_find(string_array *tables, hier_header *hh)
+{
+    const hier_catalog *cat = pg_hier_catalog();
+    hier_cat_hier *hiers = HIER_CAT_HIERS(cat);
+    int32 *postings = HIER_CAT_POSTINGS(cat);
+    const hier_cat_member **lists;
+    int shortest = 0;
+    int best = -1;
+
+    if (tables->size == 0)
+        return false;
+
+    lists = palloc(tables->size * sizeof(hier_cat_member *));
+    for (int j = 0; j < tables->size; j++)
+    {
+        lists[j] = member_lookup(cat, tables->data[j]);
+        if (lists[j] == NULL)
+        {
+            pfree(lists);
+            return false;
+        }
+        if (lists[j]->count < lists[shortest]->count)
+            shortest = j;
+    }
+
+    for (int p = 0; p < lists[shortest]->count; p++)
+    {
+        int32 h = postings[lists[shortest]->first + p];
+        bool match = true;
+        int root_level;
+
+        for (int j = 0; j < tables->size && match; j++)
+            match = j == shortest || posting_contains(cat, lists[j], h);
+        if (!match)
+            continue;
+
+        root_level = level_of(cat, &hiers[h], tables->data[0]);
+        for (int j = 1; j < tables->size && match; j++)
+            match = level_of(cat, &hiers[h], tables->data[j]) > root_level;
+        if (!match)
+            continue;
+
+        // Postings ascend with id, ties keep the first
+        if (best < 0 || hiers[h].nlevels < hiers[best].nlevels)
+            best = h;
+    }
+    pfree(lists);
+
+    if (best < 0)
+        return false;
+
+    update_hier_header(hh, (char *) HIER_CAT_STR(cat, hiers[best].table_path),
+                       hiers[best].id);
+    return true;
+}
+
+/**************************************
+ * Copies the levels linking child up
+ * to parent within one hierarchy.
+ * Returns an empty path when either
+ * table is not part of it.
+ **************************************/
+hier_path *
+pg_hier_catalog_path(int hier_id, const char *parent, const char *child)
+{
+    const hier_catalog *cat = pg_hier_catalog();
+    hier_cat_hier *hiers = HIER_CAT_HIERS(cat);
+    hier_cat_hier *hier = NULL;
+    hier_cat_level *levels;
+    hier_path *path = palloc0(sizeof(hier_path));
+    int lo = -1;
+    int hi = -1;
+    int low = 0;
+    int high = cat->nhiers - 1;
+
+    // Header rows are ordered by id
+    while (low <= high)
+    {
+        int mid = low + (high - low) / 2;
+        if (hiers[mid].id == hier_id)
+        {
+            hier = &hiers[mid];
+            break;
+        }
+        if (hiers[mid].id < hier_id)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    if (hier == NULL)
+        return path;
+
+    levels = HIER_CAT_LEVELS(cat) + hier->first_level;
+    for (int i = 0; i < hier->nlevels; i++)
+    {
+        if (lo < 0 && levels[i].parent_name >= 0 &&
+            strcmp(HIER_CAT_STR(cat, levels[i].parent_name), parent) == 0)
+            lo = i;
+        if (hi < 0 && strcmp(HIER_CAT_STR(cat, levels[i].name), child) == 0)
+            hi = i;
+    }
+    if (lo < 0 || hi < lo)
+        return path;
+
+    path->nhops = hi - lo + 1;
+    path->hops = palloc0(path->nhops * sizeof(hier_hop));
+    for (int i = hi, n = 0; i >= lo; i--, n++)
+        copy_hop(cat, &levels[i], &path->hops[n]);
+    return path;
+}
+
+/**************************************
+ * Shortest join path from parent down
+ * to child across every hierarchy, in
+ * the same child-upwards layout as
+ * pg_hier_catalog_path. Results are
+ * memoized per (parent, child) until
+ * the catalog reloads. Returns an
+ * empty path when there is none.
+ **************************************/
+hier_path *
+pg_hier_catalog_route(const char *parent, const char *child)
+{
+    const hier_catalog *cat = pg_hier_catalog();
+    uint64 key = hash_combine64(
+        hash_bytes_extended((const unsigned char *) parent, strlen(parent), 0),
+        hash_bytes_extended((const unsigned char *) child, strlen(child), 0));
+    hier_route_entry *entry;
+    MemoryContext oldcxt;
+    bool found;
+
+    if (route_memo == NULL)
+    {
+        HASHCTL ctl;
+
+        route_graph_build(cat);
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(uint64);
+        ctl.entrysize = sizeof(hier_route_entry);
+        ctl.hcxt = catalog_cxt;
+        route_memo = hash_create("pg_hier routes", 64, &ctl,
+                                 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    entry = hash_search(route_memo, &key, HASH_ENTER, &found);
+    if (found && entry->path != NULL &&
+        strcmp(entry->parent, parent) == 0 && strcmp(entry->child, child) == 0)
+        return copy_path(entry->path);
+
+    // New pair, or a hash collision that takes the slot over
+    entry->path = NULL;
+    oldcxt = MemoryContextSwitchTo(catalog_cxt);
+    entry->parent = pstrdup(parent);
+    entry->child = pstrdup(child);
+    entry->path = route_search(cat, parent, child);
+    MemoryContextSwitchTo(oldcxt);
+
+    return copy_path(entry->path);
+}
+
+// Reads the pg_hier_tree row of table into catalog_cxt
+static void
+tree_load(const char *table, hier_tree_entry *entry)
+{
+    MemoryContext oldcxt;
+    int ret;
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    oldcxt = MemoryContextSwitchTo(catalog_cxt);
+    entry->registered = pg_hier_tree_keys(table, false, &entry->id_keys,
+                                          &entry->parent_keys, &entry->nkeys,
+                                          &entry->closure);
+    MemoryContextSwitchTo(oldcxt);
+
+    SPI_finish();
+}
+
+/**************************************
+ * Keys of a table registered with
+ * pg_hier_create_tree, false when it is
+ * not. Rows are memoized, misses too,
+ * until the catalog reloads; the
+ * pg_hier_tree trigger invalidates it
+ * like the other metadata tables.
+ **************************************/
+bool
+pg_hier_catalog_tree(const char *table, char ***id_keys, char ***parent_keys,
+                     int *nkeys, bool *closure)
+{
+    hier_tree_entry loaded;
+    hier_tree_entry *entry;
+    char name[2 * NAMEDATALEN];
+
+    pg_hier_catalog();
+    if (tree_memo == NULL)
+    {
+        HASHCTL ctl;
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(name);
+        ctl.entrysize = sizeof(hier_tree_entry);
+        ctl.hcxt = catalog_cxt;
+        tree_memo = hash_create("pg_hier trees", 16, &ctl,
+                                HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+    }
+
+    strlcpy(name, table, sizeof(name));
+    entry = hash_search(tree_memo, name, HASH_FIND, NULL);
+    if (entry == NULL)
+    {
+        // Entered only once loaded, an error leaves no half entry
+        tree_load(table, &loaded);
+        entry = hash_search(tree_memo, name, HASH_ENTER, NULL);
+        entry->registered = loaded.registered;
+        entry->closure = loaded.closure;
+        entry->nkeys = loaded.nkeys;
+        entry->id_keys = loaded.id_keys;
+        entry->parent_keys = loaded.parent_keys;
+    }
+
+    if (!entry->registered)
+        return false;
+
+    *nkeys = entry->nkeys;
+    *closure = entry->closure;
+    *id_keys = palloc(entry->nkeys * sizeof(char *));
+    *parent_keys = palloc(entry->nkeys * sizeof(char *));
+    for (int j = 0; j < entry->nkeys; j++)
+    {
+        (*id_keys)[j] = pstrdup(entry->id_keys[j]);
+        (*parent_keys)[j] = pstrdup(entry->parent_keys[j]);
+    }
+    return true;
+}
+
+static int32
+pool_add(StringInfo pool, const char *str)
+{
+    int32 off = pool->len;
+    appendBinaryStringInfo(pool, str, strlen(str) + 1);
+    return off;
+}
+
+static int
+deconstruct_keys(HeapTuple tuple, TupleDesc tupdesc, int col, Datum **elems)
+{
+    bool isnull;
+    bool *nulls;
+    int nelems = 0;
+    int n = 0;
+    Datum datum = SPI_getbinval(tuple, tupdesc, col, &isnull);
+
+    *elems = NULL;
+    if (isnull)
+        return 0;
+
+    deconstruct_array(DatumGetArrayTypeP(datum), TEXTOID, -1, false, 'i',
+                      elems, &nulls, &nelems);
+
+    // Drop NULL entries, the key lists are positional pairs
+    for (int i = 0; i < nelems; i++)
+        if (!nulls[i])
+            (*elems)[n++] = (*elems)[i];
+    return n;
+}
+
+static int
+member_pair_cmp(const void *a, const void *b, void *arg)
+{
+    const member_pair *pa = (const member_pair *) a;
+    const member_pair *pb = (const member_pair *) b;
+    const char *pool = (const char *) arg;
+    int cmp = strcmp(pool + pa->name, pool + pb->name);
+
+    if (cmp != 0)
+        return cmp;
+    return pa->hier - pb->hier;
+}
+
+static const hier_cat_member *
+member_lookup(const hier_catalog *cat, const char *table)
+{
+    hier_cat_member *members = HIER_CAT_MEMBERS(cat);
+    int low = 0;
+    int high = cat->nmembers - 1;
+
+    while (low <= high)
+    {
+        int mid = low + (high - low) / 2;
+        int cmp = strcmp(HIER_CAT_STR(cat, members[mid].name), table);
+
+        if (cmp == 0)
+            return &members[mid];
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return NULL;
+}
+
+static bool
+posting_contains(const hier_catalog *cat, const hier_cat_member *member, int32 hier)
+{
+    int32 *postings = HIER_CAT_POSTINGS(cat) + member->first;
+    int low = 0;
+    int high = member->count - 1;
+
+    while (low <= high)
+    {
+        int mid = low + (high - low) / 2;
+
+        if (postings[mid] == hier)
+            return true;
+        if (postings[mid] < hier)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return false;
+}
+
+// Position of the table among the ordered levels, -1 if absent
+static int
+level_of(const hier_catalog *cat, const hier_cat_hier *hier, const char *table)
+{
+    hier_cat_level *levels = HIER_CAT_LEVELS(cat) + hier->first_level;
+
+    for (int i = 0; i < hier->nlevels; i++)
+        if (strcmp(HIER_CAT_STR(cat, levels[i].name), table) == 0)
+            return i;
+    return -1;
+}
+
+static void
+copy_hop(const hier_catalog *cat, const hier_cat_level *lvl, hier_hop *hop)
+{
+    hop->name = pstrdup(HIER_CAT_STR(cat, lvl->name));
+    hop->parent_name = lvl->parent_name >= 0 ?
+        pstrdup(HIER_CAT_STR(cat, lvl->parent_name)) : NULL;
+    hop->nkeys = lvl->nkeys;
+    hop->parent_keys = palloc(Max(lvl->nkeys, 1) * sizeof(char *));
+    hop->child_keys = palloc(Max(lvl->nkeys, 1) * sizeof(char *));
+    for (int j = 0; j < lvl->nkeys; j++)
+    {
+        hop->parent_keys[j] = pstrdup(HIER_CAT_KEY(cat, lvl->parent_keys + j));
+        hop->child_keys[j] = pstrdup(HIER_CAT_KEY(cat, lvl->child_keys + j));
+    }
+    hop->join_clause = lvl->join_clause >= 0 ?
+        pstrdup(HIER_CAT_STR(cat, lvl->join_clause)) : NULL;
+}
+
+static hier_path *
+copy_path(const hier_path *from)
+{
+    hier_path *path = palloc0(sizeof(hier_path));
+
+    path->nhops = from->nhops;
+    path->hops = palloc0(Max(from->nhops, 1) * sizeof(hier_hop));
+    for (int i = 0; i < from->nhops; i++)
+    {
+        const hier_hop *src = &from->hops[i];
+        hier_hop *hop = &path->hops[i];
+
+        hop->name = pstrdup(src->name);
+        hop->parent_name = src->parent_name ? pstrdup(src->parent_name) : NULL;
+        hop->nkeys = src->nkeys;
+        hop->parent_keys = palloc(Max(src->nkeys, 1) * sizeof(char *));
+        hop->child_keys = palloc(Max(src->nkeys, 1) * sizeof(char *));
+        for (int j = 0; j < src->nkeys; j++)
+        {
+            hop->parent_keys[j] = pstrdup(src->parent_keys[j]);
+            hop->child_keys[j] = pstrdup(src->child_keys[j]);
+        }
+        hop->join_clause = src->join_clause ? pstrdup(src->join_clause) : NULL;
+    }
+    return path;
+}
+
+/**************************************
+ * Adjacency of the join-path graph in
+ * compressed rows. Nodes are the member
+ * table names, the edges out of member
+ * m are the levels whose parent is m,
+ * route_edge_level[route_edge_first[m]
+ * .. route_edge_first[m + 1]).
+ **************************************/
+static void
+route_graph_build(const hier_catalog *cat)
+{
+    hier_cat_level *levels = HIER_CAT_LEVELS(cat);
+    hier_cat_member *members = HIER_CAT_MEMBERS(cat);
+    int nlevels = Max(cat->nlevels, 1);
+    int32 *fill;
+
+    route_edge_first = MemoryContextAllocZero(catalog_cxt,
+                                              (cat->nmembers + 1) * sizeof(int32));
+    route_edge_level = MemoryContextAlloc(catalog_cxt, nlevels * sizeof(int32));
+    route_level_node = MemoryContextAlloc(catalog_cxt, nlevels * sizeof(int32));
+    route_level_parent = MemoryContextAlloc(catalog_cxt, nlevels * sizeof(int32));
+
+    for (int i = 0; i < cat->nlevels; i++)
+    {
+        const hier_cat_member *node = member_lookup(cat, HIER_CAT_STR(cat, levels[i].name));
+        const hier_cat_member *from = levels[i].parent_name >= 0 ?
+            member_lookup(cat, HIER_CAT_STR(cat, levels[i].parent_name)) : NULL;
+
+        route_level_node[i] = (int32) (node - members);
+        route_level_parent[i] = from ? (int32) (from - members) : -1;
+        if (from)
+            route_edge_first[route_level_parent[i] + 1]++;
+    }
+    for (int m = 0; m < cat->nmembers; m++)
+        route_edge_first[m + 1] += route_edge_first[m];
+
+    // Levels are in hierarchy id order, so are the edges
+    fill = palloc(Max(cat->nmembers, 1) * sizeof(int32));
+    memcpy(fill, route_edge_first, cat->nmembers * sizeof(int32));
+    for (int i = 0; i < cat->nlevels; i++)
+        if (route_level_parent[i] >= 0)
+            route_edge_level[fill[route_level_parent[i]]++] = i;
+    pfree(fill);
+}
+
+/**************************************
+ * Breadth-first search from parent,
+ * fewest hops wins and ties go to the
+ * lower hierarchy id. The path is
+ * allocated in CurrentMemoryContext.
+ **************************************/
+static hier_path *
+route_search(const hier_catalog *cat, const char *parent, const char *child)
+{
+    hier_cat_level *levels = HIER_CAT_LEVELS(cat);
+    hier_cat_member *members = HIER_CAT_MEMBERS(cat);
+    const hier_cat_member *from = member_lookup(cat, parent);
+    const hier_cat_member *to = member_lookup(cat, child);
+    hier_path *path = palloc0(sizeof(hier_path));
+    int32 *via;   // level used to reach each member, -1 unseen, -2 start
+    int32 *queue;
+    int head = 0;
+    int tail = 0;
+    int target;
+
+    if (from == NULL || to == NULL || from == to)
+        return path;
+
+    via = palloc(cat->nmembers * sizeof(int32));
+    queue = palloc(cat->nmembers * sizeof(int32));
+    for (int m = 0; m < cat->nmembers; m++)
+        via[m] = -1;
+
+    target = (int) (to - members);
+    queue[tail++] = (int) (from - members);
+    via[from - members] = -2;
+
+    while (head < tail && via[target] == -1)
+    {
+        int m = queue[head++];
+
+        for (int e = route_edge_first[m]; e < route_edge_first[m + 1]; e++)
+        {
+            int32 lvl = route_edge_level[e];
+            int32 next = route_level_node[lvl];
+
+            if (via[next] != -1)
+                continue;
+            via[next] = lvl;
+            queue[tail++] = next;
+        }
+    }
+
+    if (via[target] != -1)
+    {
+        for (int m = target; via[m] >= 0; m = route_level_parent[via[m]])
+            path->nhops++;
+
+        path->hops = palloc0(path->nhops * sizeof(hier_hop));
+        for (int m = target, n = 0; via[m] >= 0; m = route_level_parent[via[m]], n++)
+            copy_hop(cat, &levels[via[m]], &path->hops[n]);
+    }
+
+    pfree(via);
+    pfree(queue);
+    return path;
+}
@@ -0,0 +1,269 @@
+#include "pg_hier_convert.h"
+
+static void convert_bool(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_int2(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_int4(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_int8(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_float4(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_float8(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_numeric(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_text(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_name(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_json(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_jsonb(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_datetime(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_output(hier_convert_column *col, Datum value, JsonbValue *result);
+static void convert_to_jsonb(hier_convert_column *col, Datum value, JsonbValue *result);
+static void set_string(JsonbValue *result, char *str);
+static void set_decimal(JsonbValue *result, const char *digits);
+
+static void
+set_string(JsonbValue *result, char *str)
+{
+    result->type = jbvString;
+    result->val.string.val = str;
+    result->val.string.len = strlen(str);
+}
+
+static void
+set_decimal(JsonbValue *result, const char *digits)
+{
+    result->type = jbvNumeric;
+    result->val.numeric = DatumGetNumeric(DirectFunctionCall3(numeric_in,
+                                                              CStringGetDatum(digits),
+                                                              ObjectIdGetDatum(InvalidOid),
+                                                              Int32GetDatum(-1)));
+}
+
+static void
+convert_bool(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    result->type = jbvBool;
+    result->val.boolean = DatumGetBool(value);
+}
+
+/**************************************
+ * Integers go straight to numeric, no
+ * function manager call per value
+ **************************************/
+static void
+convert_int2(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    result->type = jbvNumeric;
+    result->val.numeric = int64_to_numeric(DatumGetInt16(value));
+}
+
+static void
+convert_int4(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    result->type = jbvNumeric;
+    result->val.numeric = int64_to_numeric(DatumGetInt32(value));
+}
+
+static void
+convert_int8(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    result->type = jbvNumeric;
+    result->val.numeric = int64_to_numeric(DatumGetInt64(value));
+}
+
+/**************************************
+ * Floats keep the shortest digits that
+ * round-trip, as float8out prints them.
+ * NaN and infinities are not JSON
+ * numbers and become strings.
+ **************************************/
+static void
+convert_float4(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    float4 f = DatumGetFloat4(value);
+    char buf[FLOAT_SHORTEST_DECIMAL_LEN];
+
+    if (isnan(f))
+        set_string(result, "NaN");
+    else if (isinf(f))
+        set_string(result, f > 0 ? "Infinity" : "-Infinity");
+    else
+    {
+        float_to_shortest_decimal_buf(f, buf);
+        set_decimal(result, buf);
+    }
+}
+
+static void
+convert_float8(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    float8 f = DatumGetFloat8(value);
+    char buf[DOUBLE_SHORTEST_DECIMAL_LEN];
+
+    if (isnan(f))
+        set_string(result, "NaN");
+    else if (isinf(f))
+        set_string(result, f > 0 ? "Infinity" : "-Infinity");
+    else
+    {
+        double_to_shortest_decimal_buf(f, buf);
+        set_decimal(result, buf);
+    }
+}
+
+static void
+convert_numeric(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    Numeric num = DatumGetNumeric(value);
+
+    if (numeric_is_nan(num) || numeric_is_inf(num))
+    {
+        set_string(result, DatumGetCString(DirectFunctionCall1(numeric_out, value)));
+        return;
+    }
+    result->type = jbvNumeric;
+    result->val.numeric = num;
+}
+
+static void
+convert_text(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    text *t = DatumGetTextPP(value);
+
+    result->type = jbvString;
+    result->val.string.val = VARDATA_ANY(t);
+    result->val.string.len = VARSIZE_ANY_EXHDR(t);
+}
+
+static void
+convert_name(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    set_string(result, NameStr(*DatumGetName(value)));
+}
+
+// Scalars are unwrapped, containers kept as binary
+static void
+convert_jsonb(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    Jsonb *jb = DatumGetJsonbP(value);
+
+    if (JB_ROOT_IS_SCALAR(jb) && JsonbExtractScalar(&jb->root, result))
+        return;
+
+    result->type = jbvBinary;
+    result->val.binary.data = &jb->root;
+    result->val.binary.len = VARSIZE(jb) - VARHDRSZ;
+}
+
+static void
+convert_json(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    char *str = text_to_cstring(DatumGetTextPP(value));
+
+    convert_jsonb(col, DirectFunctionCall1(jsonb_in, CStringGetDatum(str)), result);
+}
+
+static void
+convert_datetime(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    set_string(result, JsonEncodeDateTime(NULL, value, col->typid, NULL));
+}
+
+static void
+convert_output(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    set_string(result, OutputFunctionCall(&col->out, value));
+}
+
+// Arrays, rows, ranges and user types, out holds to_jsonb
+static void
+convert_to_jsonb(hier_convert_column *col, Datum value, JsonbValue *result)
+{
+    convert_jsonb(col, FunctionCall1(&col->out, value), result);
+}
+
+/**************************************
+ * attnos holds the 0-based attribute
+ * of each planned column, NULL plans
+ * the first ncolumns attributes.
+ **************************************/
+hier_convert_plan *
+pg_hier_convert_plan(TupleDesc desc, int ncolumns, const int *attnos)
+{
+    hier_convert_plan *plan = palloc(sizeof(hier_convert_plan));
+
+    plan->ncolumns = ncolumns;
+    plan->columns = palloc0(Max(ncolumns, 1) * sizeof(hier_convert_column));
+
+    for (int i = 0; i < ncolumns; i++)
+    {
+        hier_convert_column *col = &plan->columns[i];
+        int attno = attnos ? attnos[i] : i;
+        Oid outfunc;
+        bool is_varlena;
+
+        col->typid = getBaseType(TupleDescAttr(desc, attno)->atttypid);
+        switch (col->typid)
+        {
+        case BOOLOID:
+            col->convert = convert_bool;
+            break;
+        case INT2OID:
+            col->convert = convert_int2;
+            break;
+        case INT4OID:
+            col->convert = convert_int4;
+            break;
+        case INT8OID:
+            col->convert = convert_int8;
+            break;
+        case FLOAT4OID:
+            col->convert = convert_float4;
+            break;
+        case FLOAT8OID:
+            col->convert = convert_float8;
+            break;
+        case NUMERICOID:
+            col->convert = convert_numeric;
+            break;
+        case TEXTOID:
+        case VARCHAROID:
+        case BPCHAROID:
+            col->convert = convert_text;
+            break;
+        case NAMEOID:
+            col->convert = convert_name;
+            break;
+        case JSONOID:
+            col->convert = convert_json;
+            break;
+        case JSONBOID:
+            col->convert = convert_jsonb;
+            break;
+        case DATEOID:
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+            col->convert = convert_datetime;
+            break;
+        default:
+            if (col->typid >= FirstNormalObjectId ||
+                OidIsValid(get_element_type(col->typid)) ||
+                type_is_rowtype(col->typid) || type_is_range(col->typid) ||
+                type_is_multirange(col->typid))
+            {
+                // to_jsonb(anyelement) reads its argument type from fn_expr
+                fmgr_info(F_TO_JSONB, &col->out);
+                fmgr_info_set_expr((Node *) makeFuncExpr(F_TO_JSONB, JSONBOID,
+                                                         list_make1(makeNullConst(col->typid, -1,
+                                                                                  InvalidOid)),
+                                                         InvalidOid, InvalidOid,
+                                                         COERCE_EXPLICIT_CALL),
+                                   &col->out);
+                col->convert = convert_to_jsonb;
+                break;
+            }
+            // Everything else to_jsonb prints with its output function too
+            getTypeOutputInfo(col->typid, &outfunc, &is_varlena);
+            fmgr_info(outfunc, &col->out);
+            col->convert = convert_output;
+            break;
+        }
+    }
+    return plan;
+}
@@ -0,0 +1,1382 @@
+#include "pg_hier_exec.h"
+#include "pg_hier_helper.h"
+
+int pg_hier_executor = HIER_EXECUTOR_SQL;
+int pg_hier_tree_max_depth = 100;
+
+const struct config_enum_entry pg_hier_executor_options[] = {
+    {"sql", HIER_EXECUTOR_SQL, false},
+    {"native", HIER_EXECUTOR_NATIVE, false},
+    {"batched", HIER_EXECUTOR_BATCHED, false},
+    {NULL, 0, false}
+};
+
+static uint32 doc_key_hash(const void *key, Size keysize);
+static int doc_key_match(const void *key1, const void *key2, Size keysize);
+static HTAB *create_doc_hash(const char *name);
+static hier_doc_bucket *doc_bucket(HTAB *docs, char *key);
+static int find_attr(TupleDesc desc, const char *name);
+static void bind_keymap(hier_keymap *map, TupleDesc desc, int nkeys,
+                        char **names, const char *table);
+static char *make_key(hier_keymap *map, Datum *values, bool *nulls);
+static hier_jb *build_doc(hier_exec_node *en, Datum *values, bool *nulls,
+                          MemoryContext row_cxt);
+static Relation native_open(const char *table);
+static bool native_usable(const char *table);
+static bool native_check(hier_node *node, hier_header *hh);
+static hier_exec_node *native_level(hier_node *node, hier_path *path,
+                                    hier_header *hh, MemoryContext row_cxt);
+static HTAB *native_rekey(HTAB *docs, hier_hop *below, hier_hop *hop,
+                          MemoryContext row_cxt);
+static Jsonb *docs_to_array(List *docs);
+static hier_exec_node *batched_node(hier_node *node, hier_path *path, hier_header *hh);
+static bool where_names_ancestor(hier_node *node, List *ancestors);
+static bool batched_check(hier_exec_node *en, List *ancestors);
+static void batched_query(StringInfo sql, hier_exec_node *en, int key_param);
+static void batched_fetch(hier_exec_node *en, hier_params *params,
+                          int nkeys, Oid *key_types, Datum *key_arrays);
+static void batched_assemble(hier_exec_node *en, MemoryContext row_cxt);
+static hier_columnar_level *columnar_level(hier_exec_node *en, MemoryContext row_cxt);
+static void columnar_emit(hier_columnar_level *level, MemoryContext row_cxt);
+static hier_jb *columnar_doc(hier_columnar_level *level);
+static hier_node *columnar_where(hier_node *node, List *ancestors);
+static hier_jb *tree_doc(hier_tree_state *ts, uint64 row, int depth);
+
+/**************************************
+ * Link key hash, keys are cstrings of
+ * the key column values
+ **************************************/
+static uint32
+doc_key_hash(const void *key, Size keysize)
+{
+    const char *str = *(const char *const *) key;
+    return hash_bytes((const unsigned char *) str, strlen(str));
+}
+
+static int
+doc_key_match(const void *key1, const void *key2, Size keysize)
+{
+    return strcmp(*(const char *const *) key1, *(const char *const *) key2);
+}
+
+static HTAB *
+create_doc_hash(const char *name)
+{
+    HASHCTL ctl;
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(char *);
+    ctl.entrysize = sizeof(hier_doc_bucket);
+    ctl.hash = doc_key_hash;
+    ctl.match = doc_key_match;
+    ctl.hcxt = CurrentMemoryContext;
+    return hash_create(name, 256, &ctl,
+                       HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+}
+
+// key must outlive the hash table
+static hier_doc_bucket *
+doc_bucket(HTAB *docs, char *key)
+{
+    bool found;
+    hier_doc_bucket *bucket = hash_search(docs, &key, HASH_ENTER, &found);
+
+    if (!found)
+        bucket->docs = NIL;
+    return bucket;
+}
+
+/**************************************
+ * Column helpers. DSL names are pasted
+ * unquoted into SQL, match them the way
+ * the parser would.
+ **************************************/
+static int
+find_attr(TupleDesc desc, const char *name)
+{
+    char *attname = downcase_identifier(name, strlen(name), false, false);
+
+    for (int i = 0; i < desc->natts; i++)
+    {
+        Form_pg_attribute attr = TupleDescAttr(desc, i);
+        if (!attr->attisdropped && strcmp(NameStr(attr->attname), attname) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void
+bind_keymap(hier_keymap *map, TupleDesc desc, int nkeys, char **names,
+            const char *table)
+{
+    map->nkeys = nkeys;
+    map->idx = palloc(Max(nkeys, 1) * sizeof(int));
+    map->out = palloc(Max(nkeys, 1) * sizeof(FmgrInfo));
+
+    for (int i = 0; i < nkeys; i++)
+    {
+        Oid outfunc;
+        bool is_varlena;
+
+        map->idx[i] = find_attr(desc, names[i]);
+        if (map->idx[i] < 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_UNDEFINED_COLUMN),
+                     errmsg("column \"%s\" of relation \"%s\" does not exist",
+                            names[i], table)));
+
+        getTypeOutputInfo(TupleDescAttr(desc, map->idx[i])->atttypid,
+                          &outfunc, &is_varlena);
+        fmgr_info(outfunc, &map->out[i]);
+    }
+}
+
+// NULL when any key column is NULL, it can never match
+static char *
+make_key(hier_keymap *map, Datum *values, bool *nulls)
+{
+    StringInfoData key;
+
+    initStringInfo(&key);
+    for (int i = 0; i < map->nkeys; i++)
+    {
+        int idx = map->idx[i];
+
+        if (nulls[idx])
+        {
+            pfree(key.data);
+            return NULL;
+        }
+        if (i > 0)
+            appendStringInfoChar(&key, '\x1f');
+        appendStringInfoString(&key, OutputFunctionCall(&map->out[i], values[idx]));
+    }
+    return key.data;
+}
+
+/**************************************
+ * Builds the object for one row, its
+ * own columns plus one array per child
+ * looked up by this row's key values.
+ * Child documents are attached, not
+ * copied; the row's values are copied
+ * out, conversion scratch goes in
+ * row_cxt.
+ **************************************/
+static hier_jb *
+build_doc(hier_exec_node *en, Datum *values, bool *nulls, MemoryContext row_cxt)
+{
+    hier_jb *doc = hier_jb_object();
+    hier_node *node = en->node;
+
+    for (int i = 0; i < en->ncolumns; i++)
+    {
+        MemoryContext oldcxt;
+        JsonbValue val;
+
+        if (nulls[en->col_idx[i]])
+        {
+            hier_jb_put(doc, node->columns->data[i], hier_jb_null());
+            continue;
+        }
+
+        oldcxt = MemoryContextSwitchTo(row_cxt);
+        pg_hier_convert(en->convert, i, values[en->col_idx[i]], &val);
+        MemoryContextSwitchTo(oldcxt);
+        hier_jb_put(doc, node->columns->data[i], hier_jb_value(&val));
+    }
+
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_exec_node *child = en->children[c];
+        hier_doc_bucket *bucket = NULL;
+        MemoryContext oldcxt;
+        char *child_key;
+        hier_jb *array;
+        ListCell *lc;
+
+        oldcxt = MemoryContextSwitchTo(row_cxt);
+        child_key = make_key(&en->child_keys[c], values, nulls);
+        MemoryContextSwitchTo(oldcxt);
+
+        if (child_key != NULL)
+            bucket = hash_search(child->docs, &child_key, HASH_FIND, NULL);
+
+        // jsonb_agg over no rows is NULL, match it
+        if (bucket == NULL || bucket->docs == NIL)
+        {
+            hier_jb_put(doc, child->node->table, hier_jb_null());
+            continue;
+        }
+
+        array = hier_jb_array();
+        foreach(lc, bucket->docs)
+            hier_jb_append(array, (hier_jb *) lfirst(lc));
+        hier_jb_put(doc, child->node->table, array);
+    }
+
+    return doc;
+}
+
+static Jsonb *
+docs_to_array(List *docs)
+{
+    hier_jb *array = hier_jb_array();
+    ListCell *lc;
+
+    foreach(lc, docs)
+        hier_jb_append(array, (hier_jb *) lfirst(lc));
+    return hier_jb_finish(array);
+}
+
+/**************************************
+ * Native executor
+ **************************************/
+static Relation
+native_open(const char *table)
+{
+    return table_openrv(pg_hier_rangevar(table), AccessShareLock);
+}
+
+/**************************************
+ * Direct scans skip the checks the
+ * executor applies, only take tables
+ * the SQL path would read unfiltered.
+ **************************************/
+static bool
+native_usable(const char *table)
+{
+    Relation rel = native_open(table);
+    Oid relid = RelationGetRelid(rel);
+    char relkind = rel->rd_rel->relkind;
+    bool usable = true;
+
+    if (relkind != RELKIND_RELATION && relkind != RELKIND_MATVIEW)
+    {
+        elog(DEBUG1, "pg_hier native executor: \"%s\" is not a plain table", table);
+        usable = false;
+    }
+    else if (pg_class_aclcheck(relid, GetUserId(), ACL_SELECT) != ACLCHECK_OK)
+    {
+        elog(DEBUG1, "pg_hier native executor: no table-level SELECT on \"%s\"", table);
+        usable = false;
+    }
+    else if (check_enable_rls(relid, InvalidOid, true) == RLS_ENABLED)
+    {
+        elog(DEBUG1, "pg_hier native executor: row level security on \"%s\"", table);
+        usable = false;
+    }
+
+    table_close(rel, NoLock);
+    return usable;
+}
+
+static bool
+native_check(hier_node *node, hier_header *hh)
+{
+    if (node->where != NULL)
+    {
+        elog(DEBUG1, "pg_hier native executor: WHERE on \"%s\"", node->table);
+        return false;
+    }
+    if (node->required)
+    {
+        elog(DEBUG1, "pg_hier native executor: INNER on \"%s\"", node->table);
+        return false;
+    }
+    if (!native_usable(node->table))
+        return false;
+
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_node *child = node->children[c];
+        hier_path *path = pg_hier_catalog_path(hh->hier_id, node->table, child->table);
+
+        if (path->nhops == 0)
+        {
+            elog(DEBUG1, "pg_hier native executor: no path from \"%s\" to \"%s\"",
+                 node->table, child->table);
+            return false;
+        }
+        for (int h = 0; h < path->nhops; h++)
+        {
+            if (path->hops[h].nkeys == 0)
+                return false;
+            if (h > 0 && !native_usable(path->hops[h].name))
+                return false;
+        }
+        if (!native_check(child, hh))
+            return false;
+    }
+    return true;
+}
+
+/**************************************
+ * Scans one level once, children
+ * first, hashing each row's document
+ * under the key it shares with the
+ * level above.
+ **************************************/
+static hier_exec_node *
+native_level(hier_node *node, hier_path *path, hier_header *hh,
+             MemoryContext row_cxt)
+{
+    hier_exec_node *en = palloc0(sizeof(hier_exec_node));
+    int nchildren = Max(node->nchildren, 1);
+    Relation rel;
+    TupleDesc desc;
+    TableScanDesc scan;
+    TupleTableSlot *slot;
+
+    en->node = node;
+    en->path = path;
+    en->children = palloc0(nchildren * sizeof(hier_exec_node *));
+    en->child_keys = palloc0(nchildren * sizeof(hier_keymap));
+
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_path *child_path = pg_hier_catalog_path(hh->hier_id, node->table,
+                                                     node->children[c]->table);
+        en->children[c] = native_level(node->children[c], child_path, hh, row_cxt);
+    }
+
+    rel = native_open(node->table);
+    desc = RelationGetDescr(rel);
+
+    en->ncolumns = node->columns->size;
+    en->col_idx = palloc(Max(en->ncolumns, 1) * sizeof(int));
+    for (int i = 0; i < en->ncolumns; i++)
+    {
+        en->col_idx[i] = find_attr(desc, node->columns->data[i]);
+        if (en->col_idx[i] < 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_UNDEFINED_COLUMN),
+                     errmsg("column \"%s\" of relation \"%s\" does not exist",
+                            node->columns->data[i], node->table)));
+    }
+    en->convert = pg_hier_convert_plan(desc, en->ncolumns, en->col_idx);
+
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_path *child_path = en->children[c]->path;
+        hier_hop *last = &child_path->hops[child_path->nhops - 1];
+        bind_keymap(&en->child_keys[c], desc, last->nkeys, last->parent_keys, node->table);
+    }
+
+    if (path)
+    {
+        bind_keymap(&en->link, desc, path->hops[0].nkeys, path->hops[0].child_keys, node->table);
+        en->docs = create_doc_hash("pg_hier native level");
+    }
+
+    scan = table_beginscan(rel, GetActiveSnapshot(), 0, NULL);
+    slot = table_slot_create(rel, NULL);
+
+    while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+    {
+        MemoryContext oldcxt;
+        hier_jb *doc;
+        char *key = NULL;
+
+        CHECK_FOR_INTERRUPTS();
+        slot_getallattrs(slot);
+
+        doc = build_doc(en, slot->tts_values, slot->tts_isnull, row_cxt);
+        if (path)
+        {
+            oldcxt = MemoryContextSwitchTo(row_cxt);
+            key = make_key(&en->link, slot->tts_values, slot->tts_isnull);
+            MemoryContextSwitchTo(oldcxt);
+        }
+
+        if (path == NULL)
+            en->root_docs = lappend(en->root_docs, doc);
+        else if (key != NULL)
+        {
+            hier_doc_bucket *bucket = doc_bucket(en->docs, pstrdup(key));
+            bucket->docs = lappend(bucket->docs, doc);
+        }
+
+        MemoryContextReset(row_cxt);
+    }
+
+    ExecDropSingleTupleTableSlot(slot);
+    table_endscan(scan);
+    table_close(rel, NoLock);
+
+    // Carry the documents up through intermediate tables
+    for (int h = 1; path && h < path->nhops; h++)
+        en->docs = native_rekey(en->docs, &path->hops[h - 1], &path->hops[h], row_cxt);
+
+    return en;
+}
+
+/**************************************
+ * Scans an intermediate table once and
+ * files the documents found under its
+ * own key by the key of the next hop.
+ **************************************/
+static HTAB *
+native_rekey(HTAB *docs, hier_hop *below, hier_hop *hop, MemoryContext row_cxt)
+{
+    HTAB *rekeyed = create_doc_hash("pg_hier native hop");
+    Relation rel = native_open(hop->name);
+    TupleDesc desc = RelationGetDescr(rel);
+    hier_keymap in_map;
+    hier_keymap out_map;
+    TableScanDesc scan;
+    TupleTableSlot *slot;
+
+    bind_keymap(&in_map, desc, below->nkeys, below->parent_keys, hop->name);
+    bind_keymap(&out_map, desc, hop->nkeys, hop->child_keys, hop->name);
+
+    scan = table_beginscan(rel, GetActiveSnapshot(), 0, NULL);
+    slot = table_slot_create(rel, NULL);
+
+    while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+    {
+        MemoryContext oldcxt;
+        hier_doc_bucket *found = NULL;
+        char *in_key;
+        char *out_key = NULL;
+
+        CHECK_FOR_INTERRUPTS();
+        slot_getallattrs(slot);
+
+        oldcxt = MemoryContextSwitchTo(row_cxt);
+        in_key = make_key(&in_map, slot->tts_values, slot->tts_isnull);
+        if (in_key != NULL)
+            found = hash_search(docs, &in_key, HASH_FIND, NULL);
+        if (found != NULL && found->docs != NIL)
+            out_key = make_key(&out_map, slot->tts_values, slot->tts_isnull);
+        MemoryContextSwitchTo(oldcxt);
+
+        if (out_key != NULL)
+        {
+            hier_doc_bucket *bucket = doc_bucket(rekeyed, pstrdup(out_key));
+            bucket->docs = list_concat(bucket->docs, found->docs);
+        }
+
+        MemoryContextReset(row_cxt);
+    }
+
+    ExecDropSingleTupleTableSlot(slot);
+    table_endscan(scan);
+    table_close(rel, NoLock);
+
+    return rekeyed;
+}
+
+/**************************************
+ * Runs the DSL without generating SQL,
+ * every level is read with one table
+ * scan and joined through hash tables.
+ * Returns false when the DSL needs the
+ * SQL path (WHERE clauses, views, row
+ * level security, column privileges).
+ **************************************/
+bool
+pg_hier_exec_native(const char *input, Datum *result, bool *is_null)
+{
+    MemoryContext exec_cxt;
+    MemoryContext row_cxt;
+    MemoryContext oldcxt;
+    hier_ast *ast;
+    hier_node *tree;
+    string_array *tables;
+    hier_header *hh;
+    hier_exec_node *root;
+
+    exec_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                     "pg_hier native executor",
+                                     ALLOCSET_DEFAULT_SIZES);
+    oldcxt = MemoryContextSwitchTo(exec_cxt);
+
+    ast = pg_hier_parse_dsl(input);
+    tree = ast->root;
+    tables = ast->tables;
+    if (tables->size < 2)
+        ereport(ERROR, (errmsg("At least two tables are needed for hierarchical query.")));
+
+    hh = CREATE_HIER_HEADER();
+    pg_hier_find_hier(tables, hh);
+
+    if (hh->hier_id < 0 || !native_check(tree, hh))
+    {
+        MemoryContextSwitchTo(oldcxt);
+        MemoryContextDelete(exec_cxt);
+        return false;
+    }
+
+    row_cxt = AllocSetContextCreate(exec_cxt, "pg_hier native row",
+                                    ALLOCSET_DEFAULT_SIZES);
+    root = native_level(tree, NULL, hh, row_cxt);
+
+    *is_null = root->root_docs == NIL;
+    if (!*is_null)
+    {
+        // Serialized straight into the caller's context
+        List *docs = root->root_docs;
+
+        MemoryContextSwitchTo(oldcxt);
+        *result = JsonbPGetDatum(docs_to_array(docs));
+    }
+
+    pg_hier_arena_sample();
+    MemoryContextSwitchTo(oldcxt);
+    MemoryContextDelete(exec_cxt);
+    return true;
+}
+
+/**************************************
+ * Batched executor
+ **************************************/
+static hier_exec_node *
+batched_node(hier_node *node, hier_path *path, hier_header *hh)
+{
+    hier_exec_node *en = palloc0(sizeof(hier_exec_node));
+    int nchildren = Max(node->nchildren, 1);
+
+    en->node = node;
+    en->path = path;
+    en->children = palloc0(nchildren * sizeof(hier_exec_node *));
+    en->child_keys = palloc0(nchildren * sizeof(hier_keymap));
+
+    for (int c = 0; c < node->nchildren; c++)
+        en->children[c] = batched_node(node->children[c],
+                                       pg_hier_catalog_path(hh->hier_id, node->table,
+                                                            node->children[c]->table),
+                                       hh);
+    return en;
+}
+
+// Each level is queried alone, its WHERE cannot see the levels above
+static bool
+where_names_ancestor(hier_node *node, List *ancestors)
+{
+    ListCell *lc;
+
+    foreach(lc, ancestors)
+        if (pg_hier_where_mentions(node->where, ((hier_node *) lfirst(lc))->table))
+            return true;
+    return false;
+}
+
+static bool
+batched_check(hier_exec_node *en, List *ancestors)
+{
+    bool usable = true;
+
+    if (where_names_ancestor(en->node, ancestors))
+    {
+        elog(DEBUG1, "pg_hier batched executor: WHERE on \"%s\" names an ancestor",
+             en->node->table);
+        return false;
+    }
+
+    ancestors = lappend(ancestors, en->node);
+    for (int c = 0; c < en->node->nchildren && usable; c++)
+    {
+        hier_path *path = en->children[c]->path;
+
+        if (en->children[c]->node->required)
+        {
+            elog(DEBUG1, "pg_hier batched executor: INNER on \"%s\"",
+                 en->children[c]->node->table);
+            usable = false;
+        }
+        else if (path->nhops == 0)
+        {
+            elog(DEBUG1, "pg_hier batched executor: no path from \"%s\" to \"%s\"",
+                 en->node->table, en->children[c]->node->table);
+            usable = false;
+        }
+        for (int h = 0; h < path->nhops && usable; h++)
+            if (path->hops[h].nkeys == 0 ||
+                (h < path->nhops - 1 && path->hops[h].join_clause == NULL))
+                usable = false;
+        if (usable)
+            usable = batched_check(en->children[c], ancestors);
+    }
+    ancestors = list_delete_last(ancestors);
+    return usable;
+}
+
+/**************************************
+ * Builds the query for one level. The
+ * select list holds the DSL columns
+ * (cN), the keys its children link to
+ * (kC_J) and the keys matching the
+ * parent rows (lJ), which are bound as
+ * arrays starting at $key_param.
+ **************************************/
+static void
+batched_query(StringInfo sql, hier_exec_node *en, int key_param)
+{
+    hier_node *node = en->node;
+    hier_path *path = en->path;
+    hier_hop *last = path ? &path->hops[path->nhops - 1] : NULL;
+    bool first = true;
+
+    appendStringInfoString(sql, "SELECT ");
+    for (int i = 0; i < node->columns->size; i++)
+    {
+        appendStringInfo(sql, "%s%s.%s AS c%d", first ? "" : ", ",
+                         node->table, node->columns->data[i], i);
+        first = false;
+    }
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_path *child_path = en->children[c]->path;
+        hier_hop *child_last = &child_path->hops[child_path->nhops - 1];
+
+        for (int j = 0; j < child_last->nkeys; j++)
+        {
+            appendStringInfo(sql, "%s%s.%s AS k%d_%d", first ? "" : ", ",
+                             node->table, child_last->parent_keys[j], c, j);
+            first = false;
+        }
+    }
+    for (int j = 0; last && j < last->nkeys; j++)
+    {
+        appendStringInfo(sql, "%s%s.%s AS l%d", first ? "" : ", ",
+                         last->name, last->child_keys[j], j);
+        first = false;
+    }
+
+    appendStringInfo(sql, " FROM %s", node->table);
+    for (int h = 0; path && h < path->nhops - 1; h++)
+        appendStringInfo(sql, " JOIN %s ON (%s)",
+                         path->hops[h].parent_name, path->hops[h].join_clause);
+
+    if (last == NULL)
+    {
+        if (node->where)
+            appendStringInfo(sql, " WHERE %s", node->where);
+        return;
+    }
+
+    if (last->nkeys == 1)
+        appendStringInfo(sql, " WHERE %s.%s = ANY($%d)",
+                         last->name, last->child_keys[0], key_param);
+    else
+    {
+        appendStringInfoString(sql, " WHERE (");
+        for (int j = 0; j < last->nkeys; j++)
+            appendStringInfo(sql, "%s%s.%s", j > 0 ? ", " : "",
+                             last->name, last->child_keys[j]);
+        appendStringInfoString(sql, ") IN (SELECT * FROM unnest(");
+        for (int j = 0; j < last->nkeys; j++)
+            appendStringInfo(sql, "%s$%d", j > 0 ? ", " : "", key_param + j);
+        appendStringInfoString(sql, "))");
+    }
+
+    if (node->where)
+        appendStringInfo(sql, " AND (%s)", node->where);
+}
+
+/**************************************
+ * Runs the query for one level bound to
+ * the distinct keys of the level above,
+ * then recurses with this level's keys.
+ **************************************/
+static void
+batched_fetch(hier_exec_node *en, hier_params *params,
+              int nkeys, Oid *key_types, Datum *key_arrays)
+{
+    hier_node *node = en->node;
+    StringInfoData sql;
+    int nargs = params->nargs + nkeys;
+    Oid *argtypes = palloc(Max(nargs, 1) * sizeof(Oid));
+    Datum *values = palloc(Max(nargs, 1) * sizeof(Datum));
+    char *nulls = palloc(Max(nargs, 1) * sizeof(char));
+    TupleDesc desc;
+    int ret;
+
+    for (int i = 0; i < params->nargs; i++)
+    {
+        argtypes[i] = params->types[i];
+        values[i] = params->values[i];
+        nulls[i] = params->nulls[i];
+    }
+    for (int j = 0; j < nkeys; j++)
+    {
+        argtypes[params->nargs + j] = key_types[j];
+        values[params->nargs + j] = key_arrays[j];
+        nulls[params->nargs + j] = ' ';
+    }
+
+    initStringInfo(&sql);
+    batched_query(&sql, en, params->nargs + 1);
+
+    ret = SPI_execute_with_args(sql.data, nargs, argtypes, values, nulls, true, 0);
+    if (ret != SPI_OK_SELECT)
+        elog(ERROR, "SPI_execute_with_args failed: %s", SPI_result_code_string(ret));
+
+    // Kept until SPI_finish, assembled once every level is in
+    en->tuptable = SPI_tuptable;
+    en->ntuples = SPI_processed;
+    desc = en->tuptable->tupdesc;
+
+    en->ncolumns = node->columns->size;
+    en->col_idx = palloc(Max(en->ncolumns, 1) * sizeof(int));
+    for (int i = 0; i < en->ncolumns; i++)
+        en->col_idx[i] = i;
+    en->convert = pg_hier_convert_plan(desc, en->ncolumns, en->col_idx);
+
+    if (en->path)
+    {
+        hier_hop *last = &en->path->hops[en->path->nhops - 1];
+        char **names = palloc(last->nkeys * sizeof(char *));
+
+        for (int j = 0; j < last->nkeys; j++)
+            names[j] = psprintf("l%d", j);
+        bind_keymap(&en->link, desc, last->nkeys, names, node->table);
+        en->docs = create_doc_hash("pg_hier batched level");
+    }
+
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_exec_node *child = en->children[c];
+        hier_hop *child_last = &child->path->hops[child->path->nhops - 1];
+        int child_nkeys = child_last->nkeys;
+        char **names = palloc(child_nkeys * sizeof(char *));
+        HTAB *seen = create_doc_hash("pg_hier batched keys");
+        Datum **elems = palloc(child_nkeys * sizeof(Datum *));
+        Oid *child_types = palloc(child_nkeys * sizeof(Oid));
+        Datum *child_arrays = palloc(child_nkeys * sizeof(Datum));
+        Datum *row_values = palloc(desc->natts * sizeof(Datum));
+        bool *row_nulls = palloc(desc->natts * sizeof(bool));
+        int ndistinct = 0;
+
+        for (int j = 0; j < child_nkeys; j++)
+        {
+            names[j] = psprintf("k%d_%d", c, j);
+            elems[j] = palloc(Max(en->ntuples, 1) * sizeof(Datum));
+        }
+        bind_keymap(&en->child_keys[c], desc, child_nkeys, names, node->table);
+
+        // Distinct parent keys become one array per key column
+        for (uint64 r = 0; r < en->ntuples; r++)
+        {
+            char *key;
+            bool found;
+
+            heap_deform_tuple(en->tuptable->vals[r], desc, row_values, row_nulls);
+            key = make_key(&en->child_keys[c], row_values, row_nulls);
+            if (key == NULL)
+                continue;
+
+            hash_search(seen, &key, HASH_ENTER, &found);
+            if (found)
+                continue;
+
+            for (int j = 0; j < child_nkeys; j++)
+                elems[j][ndistinct] = row_values[en->child_keys[c].idx[j]];
+            ndistinct++;
+        }
+
+        if (ndistinct == 0)
+        {
+            child->docs = create_doc_hash("pg_hier batched level");
+            continue;
+        }
+
+        for (int j = 0; j < child_nkeys; j++)
+        {
+            Oid elemtype = TupleDescAttr(desc, en->child_keys[c].idx[j])->atttypid;
+            int16 typlen;
+            bool typbyval;
+            char typalign;
+
+            child_types[j] = get_array_type(elemtype);
+            if (!OidIsValid(child_types[j]))
+                elog(ERROR, "could not find array type for key %s of %s",
+                     child_last->parent_keys[j], node->table);
+
+            get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+            child_arrays[j] = PointerGetDatum(construct_array(elems[j], ndistinct, elemtype,
+                                                              typlen, typbyval, typalign));
+        }
+
+        batched_fetch(child, params, child_nkeys, child_types, child_arrays);
+    }
+}
+
+/**************************************
+ * Builds the documents bottom-up from
+ * the fetched rows.
+ **************************************/
+static void
+batched_assemble(hier_exec_node *en, MemoryContext row_cxt)
+{
+    TupleDesc desc;
+    Datum *values;
+    bool *nulls;
+
+    // Skipped, no parent rows to link to
+    if (en->tuptable == NULL)
+        return;
+
+    for (int c = 0; c < en->node->nchildren; c++)
+        batched_assemble(en->children[c], row_cxt);
+
+    desc = en->tuptable->tupdesc;
+    values = palloc(desc->natts * sizeof(Datum));
+    nulls = palloc(desc->natts * sizeof(bool));
+
+    for (uint64 r = 0; r < en->ntuples; r++)
+    {
+        MemoryContext oldcxt;
+        hier_jb *doc;
+        char *key = NULL;
+
+        CHECK_FOR_INTERRUPTS();
+        heap_deform_tuple(en->tuptable->vals[r], desc, values, nulls);
+
+        doc = build_doc(en, values, nulls, row_cxt);
+        if (en->path)
+        {
+            oldcxt = MemoryContextSwitchTo(row_cxt);
+            key = make_key(&en->link, values, nulls);
+            MemoryContextSwitchTo(oldcxt);
+        }
+
+        if (en->path == NULL)
+            en->root_docs = lappend(en->root_docs, doc);
+        else if (key != NULL)
+        {
+            hier_doc_bucket *bucket = doc_bucket(en->docs, pstrdup(key));
+            bucket->docs = lappend(bucket->docs, doc);
+        }
+
+        MemoryContextReset(row_cxt);
+    }
+}
+
+/**************************************
+ * Runs the DSL with one query per DSL
+ * node, each bound to the key set
+ * collected from its parent level
+ * (WHERE child_key = ANY($n)), and
+ * stitches the rows together in C.
+ * Returns false when the hierarchy
+ * cannot be resolved.
+ **************************************/
+bool
+pg_hier_exec_batched(const char *input, hier_params *params,
+                     Datum *result, bool *is_null)
+{
+    MemoryContext row_cxt;
+    hier_ast *ast;
+    hier_node *tree;
+    string_array *tables;
+    hier_header *hh;
+    hier_exec_node *root;
+    int ret;
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    ast = pg_hier_parse_dsl(input);
+    tree = ast->root;
+    tables = ast->tables;
+    if (tables->size < 2)
+        ereport(ERROR, (errmsg("At least two tables are needed for hierarchical query.")));
+
+    hh = CREATE_HIER_HEADER();
+    pg_hier_find_hier(tables, hh);
+    if (hh->hier_id < 0)
+    {
+        SPI_finish();
+        return false;
+    }
+
+    root = batched_node(tree, NULL, hh);
+    if (!batched_check(root, NIL))
+    {
+        SPI_finish();
+        return false;
+    }
+
+    batched_fetch(root, params, 0, NULL, NULL);
+
+    row_cxt = AllocSetContextCreate(CurrentMemoryContext, "pg_hier batched row",
+                                    ALLOCSET_DEFAULT_SIZES);
+    batched_assemble(root, row_cxt);
+
+    *is_null = root->root_docs == NIL;
+    if (!*is_null)
+        *result = SPI_datumTransfer(JsonbPGetDatum(docs_to_array(root->root_docs)),
+                                    false, -1);
+
+    pg_hier_arena_sample();
+    SPI_finish();
+    return true;
+}
+
+/**************************************
+ * Columnar output
+ *
+ * Binds the DSL columns of a fetched
+ * level to value arrays and indexes its
+ * rows by link key. Columns named twice
+ * share one array.
+ **************************************/
+static hier_columnar_level *
+columnar_level(hier_exec_node *en, MemoryContext row_cxt)
+{
+    hier_columnar_level *level = palloc0(sizeof(hier_columnar_level));
+    hier_node *node = en->node;
+    TupleDesc desc = en->tuptable ? en->tuptable->tupdesc : NULL;
+
+    level->en = en;
+    level->parents = hier_jb_array();
+    level->sources = palloc(Max(node->columns->size, 1) * sizeof(int));
+    level->children = palloc0(Max(node->nchildren, 1) * sizeof(hier_columnar_level *));
+    column_array_init(&level->columns, node->columns->size);
+
+    // A level skipped for lack of parent keys still lists its columns
+    for (int i = 0; i < node->columns->size; i++)
+    {
+        int before = level->columns.num_columns;
+        int idx = column_array_add(&level->columns,
+                                   cstring_to_text(node->columns->data[i]),
+                                   desc ? TupleDescAttr(desc, en->col_idx[i])->atttypid
+                                        : InvalidOid);
+
+        if (level->columns.num_columns > before)
+            level->sources[idx] = i;
+    }
+
+    if (en->path && en->tuptable)
+    {
+        Datum *values = palloc(desc->natts * sizeof(Datum));
+        bool *nulls = palloc(desc->natts * sizeof(bool));
+
+        level->rows = create_doc_hash("pg_hier columnar level");
+        for (uint64 r = 0; r < en->ntuples; r++)
+        {
+            MemoryContext oldcxt;
+            char *key;
+
+            heap_deform_tuple(en->tuptable->vals[r], desc, values, nulls);
+            oldcxt = MemoryContextSwitchTo(row_cxt);
+            key = make_key(&en->link, values, nulls);
+            MemoryContextSwitchTo(oldcxt);
+
+            if (key != NULL)
+            {
+                hier_doc_bucket *bucket = doc_bucket(level->rows, pstrdup(key));
+                bucket->docs = lappend_int(bucket->docs, (int) r);
+            }
+            MemoryContextReset(row_cxt);
+        }
+    }
+
+    for (int c = 0; c < node->nchildren; c++)
+        level->children[c] = columnar_level(en->children[c], row_cxt);
+    return level;
+}
+
+/**************************************
+ * Appends the emitted rows of a level
+ * to its value arrays and emits the
+ * matching child rows, in parent order,
+ * before descending. A child row shared
+ * by several parents is emitted once
+ * per parent, as in the nested output.
+ **************************************/
+static void
+columnar_emit(hier_columnar_level *level, MemoryContext row_cxt)
+{
+    hier_exec_node *en = level->en;
+    ColumnArrayState *columns = &level->columns;
+    TupleDesc desc;
+    Datum *values;
+    bool *nulls;
+    int position = 0;
+    ListCell *lc;
+
+    if (en->tuptable == NULL)
+        return;
+
+    desc = en->tuptable->tupdesc;
+    values = palloc(desc->natts * sizeof(Datum));
+    nulls = palloc(desc->natts * sizeof(bool));
+
+    foreach(lc, level->emitted)
+    {
+        hier_jb *offset = NULL;
+        MemoryContext oldcxt;
+        JsonbValue val;
+
+        CHECK_FOR_INTERRUPTS();
+        heap_deform_tuple(en->tuptable->vals[lfirst_int(lc)], desc, values, nulls);
+
+        for (int j = 0; j < columns->num_columns; j++)
+        {
+            int i = level->sources[j];
+
+            if (nulls[en->col_idx[i]])
+            {
+                hier_jb_append(columns->column_values[j], hier_jb_null());
+                continue;
+            }
+
+            oldcxt = MemoryContextSwitchTo(row_cxt);
+            pg_hier_convert(en->convert, i, values[en->col_idx[i]], &val);
+            MemoryContextSwitchTo(oldcxt);
+            hier_jb_append(columns->column_values[j], hier_jb_value(&val));
+        }
+
+        for (int c = 0; c < en->node->nchildren; c++)
+        {
+            hier_columnar_level *child = level->children[c];
+            hier_doc_bucket *bucket = NULL;
+            char *key;
+            ListCell *rc;
+
+            if (child->rows == NULL)
+                continue;
+
+            oldcxt = MemoryContextSwitchTo(row_cxt);
+            key = make_key(&en->child_keys[c], values, nulls);
+            MemoryContextSwitchTo(oldcxt);
+            if (key != NULL)
+                bucket = hash_search(child->rows, &key, HASH_FIND, NULL);
+            if (bucket == NULL)
+                continue;
+
+            // One offset node, attached to every child row
+            if (offset == NULL)
+            {
+                val.type = jbvNumeric;
+                val.val.numeric = int64_to_numeric(position);
+                offset = hier_jb_value(&val);
+            }
+
+            foreach(rc, bucket->docs)
+            {
+                child->emitted = lappend_int(child->emitted, lfirst_int(rc));
+                hier_jb_append(child->parents, offset);
+            }
+        }
+
+        MemoryContextReset(row_cxt);
+        position++;
+    }
+
+    for (int c = 0; c < en->node->nchildren; c++)
+        columnar_emit(level->children[c], row_cxt);
+}
+
+static hier_jb *
+columnar_doc(hier_columnar_level *level)
+{
+    hier_node *node = level->en->node;
+    ColumnArrayState *columns = &level->columns;
+    hier_jb *doc = hier_jb_object();
+    hier_jb *values = hier_jb_object();
+    hier_jb *types = hier_jb_object();
+    hier_jb *children = hier_jb_array();
+    JsonbValue val;
+
+    val.type = jbvString;
+    val.val.string.val = node->table;
+    val.val.string.len = strlen(node->table);
+    hier_jb_put(doc, "table", hier_jb_value(&val));
+
+    val.type = jbvNumeric;
+    val.val.numeric = int64_to_numeric(list_length(level->emitted));
+    hier_jb_put(doc, "count", hier_jb_value(&val));
+    if (level->en->path)
+        hier_jb_put(doc, "parent", level->parents);
+
+    for (int j = 0; j < columns->num_columns; j++)
+    {
+        char *name = text_to_cstring(columns->column_names[j]);
+
+        hier_jb_put(values, name, columns->column_values[j]);
+        if (!OidIsValid(columns->column_types[j]))
+        {
+            hier_jb_put(types, name, hier_jb_null());
+            continue;
+        }
+        val.type = jbvString;
+        val.val.string.val = format_type_be(columns->column_types[j]);
+        val.val.string.len = strlen(val.val.string.val);
+        hier_jb_put(types, name, hier_jb_value(&val));
+    }
+    hier_jb_put(doc, "columns", values);
+    hier_jb_put(doc, "types", types);
+
+    for (int c = 0; c < node->nchildren; c++)
+        hier_jb_append(children, columnar_doc(level->children[c]));
+    hier_jb_put(doc, "children", children);
+    return doc;
+}
+
+// First node whose WHERE names one of its ancestors
+static hier_node *
+columnar_where(hier_node *node, List *ancestors)
+{
+    hier_node *named = NULL;
+
+    if (where_names_ancestor(node, ancestors))
+        return node;
+
+    ancestors = lappend(ancestors, node);
+    for (int c = 0; c < node->nchildren && named == NULL; c++)
+        named = columnar_where(node->children[c], ancestors);
+    ancestors = list_delete_last(ancestors);
+    return named;
+}
+
+/**************************************
+ * Fetches the DSL level by level like
+ * the batched executor, then returns
+ * one value array per column and level
+ * instead of nested documents:
+ *
+ * {"table": t, "count": n,
+ *  "columns": {col: [..]},
+ *  "types": {col: type},
+ *  "children": [{.., "parent": [..]}]}
+ *
+ * parent holds, per row, the position
+ * of its parent row in the level above.
+ **************************************/
+Datum
+pg_hier_exec_columnar(const char *input, hier_params *params)
+{
+    MemoryContext row_cxt;
+    hier_ast *ast;
+    hier_header *hh;
+    hier_exec_node *root;
+    hier_columnar_level *level;
+    hier_node *named;
+    Datum result;
+    int ret;
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    ast = pg_hier_parse_dsl(input);
+    if (ast->tables->size < 2)
+        ereport(ERROR, (errmsg("At least two tables are needed for hierarchical query.")));
+
+    hh = CREATE_HIER_HEADER();
+    pg_hier_find_hier(ast->tables, hh);
+    if (hh->hier_id < 0)
+        ereport(ERROR, (errmsg("No hierarchy found for %s", input)));
+
+    if ((named = columnar_where(ast->root, NIL)) != NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("Columnar output does not support a WHERE on %s naming an ancestor table",
+                        named->table),
+                 errhint("Use pg_hier for WHERE clauses that compare with ancestor rows.")));
+
+    root = batched_node(ast->root, NULL, hh);
+    if (!batched_check(root, NIL))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("Columnar output needs key joins between every level"),
+                 errhint("INNER blocks are not supported in columnar output.")));
+
+    batched_fetch(root, params, 0, NULL, NULL);
+
+    row_cxt = AllocSetContextCreate(CurrentMemoryContext, "pg_hier columnar row",
+                                    ALLOCSET_DEFAULT_SIZES);
+    level = columnar_level(root, row_cxt);
+    for (uint64 r = 0; r < root->ntuples; r++)
+        level->emitted = lappend_int(level->emitted, (int) r);
+    columnar_emit(level, row_cxt);
+
+    result = SPI_datumTransfer(JsonbPGetDatum(hier_jb_finish(columnar_doc(level))),
+                               false, -1);
+
+    pg_hier_arena_sample();
+    SPI_finish();
+    return result;
+}
+
+/**************************************
+ * Self-referential tree executor
+ *
+ * Builds the object for one row and,
+ * below pg_hier.tree_max_depth, the
+ * rows pointing at it under the table
+ * name. Leaves get NULL, as jsonb_agg
+ * over no rows would.
+ **************************************/
+static hier_jb *
+tree_doc(hier_tree_state *ts, uint64 row, int depth)
+{
+    hier_node *node = ts->node;
+    Datum *values = ts->values + row * ts->natts;
+    bool *nulls = ts->nulls + row * ts->natts;
+    hier_doc_bucket *bucket = NULL;
+    hier_jb *doc = hier_jb_object();
+    char *id;
+
+    check_stack_depth();
+    CHECK_FOR_INTERRUPTS();
+
+    for (int i = 0; i < node->columns->size; i++)
+    {
+        JsonbValue val;
+
+        if (nulls[i])
+            val.type = jbvNull;
+        else
+            pg_hier_convert(ts->convert, i, values[i], &val);
+        hier_jb_put(doc, node->columns->data[i], hier_jb_value(&val));
+    }
+
+    id = depth < pg_hier_tree_max_depth ? make_key(&ts->id, values, nulls) : NULL;
+    if (id != NULL)
+        bucket = hash_search(ts->children, &id, HASH_FIND, NULL);
+
+    if (bucket == NULL)
+        hier_jb_put(doc, node->table, hier_jb_null());
+    else
+    {
+        hier_jb *array = hier_jb_array();
+        ListCell *lc;
+
+        foreach(lc, bucket->docs)
+            hier_jb_append(array, tree_doc(ts, (uint64) lfirst_int(lc), depth + 1));
+        hier_jb_put(doc, node->table, array);
+    }
+    return doc;
+}
+
+/**************************************
+ * Runs a single-table DSL over a table
+ * registered with pg_hier_create_tree.
+ * The table is read with one query, the
+ * rows are grouped by parent key and
+ * nested recursively in C. Roots are
+ * the rows matching the DSL WHERE, or
+ * without a parent when there is none.
+ * An indexed tree with a WHERE reads
+ * just the subtrees below the roots.
+ * Returns false for any other DSL.
+ **************************************/
+bool
+pg_hier_exec_tree(const char *input, hier_params *params,
+                  Datum *result, bool *is_null)
+{
+    hier_tree_state ts;
+    hier_keymap parent;
+    hier_ast *ast;
+    hier_node *node;
+    StringInfoData sql;
+    TupleDesc desc;
+    char **id_keys;
+    char **parent_keys;
+    char **names;
+    List *roots = NIL;
+    ListCell *lc;
+    int nkeys;
+    int root_col;
+    bool closure;
+    int ret;
+
+    ast = pg_hier_parse_dsl(input);
+    node = ast->root;
+    if (ast->tables->size != 1)
+    {
+        pg_hier_free_ast(ast);
+        return false;
+    }
+
+    // Memoized with the catalog, no query for other single-table DSLs
+    if (!pg_hier_catalog_tree(node->table, &id_keys, &parent_keys, &nkeys, &closure))
+    {
+        pg_hier_free_ast(ast);
+        return false;
+    }
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    // Columns (cN), own key (iJ), parent key (pJ), root flag
+    initStringInfo(&sql);
+    appendStringInfoString(&sql, "SELECT ");
+    for (int i = 0; i < node->columns->size; i++)
+        appendStringInfo(&sql, "%s.%s AS c%d, ", node->table, node->columns->data[i], i);
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(&sql, "%s.%s AS i%d, %s.%s AS p%d, ",
+                         node->table, quote_identifier(id_keys[j]), j,
+                         node->table, quote_identifier(parent_keys[j]), j);
+    if (node->where)
+        appendStringInfo(&sql, "(%s) IS TRUE AS r FROM %s", node->where, node->table);
+    else
+        appendStringInfo(&sql, "true AS r FROM %s", node->table);
+
+    // With a closure index only the selected subtrees are read
+    if (closure && node->where)
+        pg_hier_tree_subtree(&sql, node->table, id_keys, nkeys, node->where,
+                             pg_hier_tree_max_depth);
+
+    ret = SPI_execute_with_args(sql.data, params->nargs, params->types, params->values,
+                                params->nulls, true, 0);
+    if (ret != SPI_OK_SELECT)
+        elog(ERROR, "SPI_execute_with_args failed: %s", SPI_result_code_string(ret));
+
+    desc = SPI_tuptable->tupdesc;
+    ts.node = node;
+    ts.ntuples = SPI_processed;
+    ts.natts = desc->natts;
+    ts.values = palloc(Max(ts.ntuples * ts.natts, 1) * sizeof(Datum));
+    ts.nulls = palloc(Max(ts.ntuples * ts.natts, 1) * sizeof(bool));
+    ts.convert = pg_hier_convert_plan(desc, node->columns->size, NULL);
+
+    names = palloc(nkeys * sizeof(char *));
+    for (int j = 0; j < nkeys; j++)
+        names[j] = psprintf("i%d", j);
+    bind_keymap(&ts.id, desc, nkeys, names, node->table);
+    for (int j = 0; j < nkeys; j++)
+        names[j] = psprintf("p%d", j);
+    bind_keymap(&parent, desc, nkeys, names, node->table);
+    root_col = desc->natts - 1;
+
+    ts.children = create_doc_hash("pg_hier tree children");
+    for (uint64 r = 0; r < ts.ntuples; r++)
+    {
+        Datum *values = ts.values + r * ts.natts;
+        bool *nulls = ts.nulls + r * ts.natts;
+        char *parent_key;
+
+        CHECK_FOR_INTERRUPTS();
+        heap_deform_tuple(SPI_tuptable->vals[r], desc, values, nulls);
+
+        parent_key = make_key(&parent, values, nulls);
+        if (parent_key != NULL)
+        {
+            hier_doc_bucket *bucket = doc_bucket(ts.children, parent_key);
+            bucket->docs = lappend_int(bucket->docs, (int) r);
+        }
+
+        if (node->where ? DatumGetBool(values[root_col]) : parent_key == NULL)
+            roots = lappend_int(roots, (int) r);
+    }
+
+    *is_null = roots == NIL;
+    if (!*is_null)
+    {
+        hier_jb *array = hier_jb_array();
+
+        foreach(lc, roots)
+            hier_jb_append(array, tree_doc(&ts, (uint64) lfirst_int(lc), 1));
+        *result = SPI_datumTransfer(JsonbPGetDatum(hier_jb_finish(array)), false, -1);
+    }
+
+    pg_hier_arena_sample();
+    SPI_finish();
+    pg_hier_free_ast(ast);
+    return true;
+}
@@ -0,0 +1,341 @@
+#include "pg_hier_export.h"
+#include "pg_hier_helper.h"
+
+// DSL node with the first CSV column of its fields, in DSL order
+typedef struct export_level
+{
+    hier_node *node;
+    int first_slot;
+    struct export_level **children;
+} export_level;
+
+// Where lines go, a server file or the result tuplestore
+typedef struct export_sink
+{
+    hier_export_format format;
+    FILE *file;
+    const char *path;
+    ReturnSetInfo *rsinfo;
+    StringInfoData line;
+    export_level *root;
+    int nslots;
+    char **slots; // current CSV row, NULL fields stay empty
+} export_sink;
+
+static export_level *export_levels(hier_node *node, int *next_slot);
+static void clear_slots(export_sink *sink, export_level *level);
+static char *scalar_text(JsonbValue *v);
+static void csv_field(StringInfo buf, const char *value);
+static void csv_header(export_sink *sink, export_level *level, bool *first);
+static void sink_line(export_sink *sink);
+static void csv_rows(export_sink *sink, export_level *level, JsonbContainer *obj);
+static int64 export_run(const char *input, export_sink *sink);
+
+hier_export_format
+pg_hier_export_format(const char *name)
+{
+    if (pg_strcasecmp(name, "ndjson") == 0)
+        return HIER_EXPORT_NDJSON;
+    if (pg_strcasecmp(name, "csv") == 0)
+        return HIER_EXPORT_CSV;
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("Unknown export format %s, expected ndjson or csv", name)));
+    return HIER_EXPORT_NDJSON;
+}
+
+static export_level *
+export_levels(hier_node *node, int *next_slot)
+{
+    export_level *level = palloc(sizeof(export_level));
+
+    level->node = node;
+    level->first_slot = *next_slot;
+    *next_slot += node->columns->size;
+    level->children = palloc(Max(node->nchildren, 1) * sizeof(export_level *));
+    for (int c = 0; c < node->nchildren; c++)
+        level->children[c] = export_levels(node->children[c], next_slot);
+    return level;
+}
+
+static void
+clear_slots(export_sink *sink, export_level *level)
+{
+    for (int i = 0; i < level->node->columns->size; i++)
+        sink->slots[level->first_slot + i] = NULL;
+    for (int c = 0; c < level->node->nchildren; c++)
+        clear_slots(sink, level->children[c]);
+}
+
+static char *
+scalar_text(JsonbValue *v)
+{
+    switch (v->type)
+    {
+    case jbvNull:
+        return NULL;
+    case jbvString:
+        return pnstrdup(v->val.string.val, v->val.string.len);
+    case jbvNumeric:
+        return DatumGetCString(DirectFunctionCall1(numeric_out,
+                                                   NumericGetDatum(v->val.numeric)));
+    case jbvBool:
+        return v->val.boolean ? "true" : "false";
+    case jbvBinary:
+        return JsonbToCString(NULL, v->val.binary.data, v->val.binary.len);
+    default:
+        elog(ERROR, "unexpected jsonb value type: %d", (int) v->type);
+    }
+    return NULL;
+}
+
+// COPY CSV conventions, NULL is an empty field and "" an empty string
+static void
+csv_field(StringInfo buf, const char *value)
+{
+    if (value == NULL)
+        return;
+    if (value[0] != '\0' && strpbrk(value, ",\"\n\r") == NULL)
+    {
+        appendStringInfoString(buf, value);
+        return;
+    }
+
+    appendStringInfoChar(buf, '"');
+    for (const char *p = value; *p; p++)
+    {
+        if (*p == '"')
+            appendStringInfoChar(buf, '"');
+        appendStringInfoChar(buf, *p);
+    }
+    appendStringInfoChar(buf, '"');
+}
+
+static void
+csv_header(export_sink *sink, export_level *level, bool *first)
+{
+    hier_node *node = level->node;
+
+    for (int i = 0; i < node->columns->size; i++)
+    {
+        if (!*first)
+            appendStringInfoChar(&sink->line, ',');
+        csv_field(&sink->line, psprintf("%s.%s", node->table, node->columns->data[i]));
+        *first = false;
+    }
+    for (int c = 0; c < node->nchildren; c++)
+        csv_header(sink, level->children[c], first);
+}
+
+static void
+sink_line(export_sink *sink)
+{
+    if (sink->file != NULL)
+    {
+        appendStringInfoChar(&sink->line, '\n');
+        if (fwrite(sink->line.data, 1, sink->line.len, sink->file) != sink->line.len)
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not write to file \"%s\": %m", sink->path)));
+    }
+    else
+    {
+        Datum value = PointerGetDatum(cstring_to_text_with_len(sink->line.data,
+                                                               sink->line.len));
+        bool isnull = false;
+
+        tuplestore_putvalues(sink->rsinfo->setResult, sink->rsinfo->setDesc,
+                             &value, &isnull);
+    }
+    resetStringInfo(&sink->line);
+}
+
+/**************************************
+ * Fills the level's fields from obj and
+ * recurses into every element of every
+ * child array. A record without child
+ * elements is a leaf and ends a row.
+ **************************************/
+static void
+csv_rows(export_sink *sink, export_level *level, JsonbContainer *obj)
+{
+    hier_node *node = level->node;
+    bool leaf = true;
+    JsonbValue found;
+
+    for (int i = 0; i < node->columns->size; i++)
+    {
+        char *name = node->columns->data[i];
+        JsonbValue *v = getKeyJsonValueFromContainer(obj, name, strlen(name), &found);
+
+        sink->slots[level->first_slot + i] = v ? scalar_text(v) : NULL;
+    }
+
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        export_level *child = level->children[c];
+        char *name = child->node->table;
+        JsonbValue *v = getKeyJsonValueFromContainer(obj, name, strlen(name), &found);
+        JsonbIterator *it;
+        JsonbIteratorToken token;
+        JsonbValue elem;
+
+        if (v == NULL || v->type != jbvBinary || !JsonContainerIsArray(v->val.binary.data))
+            continue;
+
+        it = JsonbIteratorInit(v->val.binary.data);
+        while ((token = JsonbIteratorNext(&it, &elem, true)) != WJB_DONE)
+        {
+            if (token != WJB_ELEM || elem.type != jbvBinary ||
+                !JsonContainerIsObject(elem.val.binary.data))
+                continue;
+            csv_rows(sink, child, elem.val.binary.data);
+            leaf = false;
+        }
+        // Sibling branches do not share rows
+        clear_slots(sink, child);
+    }
+
+    if (!leaf)
+        return;
+
+    for (int s = 0; s < sink->nslots; s++)
+    {
+        if (s > 0)
+            appendStringInfoChar(&sink->line, ',');
+        csv_field(&sink->line, sink->slots[s]);
+    }
+    sink_line(sink);
+}
+
+/**************************************
+ * Runs the DSL in rows mode through a
+ * cursor. Every row's lines are built
+ * in a context reset after the row.
+ * Returns the documents exported.
+ **************************************/
+static int64
+export_run(const char *input, export_sink *sink)
+{
+    hier_params *params = palloc0(sizeof(hier_params));
+    MemoryContext row_cxt;
+    SPIPlanPtr plan;
+    Portal portal;
+    int64 count = 0;
+    int ret;
+
+    initStringInfo(&sink->line);
+    if (sink->format == HIER_EXPORT_CSV)
+    {
+        hier_ast *ast = pg_hier_parse_dsl(input);
+        bool first = true;
+
+        sink->nslots = 0;
+        sink->root = export_levels(ast->root, &sink->nslots);
+        sink->slots = palloc0(Max(sink->nslots, 1) * sizeof(char *));
+        csv_header(sink, sink->root, &first);
+        sink_line(sink);
+    }
+
+    row_cxt = AllocSetContextCreate(CurrentMemoryContext, "pg_hier export row",
+                                    ALLOCSET_DEFAULT_SIZES);
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    plan = pg_hier_plan_get(input, params, HIER_OUTPUT_ROWS);
+    portal = SPI_cursor_open(NULL, plan, params->values, params->nulls, true);
+
+    for (;;)
+    {
+        SPI_cursor_fetch(portal, true, pg_hier_fetch_size);
+        if (SPI_processed == 0)
+            break;
+
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            MemoryContext oldcxt;
+            bool isnull;
+            Datum val = SPI_getbinval(SPI_tuptable->vals[i],
+                                      SPI_tuptable->tupdesc, 1, &isnull);
+
+            CHECK_FOR_INTERRUPTS();
+            if (isnull)
+                continue;
+
+            oldcxt = MemoryContextSwitchTo(row_cxt);
+            if (sink->format == HIER_EXPORT_NDJSON)
+            {
+                Jsonb *doc = DatumGetJsonbP(val);
+
+                JsonbToCString(&sink->line, &doc->root, VARSIZE(doc));
+                sink_line(sink);
+            }
+            else
+            {
+                csv_rows(sink, sink->root, &DatumGetJsonbP(val)->root);
+                clear_slots(sink, sink->root);
+            }
+            MemoryContextSwitchTo(oldcxt);
+            MemoryContextReset(row_cxt);
+            count++;
+        }
+        SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(portal);
+    pg_hier_arena_sample();
+    SPI_finish();
+    MemoryContextDelete(row_cxt);
+    return count;
+}
+
+/**************************************
+ * Writes to a file on the server, with
+ * the same rights COPY TO a file needs.
+ **************************************/
+int64
+pg_hier_export_file(const char *input, hier_export_format format, const char *path)
+{
+    export_sink sink;
+    int64 count;
+
+    if (!has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES))
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("permission denied to export to a file"),
+                 errdetail("Only roles with privileges of the \"pg_write_server_files\" role may export to a file.")));
+    if (!is_absolute_path(path))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_NAME),
+                 errmsg("relative path not allowed for pg_hier_export to file")));
+
+    memset(&sink, 0, sizeof(sink));
+    sink.format = format;
+    sink.path = path;
+    sink.file = AllocateFile(path, PG_BINARY_W);
+    if (sink.file == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\" for writing: %m", path)));
+
+    count = export_run(input, &sink);
+
+    if (FreeFile(sink.file) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not close file \"%s\": %m", path)));
+    return count;
+}
+
+// One text row per line, the tuplestore spills past work_mem
+void
+pg_hier_export_store(const char *input, hier_export_format format, ReturnSetInfo *rsinfo)
+{
+    export_sink sink;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.format = format;
+    sink.rsinfo = rsinfo;
+    export_run(input, &sink);
+}
@@ -0,0 +1,154 @@
+#include "pg_hier_format.h"
+#include "pg_hier_helper.h"
+
+static hier_jb *format_row(HeapTuple tuple, TupleDesc desc, char **names,
+                           hier_convert_plan *plan, Datum *values, bool *nulls,
+                           MemoryContext row_cxt);
+static Jsonb *format_run(const char *query, ReturnSetInfo *rsinfo);
+
+/**************************************
+ * Builds the object for one row in the
+ * current context, conversion scratch
+ * goes in row_cxt.
+ **************************************/
+static hier_jb *
+format_row(HeapTuple tuple, TupleDesc desc, char **names, hier_convert_plan *plan,
+           Datum *values, bool *nulls, MemoryContext row_cxt)
+{
+    hier_jb *doc = hier_jb_object();
+
+    heap_deform_tuple(tuple, desc, values, nulls);
+    for (int i = 0; i < desc->natts; i++)
+    {
+        MemoryContext oldcxt;
+        JsonbValue val;
+
+        if (nulls[i])
+        {
+            hier_jb_put(doc, names[i], hier_jb_null());
+            continue;
+        }
+
+        oldcxt = MemoryContextSwitchTo(row_cxt);
+        pg_hier_convert(plan, i, values[i], &val);
+        MemoryContextSwitchTo(oldcxt);
+        hier_jb_put(doc, names[i], hier_jb_value(&val));
+    }
+    return doc;
+}
+
+/**************************************
+ * Returns every row in one array, or
+ * with rsinfo puts each row in the
+ * result tuplestore as soon as it is
+ * built and returns NULL. Each batch is
+ * freed after use.
+ **************************************/
+static Jsonb *
+format_run(const char *query, ReturnSetInfo *rsinfo)
+{
+    MemoryContext row_cxt;
+    hier_jb *array = NULL;
+    Jsonb *result = NULL;
+    hier_convert_plan *plan = NULL;
+    char **names = NULL;
+    Datum *values = NULL;
+    bool *nulls = NULL;
+    SPIPlanPtr spi_plan;
+    Portal portal;
+    int ret;
+
+    row_cxt = AllocSetContextCreate(CurrentMemoryContext, "pg_hier format row",
+                                    ALLOCSET_DEFAULT_SIZES);
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    spi_plan = SPI_prepare(query, 0, NULL);
+    if (spi_plan == NULL)
+        elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+    if (!SPI_is_cursor_plan(spi_plan))
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("Query for pg_hier_format must return rows")));
+
+    portal = SPI_cursor_open(NULL, spi_plan, NULL, NULL, true);
+    if (rsinfo == NULL)
+        array = hier_jb_array();
+
+    for (;;)
+    {
+        TupleDesc desc;
+
+        SPI_cursor_fetch(portal, true, pg_hier_fetch_size);
+        if (SPI_processed == 0)
+            break;
+
+        desc = SPI_tuptable->tupdesc;
+        if (plan == NULL)
+        {
+            plan = pg_hier_convert_plan(desc, desc->natts, NULL);
+            names = palloc(Max(desc->natts, 1) * sizeof(char *));
+            values = palloc(Max(desc->natts, 1) * sizeof(Datum));
+            nulls = palloc(Max(desc->natts, 1) * sizeof(bool));
+            for (int i = 0; i < desc->natts; i++)
+                names[i] = pstrdup(NameStr(TupleDescAttr(desc, i)->attname));
+        }
+
+        for (uint64 r = 0; r < SPI_processed; r++)
+        {
+            MemoryContext oldcxt;
+            Datum doc;
+            bool isnull = false;
+
+            CHECK_FOR_INTERRUPTS();
+            if (rsinfo == NULL)
+            {
+                hier_jb_append(array, format_row(SPI_tuptable->vals[r], desc, names,
+                                                 plan, values, nulls, row_cxt));
+                MemoryContextReset(row_cxt);
+                continue;
+            }
+
+            oldcxt = MemoryContextSwitchTo(row_cxt);
+            doc = JsonbPGetDatum(hier_jb_finish(format_row(SPI_tuptable->vals[r], desc,
+                                                           names, plan, values, nulls,
+                                                           row_cxt)));
+            MemoryContextSwitchTo(oldcxt);
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, &doc, &isnull);
+            MemoryContextReset(row_cxt);
+        }
+        SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(portal);
+    MemoryContextDelete(row_cxt);
+
+    // The rows live in the SPI context, copy the array out before SPI_finish
+    if (array != NULL)
+        result = DatumGetJsonbP(SPI_datumTransfer(JsonbPGetDatum(hier_jb_finish(array)),
+                                                  false, -1));
+
+    pg_hier_arena_sample();
+    SPI_finish();
+    return result;
+}
+
+/**************************************
+ * One jsonb array of row objects. The
+ * rows are copied out of each batch,
+ * only the result itself grows with
+ * the query.
+ **************************************/
+Jsonb *
+pg_hier_format_array(const char *query)
+{
+    return format_run(query, NULL);
+}
+
+// One row object per result row, the tuplestore spills past work_mem
+void
+pg_hier_format_store(const char *query, ReturnSetInfo *rsinfo)
+{
+    format_run(query, rsinfo);
+}
@@ -1,409 +1,358 @@
 #include "pg_hier_helper.h"
 
-void 
-parse_input(StringInfo buf, const char *input, string_array **tables)
-{
-    table_stack *stack = NULL;
-    hier_header *hh = NULL;
-    char *input_copy = NULL;
-    char *token = NULL;
-    char *next_token = NULL;
-    char *saveptr = NULL;
-    bool first_column = true;
-    StringInfoData where_clause;
-    initStringInfo(&where_clause);
-    
-    PG_TRY();
-    {
-        *tables = create_string_array();
-        hh = CREATE_HIER_HEADER();
-        input_copy = pstrdup(input);
-        appendStringInfoString(buf, "jsonb_agg(jsonb_build_object(");
-        token = GET_TOKEN(input_copy, &saveptr);
-        next_token = GET_TOKEN(&saveptr);
-        if (*token == '\0')
-            elog(ERROR, "Expected table name");
-        add_string_to_array(*tables, token);
-        if (!first_column)
-            appendStringInfoString(buf, ", ");
-        stack = create_table_stack_entry(token, stack);
-        token = GET_TOKEN(&saveptr);
-        next_token = GET_TOKEN(&saveptr);
-        while (token)
-        {
-            if (*token == '\0')
-                break;
-            if (next_token && !strcmp(next_token, "{"))
-            {
-                int hier_id;
-                add_string_to_array(*tables, token);
-                stack = create_table_stack_entry(token, stack);
-                if (!first_column)
-                    appendStringInfoString(buf, ", ");
-                appendStringInfo(buf, 
-                    "'%s', (SELECT jsonb_agg(json_build_object(", token);
-                first_column = true;
-                token = GET_TOKEN(&saveptr);
-                next_token = GET_TOKEN(&saveptr);
-            }
-            else
-            {
-                while (token)
-                {
-                    if (*token == '\0')
-                        break;
-                    if (next_token && !strcmp(next_token, "{"))
-                        break;
-                    if (token && strcmp(token, "}") == 0)
-                    {
-                        if (stack == NULL)
-                            ereport(ERROR, 
-                                (errmsg("Unmatched closing brace in input")));
-                        StringInfoData rel_buf;
-                        initStringInfo(&rel_buf);
-                        char *child_table = pop_table_stack(&stack);
-                        char *parent_table = NULL;
-                        
-                        token = next_token;
-                        next_token = GET_TOKEN(&saveptr);
-                        
-                        StringInfoData where_condition;
-                        initStringInfo(&where_condition);
-                        
-                        if (token && !strcmp(token, "WHERE")) {
-                            while (next_token && strcmp(next_token, "}") != 0 && strcmp(next_token, ";")) {
-                                appendStringInfo(&where_condition, "%s ", next_token);
-                                token = next_token;
-                                next_token = GET_TOKEN(&saveptr);
-                                if (!next_token) break;
-                            }
-                        }
-                        
-                        if(stack)
-                        {
-                            parent_table = peek_table_stack(&stack);
-                            pg_hier_get_hier(*tables, hh);
-                            pg_hier_from_clause(&rel_buf, hh, parent_table, child_table);
-                            appendStringInfo(buf, ")) FROM %s", rel_buf.data);
-                            
-                            if (where_condition.len > 0)
-                                appendStringInfo(buf, " AND %s", where_condition.data);
-                            
-                            appendStringInfoString(buf, " )");
-                        } else {
-                            appendStringInfo(buf, ")) FROM %s", child_table);
-                            
-                            if (where_condition.len > 0)
-                                appendStringInfo(buf, " WHERE %s", where_condition.data);
-                            pfree(where_condition.data);
-                            if (child_table)
-                                pfree(child_table);
-                            token = NULL;
-                            next_token = NULL;
-                        }
-                            
-                        if (!token || !next_token) break;
-                        
-                        if (!strcmp(token, "WHERE")) {
-                            token = next_token;
-                            next_token = GET_TOKEN(&saveptr);
-                        } else {
-                            token = token;
-                            next_token = next_token;
-                        }
-                        continue;
-                    }
-                    if (first_column)
-                        first_column = false;
-                    else
-                        appendStringInfoString(buf, ", ");
-                    appendStringInfo(buf, "'%s', %s.%s",
-                                     token, stack->table_name, token);
-                    token = next_token;
-                    next_token = GET_TOKEN(&saveptr);
-                }
-            }
-        }
-    }
-    PG_FINALLY();
-    {
-        if (stack)
-            free_table_stack(&stack);
-        if (input_copy != NULL)
-            pfree(input_copy);
-    }
-    PG_END_TRY();
-}
+int pg_hier_fetch_size = 100;
 
-void
-pg_hier_get_hier(string_array *tables, hier_header *hh)
+// Bumped when a table whose foreign key let a join go changes
+static uint64 join_generation = 0;
+static List *join_fk_relids = NIL;
+static bool join_callback_registered = false;
+
+static void join_relcache_callback(Datum arg, Oid relid);
+static bool fk_guarantees(hier_hop *hop);
+
+/**************************************
+ * DSL table names are pasted unquoted
+ * into SQL, resolve them the way the
+ * parser would.
+ **************************************/
+RangeVar *
+pg_hier_rangevar(const char *table)
 {
-    // Attempts to check 'cache,' if hh is null or
-    // newest table isn't in hh, get new hh
-    if (!hh || hh->deepest_nest < 0)
-        pg_hier_find_hier(tables, hh);
-    else
-        for (int i = hh->deepest_nest; i < tables->size; i++)
-            if(!strstr(hh->hier, tables->data[i]))
-                pg_hier_find_hier(tables, hh);
-    hh->deepest_nest = tables->size - 1;
+    const char *dot = strchr(table, '.');
+
+    if (dot)
+        return makeRangeVar(downcase_identifier(table, dot - table, false, false),
+                            downcase_identifier(dot + 1, strlen(dot + 1), false, false),
+                            -1);
+    return makeRangeVar(NULL, downcase_identifier(table, strlen(table), false, false), -1);
 }
 
 void
 pg_hier_find_hier(string_array *tables, hier_header *hh)
 {
-    string_array *ordered_tables = NULL;
-    char *hierarchy_string = NULL;
-    StringInfoData query;
-    uint64 hier_id = 0;
-    int ret;
-
     if (tables == NULL || tables->size < 2)
         ereport(ERROR, 
             (errmsg("Name path elements must contain at least two elements")));
 
-    initStringInfo(&query);
-    appendStringInfo(&query, "SELECT id, table_path FROM pg_hier_header WHERE ");
-    for (int i = 0; i < tables->size; i++)
-        appendStringInfo(&query, 
-            (
-                (i > 0) ? 
-                " AND table_path LIKE '%%%s%%'" : 
-                "table_path LIKE '%%%s%%'"
-            ), tables->data[i]);
-
-    PG_TRY();
+    // Served from the backend-local compiled catalog,
+    // no metadata query once it is warm
+    pg_hier_catalog_find(tables, hh);
+}
+
+/**************************************
+ * Primary key columns of table in key
+ * order, NULL without one. The order
+ * comes from the key's index, keyset
+ * paging compares rows in that order.
+ **************************************/
+char **
+pg_hier_primary_key(const char *table, int *nkeys)
+{
+    Oid relid = RangeVarGetRelid(pg_hier_rangevar(table), AccessShareLock, false);
+    Oid constraint;
+    HeapTuple tuple;
+    Form_pg_index index;
+    char **keys;
+
+    *nkeys = 0;
+    if (get_primary_key_attnos(relid, false, &constraint) == NULL)
+        return NULL;
+
+    tuple = SearchSysCache1(INDEXRELID, ObjectIdGetDatum(get_constraint_index(constraint)));
+    if (!HeapTupleIsValid(tuple))
+        elog(ERROR, "cache lookup failed for primary key index of %s", table);
+    index = (Form_pg_index) GETSTRUCT(tuple);
+
+    keys = palloc(index->indnkeyatts * sizeof(char *));
+    for (int i = 0; i < index->indnkeyatts; i++)
+        keys[(*nkeys)++] = get_attname(relid, index->indkey.values[i], false);
+    ReleaseSysCache(tuple);
+    return keys;
+}
+
+/**************************************
+ * Join path from parent down to child,
+ * within the DSL's hierarchy or routed
+ * across hierarchies when they differ.
+ **************************************/
+hier_path *
+pg_hier_path(hier_header *hh, const char *parent, const char *child)
+{
+    hier_path *path = pg_hier_catalog_path(hh->hier_id, parent, child);
+
+    if (path->nhops == 0)
+        path = pg_hier_catalog_route(parent, child);
+    return path;
+}
+
+static void
+join_relcache_callback(Datum arg, Oid relid)
+{
+    if (!OidIsValid(relid) || list_member_oid(join_fk_relids, relid))
+        join_generation++;
+}
+
+uint64
+pg_hier_join_generation(void)
+{
+    return join_generation;
+}
+
+// Whole-word, case-insensitive, the way identifiers compare unquoted
+bool
+pg_hier_where_mentions(const char *where, const char *table)
+{
+    int len = strlen(table);
+
+    if (where == NULL)
+        return false;
+    for (const char *p = where; *p; p++)
+    {
+        if (pg_strncasecmp(p, table, len) == 0 &&
+            (p == where || !(isalnum((unsigned char) p[-1]) || p[-1] == '_')) &&
+            !(isalnum((unsigned char) p[len]) || p[len] == '_'))
+            return true;
+    }
+    return false;
+}
+
+/**************************************
+ * True when a validated foreign key on
+ * hop->name over exactly its child keys
+ * references hop->parent_name's parent
+ * keys, i.e. every row with a non-NULL
+ * link has exactly one parent row.
+ **************************************/
+static bool
+fk_guarantees(hier_hop *hop)
+{
+    Oid relid = RangeVarGetRelid(pg_hier_rangevar(hop->name), NoLock, true);
+    Oid ref_relid = RangeVarGetRelid(pg_hier_rangevar(hop->parent_name), NoLock, true);
+    Relation rel;
+    ListCell *lc;
+    bool found = false;
+
+    if (!OidIsValid(relid) || !OidIsValid(ref_relid))
+        return false;
+
+    rel = table_open(relid, AccessShareLock);
+    foreach(lc, RelationGetFKeyList(rel))
     {
-        if ((ret = SPI_connect()) != SPI_OK_CONNECT)
-            elog(ERROR, "SPI_connect failed: %d", ret);
-        
-        if ((ret = SPI_execute(query.data, true, 0)) != SPI_OK_SELECT)
-            elog(ERROR, "SPI_execute failed: %d", ret);
-        
-        if (SPI_processed > 0)
+        ForeignKeyCacheInfo *fk = (ForeignKeyCacheInfo *) lfirst(lc);
+        HeapTuple tuple;
+        bool matched = fk->confrelid == ref_relid && fk->nkeys == hop->nkeys;
+
+        for (int j = 0; j < hop->nkeys && matched; j++)
         {
-            HeapTuple tuple = SPI_tuptable->vals[0];
-            bool isnull;
-            Datum id_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull);
-            Datum path_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isnull);
+            AttrNumber attno = get_attnum(relid, hop->child_keys[j]);
+            AttrNumber ref_attno = get_attnum(ref_relid, hop->parent_keys[j]);
 
-            hier_id = DatumGetUInt64(id_datum);
-            hierarchy_string = pstrdup(TextDatumGetCString(path_datum));
+            matched = false;
+            for (int k = 0; k < fk->nkeys && !matched; k++)
+                matched = fk->conkey[k] == attno && fk->confkey[k] == ref_attno;
+        }
+        if (!matched)
+            continue;
 
-            if (hh)
-                update_hier_header(hh, hierarchy_string, hier_id);
-            else
-                CREATE_HIER_HEADER(pstrdup(hierarchy_string), hier_id);
+        // NOT VALID keys may still have orphans
+        tuple = SearchSysCache1(CONSTROID, ObjectIdGetDatum(fk->conoid));
+        if (HeapTupleIsValid(tuple))
+        {
+            found = ((Form_pg_constraint) GETSTRUCT(tuple))->convalidated;
+            ReleaseSysCache(tuple);
+        }
+        if (found)
+            break;
+    }
+    table_close(rel, AccessShareLock);
 
-            pfree(hierarchy_string);
+    if (found)
+    {
+        MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+        if (!join_callback_registered)
+        {
+            CacheRegisterRelcacheCallback(join_relcache_callback, (Datum) 0);
+            join_callback_registered = true;
         }
+        join_fk_relids = list_append_unique_oid(join_fk_relids, relid);
+        MemoryContextSwitchTo(oldcxt);
     }
-    PG_FINALLY();
+    return found;
+}
+
+/**************************************
+ * Join path for generated SQL. An
+ * intermediate table that only passes
+ * the key through, its key to the
+ * upper table being the very columns
+ * the lower table references, is
+ * dropped and the two hops joined on
+ * the transitive key. A validated
+ * foreign key over the lower hop
+ * proves its rows exist; otherwise an
+ * EXISTS semi-join keeps the filter.
+ * Tables the WHERE clause names stay.
+ **************************************/
+hier_path *
+pg_hier_join_path(hier_header *hh, const char *parent, const char *child, const char *where)
+{
+    hier_path *path = pg_hier_path(hh, parent, child);
+    hier_path *reduced;
+    StringInfoData semi;
+    hier_hop cur;
+
+    if (path->nhops < 2)
+        return path;
+
+    reduced = palloc0(sizeof(hier_path));
+    reduced->hops = palloc(path->nhops * sizeof(hier_hop));
+    initStringInfo(&semi);
+    cur = path->hops[0];
+
+    for (int i = 1; i <= path->nhops; i++)
     {
-        SPI_finish();
-        pfree(query.data);
+        hier_hop *next = i < path->nhops ? &path->hops[i] : NULL;
+        int *map = NULL;
+        bool merge = next != NULL && cur.nkeys > 0 && cur.nkeys == next->nkeys &&
+                     cur.join_clause != NULL && next->join_clause != NULL &&
+                     !pg_hier_where_mentions(where, cur.parent_name);
+
+        // Every key cur reaches must be a key next leaves from
+        if (merge)
+        {
+            map = palloc(cur.nkeys * sizeof(int));
+            for (int j = 0; j < cur.nkeys && merge; j++)
+            {
+                map[j] = -1;
+                for (int m = 0; m < next->nkeys && map[j] < 0; m++)
+                    if (strcmp(cur.parent_keys[j], next->child_keys[m]) == 0)
+                        map[j] = m;
+                merge = map[j] >= 0;
+            }
+        }
+
+        if (merge)
+        {
+            hier_hop merged = cur;
+            StringInfoData clause;
+
+            if (!fk_guarantees(&path->hops[i - 1]))
+            {
+                appendStringInfo(&semi, "%sEXISTS (SELECT 1 FROM %s WHERE ",
+                                 semi.len > 0 ? " AND " : "", cur.parent_name);
+                for (int j = 0; j < cur.nkeys; j++)
+                    appendStringInfo(&semi, "%s%s.%s = %s.%s", j > 0 ? " AND " : "",
+                                     cur.parent_name, cur.parent_keys[j],
+                                     cur.name, cur.child_keys[j]);
+                appendStringInfoChar(&semi, ')');
+            }
+
+            merged.parent_name = next->parent_name;
+            merged.parent_keys = palloc(cur.nkeys * sizeof(char *));
+            for (int j = 0; j < cur.nkeys; j++)
+                merged.parent_keys[j] = next->parent_keys[map[j]];
+
+            initStringInfo(&clause);
+            for (int j = 0; j < merged.nkeys; j++)
+                appendStringInfo(&clause, "%s%s.%s = %s.%s", j > 0 ? " AND " : "",
+                                 merged.name, merged.child_keys[j],
+                                 merged.parent_name, merged.parent_keys[j]);
+            merged.join_clause = clause.data;
+            cur = merged;
+            continue;
+        }
+
+        if (semi.len > 0)
+        {
+            cur.exists_clause = pstrdup(semi.data);
+            resetStringInfo(&semi);
+        }
+        reduced->hops[reduced->nhops++] = cur;
+        if (next != NULL)
+            cur = *next;
     }
-    PG_END_TRY();
+    return reduced;
 }
 
-void 
-pg_hier_from_clause(StringInfo buf, hier_header *hh, char *parent, char *child)
+// Returns whether a correlating WHERE was emitted
+bool
+pg_hier_from_clause(StringInfo buf, hier_header *hh, char *parent, char *child,
+                    const char *where)
 {
-    int ret;
+    hier_path *path;
+    bool correlated = false;
     
     // Input validation
     if (!hh || !parent || !child) {
         elog(WARNING, "Missing required parameters for hierarchy lookup");
         if (child) appendStringInfoString(buf, child);
-        return;
+        return false;
     }
     
-    PG_TRY();
-    {
-        if ((ret = SPI_connect()) != SPI_OK_CONNECT)
-                elog(ERROR, "SPI_connect failed: %d", ret);
-                
-        text *parent_text = parent ? cstring_to_text(parent) : NULL;
-        text *child_text = child ? cstring_to_text(child) : NULL;
-        
-        Oid argtypes[3] = {INT4OID, TEXTOID, TEXTOID};
-        Datum values[3] = {
-            Int32GetDatum(hh->hier_id),
-            PointerGetDatum(parent_text),
-            PointerGetDatum(child_text)
-        };
-        
-        ret = SPI_execute_with_args(
-            PG_HIER_SQL_GET_HIER_BY_ID, 
-            3, argtypes, values, NULL, true, 0);
-            
-        if (parent_text) pfree(parent_text);
-        if (child_text) pfree(child_text);
-        
-        if (ret != SPI_OK_SELECT)
-            elog(ERROR, "SPI_execute failed: %d", ret);
-        
-        if (SPI_processed > 0) {
-            bool first_join = true;
-            HeapTuple last_tuple = NULL;
-            int last_idx = SPI_processed - 1;
-            
-            appendStringInfoString(buf, child);
-            
-            for (int i = 0; i < last_idx; i++) {
-                HeapTuple tuple = SPI_tuptable->vals[i];
-                bool isnull_parent, isnull_child, isnull_parent_key, isnull_child_key;
-                
-                Datum parent_name_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull_parent);
-                Datum parent_key_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isnull_parent_key);
-                Datum child_name_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 3, &isnull_child);
-                Datum child_key_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 4, &isnull_child_key);
-                
-                if (isnull_parent || isnull_child || isnull_parent_key || isnull_child_key) {
-                    elog(WARNING, "Row %d has NULL values in critical fields", i);
-                    continue;
-                }
-                
-                char *parent_name = TextDatumGetCString(parent_name_datum);
-                char *child_name = TextDatumGetCString(child_name_datum);
-                
-                // Process array keys
-                ArrayType *parent_key_array = DatumGetArrayTypeP(parent_key_datum);
-                ArrayType *child_key_array = DatumGetArrayTypeP(child_key_datum);
-                
-                Datum *parent_key_elems, *child_key_elems;
-                bool *parent_key_nulls, *child_key_nulls;
-                int parent_key_nelems, child_key_nelems;
-                
-                int16 typlen;
-                bool typbyval;
-                char typalign;
-                
-                get_typlenbyvalalign(ARR_ELEMTYPE(parent_key_array), &typlen, &typbyval, &typalign);
-                deconstruct_array(parent_key_array, ARR_ELEMTYPE(parent_key_array), 
-                                 typlen, typbyval, typalign,
-                                 &parent_key_elems, &parent_key_nulls, &parent_key_nelems);
-                                 
-                get_typlenbyvalalign(ARR_ELEMTYPE(child_key_array), &typlen, &typbyval, &typalign);
-                deconstruct_array(child_key_array, ARR_ELEMTYPE(child_key_array), 
-                                 typlen, typbyval, typalign,
-                                 &child_key_elems, &child_key_nulls, &child_key_nelems);
-                
-                appendStringInfo(buf, " JOIN %s ON (", parent_name);
-                
-                for (int j = 0; j < parent_key_nelems && j < child_key_nelems; j++) {
-                    if (j > 0) appendStringInfoString(buf, " AND ");
-                    
-                    char *parent_key = TextDatumGetCString(parent_key_elems[j]);
-                    char *child_key = TextDatumGetCString(child_key_elems[j]);
-                    
-                    appendStringInfo(buf, "%s.%s = %s.%s", 
-                                   child_name, child_key, 
-                                   parent_name, parent_key);
-                                   
-                    pfree(parent_key);
-                    pfree(child_key);
-                }
-                
-                appendStringInfoString(buf, ")");
-                
-                pfree(parent_name);
-                pfree(child_name);
-                pfree(parent_key_elems);
-                pfree(child_key_elems);
-                pfree(parent_key_nulls);
-                pfree(child_key_nulls);
-            }
-            
-            if (SPI_processed > 0) {
-                HeapTuple tuple = SPI_tuptable->vals[last_idx];
-                bool isnull_parent, isnull_child, isnull_parent_key, isnull_child_key;
-                
-                Datum parent_name_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull_parent);
-                Datum parent_key_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isnull_parent_key);
-                Datum child_name_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 3, &isnull_child);
-                Datum child_key_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 4, &isnull_child_key);
-                
-                if (!isnull_parent && !isnull_child && !isnull_parent_key && !isnull_child_key) {
-                    char *parent_name = TextDatumGetCString(parent_name_datum);
-                    char *child_name = TextDatumGetCString(child_name_datum);
-                    
-                    ArrayType *parent_key_array = DatumGetArrayTypeP(parent_key_datum);
-                    ArrayType *child_key_array = DatumGetArrayTypeP(child_key_datum);
-                    
-                    Datum *parent_key_elems, *child_key_elems;
-                    bool *parent_key_nulls, *child_key_nulls;
-                    int parent_key_nelems, child_key_nelems;
-                    
-                    int16 typlen;
-                    bool typbyval;
-                    char typalign;
-                    
-                    get_typlenbyvalalign(ARR_ELEMTYPE(parent_key_array), &typlen, &typbyval, &typalign);
-                    deconstruct_array(parent_key_array, ARR_ELEMTYPE(parent_key_array), 
-                                     typlen, typbyval, typalign,
-                                     &parent_key_elems, &parent_key_nulls, &parent_key_nelems);
-                                     
-                    get_typlenbyvalalign(ARR_ELEMTYPE(child_key_array), &typlen, &typbyval, &typalign);
-                    deconstruct_array(child_key_array, ARR_ELEMTYPE(child_key_array), 
-                                     typlen, typbyval, typalign,
-                                     &child_key_elems, &child_key_nulls, &child_key_nelems);
-                    
-                    appendStringInfoString(buf, " WHERE ");
-                    
-                    for (int j = 0; j < parent_key_nelems && j < child_key_nelems; j++) {
-                        if (j > 0) appendStringInfoString(buf, " AND ");
-                        
-                        char *parent_key = TextDatumGetCString(parent_key_elems[j]);
-                        char *child_key = TextDatumGetCString(child_key_elems[j]);
-                        
-                        appendStringInfo(buf, "%s.%s = %s.%s", 
-                                       child_name, child_key, 
-                                       parent_name, parent_key);
-                                       
-                        pfree(parent_key);
-                        pfree(child_key);
-                    }
-                    
-                    // Clean up
-                    pfree(parent_name);
-                    pfree(child_name);
-                    pfree(parent_key_elems);
-                    pfree(child_key_elems);
-                    pfree(parent_key_nulls);
-                    pfree(child_key_nulls);
-                }
-            }
-        } else {
-            appendStringInfoString(buf, child);
-            elog(WARNING, "No hierarchy data found for parent=%s, child=%s", parent, child);
-        }
+    path = pg_hier_join_path(hh, parent, child, where);
+    appendStringInfoString(buf, child);
+
+    if (path->nhops == 0) {
+        elog(WARNING, "No hierarchy data found for parent=%s, child=%s", parent, child);
+        return false;
     }
-    PG_FINALLY();
-    {
-        SPI_finish();
+
+    for (int i = 0; i < path->nhops; i++) {
+        hier_hop *hop = &path->hops[i];
+
+        if (hop->join_clause == NULL) {
+            elog(WARNING, "Level %s has no join keys to %s", hop->name,
+                 hop->parent_name ? hop->parent_name : "(none)");
+            continue;
+        }
+
+        // Every hop but the last joins an intermediate table,
+        // the last one correlates with the enclosing query
+        if (i < path->nhops - 1)
+            appendStringInfo(buf, " JOIN %s ON (%s)", hop->parent_name, hop->join_clause);
+        else
+        {
+            appendStringInfo(buf, " WHERE %s", hop->join_clause);
+            correlated = true;
+        }
+        if (hop->exists_clause)
+            appendStringInfo(buf, " AND %s", hop->exists_clause);
     }
-    PG_END_TRY();
-    
-    SPI_finish();
+    return correlated;
+}
+
+/**************************************
+ * Parses the DSL and builds its
+ * hierarchical SQL into buf.
+ **************************************/
+void
+pg_hier_build_sql(StringInfo buf, const char *input, hier_output_mode mode)
+{
+    hier_ast *ast = pg_hier_parse_dsl(input);
+
+    pg_hier_ast_sql(buf, ast, mode);
+    pg_hier_free_ast(ast);
 }
 
 Datum
-pg_hier_return_one(const char *sql)
+pg_hier_return_one(const char *input, hier_params *params, bool *is_null)
 {
     int ret;
     Datum result = (Datum) NULL;
-    bool is_null;
+    SPIPlanPtr plan;
     
+    *is_null = true;
     if ((ret = SPI_connect()) < 0)
         elog(ERROR, "SPI_connect failed: %s", SPI_result_code_string(ret));
     
-    ret = SPI_execute(sql, true, 0);
+    plan = pg_hier_plan_get(input, params, HIER_OUTPUT_AGGREGATE);
+    ret = SPI_execute_plan(plan, params->values, params->nulls, true, 0);
     
     if (ret != SPI_OK_SELECT)
     {
         SPI_finish();
-        elog(ERROR, "SPI_execute failed: %s", SPI_result_code_string(ret));
+        elog(ERROR, "SPI_execute_plan failed: %s", SPI_result_code_string(ret));
     }
     
     if (SPI_processed > 0 && SPI_tuptable != NULL)  
@@ -413,36 +362,22 @@ pg_hier_return_one(const char *sql)
             bool isnull;
             Datum val = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
             
+            // Copy into the caller's context, SPI_finish
+            // releases everything allocated while connected
             if (!isnull)
-                result = datumCopy(val, false, -1);
+            {
+                result = SPI_datumTransfer(val, false, -1);
+                *is_null = false;
+            }
         }
     }
 
+    pg_hier_arena_sample();
     SPI_finish();
 
     return result;
 }
 
-/**************************************
- * Helper function to trim
- * whitespace from a string
- **************************************/
-static char *
-trim_whitespace(char *str)
-{
-    if (str == NULL)
-        return NULL;
-    while (isspace((unsigned char)*str))
-        str++;
-    if (*str == 0)
-        return str;
-    char *end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end))
-        end--;
-    end[1] = '\0';
-    return str;
-}
-
 /**************************************
  * Helper function to reorder tables
  * based on hierarchy string
@@ -486,271 +421,126 @@ compare_string_positions(const void *a, const void *b)
     return posA->hierarchy_position - posB->hierarchy_position;
 }
 
-JsonbValue
-datum_to_jsonb_value(Datum value_datum, Oid value_type)
+/**************************************
+ * Reads the pg_hier_tree row of table,
+ * false when it is not registered. The
+ * caller is connected to SPI, the keys
+ * are allocated in the current context.
+ * for_update locks the row.
+ **************************************/
+bool
+pg_hier_tree_keys(const char *table, bool for_update, char ***id_keys,
+                  char ***parent_keys, int *nkeys, bool *closure)
 {
-    JsonbValue val;
-    Oid typoutput;
-    bool typIsVarlena;
-    char *outputstr = NULL;
-
-    memset(&val, 0, sizeof(JsonbValue));
+    Oid argtypes[1] = {TEXTOID};
+    Datum values[1] = {CStringGetTextDatum(table)};
+    HeapTuple row;
+    TupleDesc desc;
+    Datum *ids;
+    Datum *parents;
+    int nparents;
+    bool isnull;
+    int ret;
 
-    switch (value_type)
-    {
-    case INT2OID:
-    case INT4OID:
-    case INT8OID:
-    case FLOAT4OID:
-    case FLOAT8OID:
-    case NUMERICOID:
-    {
-        getTypeOutputInfo(value_type, &typoutput, &typIsVarlena);
-        outputstr = OidOutputFunctionCall(typoutput, value_datum);
-        val.type = jbvString;
-        val.val.string.val = pstrdup(outputstr);
-        val.val.string.len = strlen(outputstr);
-        pfree(outputstr);
-        break;
-    }
-    case BOOLOID:
-        val.type = jbvBool;
-        val.val.boolean = DatumGetBool(value_datum);
-        break;
-    case TEXTOID:
-    case VARCHAROID:
+    ret = SPI_execute_with_args(for_update ?
+                                "SELECT id_key, parent_key, closure FROM pg_hier_tree "
+                                "WHERE table_name = $1 FOR UPDATE" :
+                                "SELECT id_key, parent_key, closure FROM pg_hier_tree "
+                                "WHERE table_name = $1",
+                                1, argtypes, values, NULL, !for_update, 1);
+    if (ret != SPI_OK_SELECT)
+        elog(ERROR, "SPI_execute_with_args failed: %s", SPI_result_code_string(ret));
+    if (SPI_processed == 0)
+        return false;
+
+    row = SPI_tuptable->vals[0];
+    desc = SPI_tuptable->tupdesc;
+    deconstruct_array(DatumGetArrayTypeP(SPI_getbinval(row, desc, 1, &isnull)),
+                      TEXTOID, -1, false, TYPALIGN_INT, &ids, NULL, nkeys);
+    deconstruct_array(DatumGetArrayTypeP(SPI_getbinval(row, desc, 2, &isnull)),
+                      TEXTOID, -1, false, TYPALIGN_INT, &parents, NULL, &nparents);
+    if (*nkeys == 0 || nparents != *nkeys)
+        ereport(ERROR, (errmsg("Tree %s must have as many parent keys as id keys", table)));
+    *closure = DatumGetBool(SPI_getbinval(row, desc, 3, &isnull));
+
+    *id_keys = palloc(*nkeys * sizeof(char *));
+    *parent_keys = palloc(*nkeys * sizeof(char *));
+    for (int j = 0; j < *nkeys; j++)
     {
-        text *txt = DatumGetTextPP(value_datum);
-        outputstr = text_to_cstring(txt);
-        val.type = jbvString;
-        val.val.string.val = pstrdup(outputstr);
-        val.val.string.len = strlen(outputstr);
-        pfree(outputstr);
-        break;
+        (*id_keys)[j] = TextDatumGetCString(ids[j]);
+        (*parent_keys)[j] = TextDatumGetCString(parents[j]);
     }
-    default:
-        getTypeOutputInfo(value_type, &typoutput, &typIsVarlena);
-        outputstr = OidOutputFunctionCall(typoutput, value_datum);
-        val.type = jbvString;
-        val.val.string.val = pstrdup(outputstr);
-        val.val.string.len = strlen(outputstr);
-        pfree(outputstr);
-        break;
-    }
-
-    return val;
+    return true;
 }
 
-Jsonb *
-get_or_create_array(Jsonb *existing_jsonb, char *key_str)
+// Entry of ColumnArrayState.column_index
+typedef struct column_index_entry
 {
-    JsonbValue key;
-    JsonbIterator *it;
-    JsonbIteratorToken r;
-    JsonbValue v;
-    JsonbParseState *arr_parse_state = NULL;
-    bool found = false;
+    char name[NAMEDATALEN];
+    int index;
+} column_index_entry;
 
-    key.type = jbvString;
-    key.val.string.val = key_str;
-    key.val.string.len = strlen(key_str);
-
-    if (existing_jsonb)
-    {
-        it = JsonbIteratorInit(&existing_jsonb->root);
-        r = JsonbIteratorNext(&it, &v, true);
-
-        while ((r = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
-        {
-            if (r == WJB_KEY &&
-                v.val.string.len == key.val.string.len &&
-                memcmp(v.val.string.val, key.val.string.val, v.val.string.len) == 0)
-            {
-                found = true;
-
-                r = JsonbIteratorNext(&it, &v, true);
-                if (r == WJB_BEGIN_ARRAY)
-                {
-                    arr_parse_state = NULL;
-                    pushJsonbValue(&arr_parse_state, WJB_BEGIN_ARRAY, NULL);
-
-                    while ((r = JsonbIteratorNext(&it, &v, true)) != WJB_END_ARRAY)
-                    {
-                        if (r == WJB_ELEM)
-                        {
-                            pushJsonbValue(&arr_parse_state, WJB_ELEM, &v);
-                        }
-                    }
-                    break;
-                }
-            }
-        }
-    }
-    if (!found)
-    {
-        arr_parse_state = NULL;
-        pushJsonbValue(&arr_parse_state, WJB_BEGIN_ARRAY, NULL);
-    }
-    if (arr_parse_state != NULL)
-    {
-        return JsonbValueToJsonb(pushJsonbValue(&arr_parse_state, 
-                                                WJB_END_ARRAY, NULL));
-    }
-    else
-    {
-        return NULL;
-    }
-}
-
-int 
-find_column_index(ColumnArrayState *state, text *column_name)
+void
+column_array_init(ColumnArrayState *state, int allocated)
 {
-    for (int i = 0; i < state->num_columns; i++)
-    {
-        text *existing = state->column_names[i];
-        if (VARSIZE_ANY_EXHDR(column_name) == VARSIZE_ANY_EXHDR(existing) &&
-            memcmp(VARDATA_ANY(column_name), VARDATA_ANY(existing),
-                   VARSIZE_ANY_EXHDR(column_name)) == 0)
-        {
-            return i;
-        }
-    }
-    return -1;
+    HASHCTL ctl;
+
+    state->allocated = Max(allocated, 1);
+    state->num_columns = 0;
+    state->column_names = palloc(state->allocated * sizeof(text *));
+    state->column_values = palloc(state->allocated * sizeof(hier_jb *));
+    state->column_types = palloc(state->allocated * sizeof(Oid));
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = NAMEDATALEN;
+    ctl.entrysize = sizeof(column_index_entry);
+    ctl.hcxt = CurrentMemoryContext;
+    state->column_index = hash_create("pg_hier column index", state->allocated, &ctl,
+                                      HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
 }
 
-void 
-datum_to_jsonb(Datum val, Oid val_type, JsonbValue *result)
+/**************************************
+ * Returns the position of column_name,
+ * adding an empty value array for it
+ * the first time the name is seen.
+ **************************************/
+int
+column_array_add(ColumnArrayState *state, text *column_name, Oid column_type)
 {
-    switch (val_type)
-    {
-    case BOOLOID:
-        result->type = jbvBool;
-        result->val.boolean = DatumGetBool(val);
-        break;
-
-    case INT2OID:
-        result->type = jbvNumeric;
-        result->val.numeric = DatumGetNumeric(
-            DirectFunctionCall1(int2_numeric, val));
-        break;
-
-    case INT4OID:
-        result->type = jbvNumeric;
-        result->val.numeric = DatumGetNumeric(
-            DirectFunctionCall1(int4_numeric, val));
-        break;
-
-    case INT8OID:
-        result->type = jbvNumeric;
-        result->val.numeric = DatumGetNumeric(
-            DirectFunctionCall1(int8_numeric, val));
-        break;
-
-    case FLOAT4OID:
-        result->type = jbvNumeric;
-        result->val.numeric = DatumGetNumeric(
-            DirectFunctionCall1(float4_numeric, val));
-        break;
-
-    case FLOAT8OID:
-        result->type = jbvNumeric;
-        result->val.numeric = DatumGetNumeric(
-            DirectFunctionCall1(float8_numeric, val));
-        break;
-
-    case NUMERICOID:
-        result->type = jbvNumeric;
-        result->val.numeric = DatumGetNumeric(val);
-        break;
-
-    case TEXTOID:
-    case VARCHAROID:
-    case BPCHAROID:
-    case NAMEOID:
-    {
-        text *t = DatumGetTextP(val);
-        result->type = jbvString;
-        result->val.string.val = VARDATA_ANY(t);
-        result->val.string.len = VARSIZE_ANY_EXHDR(t);
-        break;
-    }
-
-    case JSONOID:
-    {
-        Jsonb *jb;
-        jb = DatumGetJsonbP(DirectFunctionCall1(to_jsonb, val));
-
-        JsonbContainer *container = &jb->root;
-        if (JB_ROOT_IS_SCALAR(container))
-        {
-            JsonbValue scalar_value;
-            JsonbIterator *it = JsonbIteratorInit(container);
-            JsonbIteratorToken tok = JsonbIteratorNext(&it, &scalar_value, true);
+    char name[NAMEDATALEN];
+    column_index_entry *entry;
+    bool found;
 
-            if (tok == WJB_VALUE)
-            {
-                *result = scalar_value;
-            }
-            else
-            {
-                result->type = jbvString;
-                result->val.string.val = "[Complex JSON value]";
-                result->val.string.len = 20;
-            }
-        }
-        else
-        {
-            result->type = jbvBinary;
-            result->val.binary.data = jb;
-            result->val.binary.len = VARSIZE(jb);
-        }
-        break;
-    }
+    text_to_cstring_buffer(column_name, name, NAMEDATALEN);
+    entry = hash_search(state->column_index, name, HASH_ENTER, &found);
+    if (found)
+        return entry->index;
 
-    case JSONBOID:
+    if (state->num_columns == state->allocated)
     {
-        Jsonb *jb = DatumGetJsonbP(val);
-        JsonbContainer *container = &jb->root;
-
-        if (JB_ROOT_IS_SCALAR(container))
-        {
-            JsonbValue scalar_value;
-            JsonbIterator *it = JsonbIteratorInit(container);
-            JsonbIteratorToken tok = JsonbIteratorNext(&it, &scalar_value, true);
-
-            if (tok == WJB_VALUE)
-            {
-                *result = scalar_value;
-            }
-            else
-            {
-                result->type = jbvString;
-                result->val.string.val = "[Complex JSONB value]";
-                result->val.string.len = 21;
-            }
-        }
-        else
-        {
-            result->type = jbvBinary;
-            result->val.binary.data = jb;
-            result->val.binary.len = VARSIZE(jb);
-        }
-        break;
+        state->allocated *= 2;
+        state->column_names = repalloc(state->column_names,
+                                       state->allocated * sizeof(text *));
+        state->column_values = repalloc(state->column_values,
+                                        state->allocated * sizeof(hier_jb *));
+        state->column_types = repalloc(state->column_types,
+                                       state->allocated * sizeof(Oid));
     }
 
-    default:
-    {
-        char *out_str;
-        Oid output_function_id;
-        bool is_varlena;
+    entry->index = state->num_columns++;
+    state->column_names[entry->index] = column_name;
+    state->column_values[entry->index] = hier_jb_array();
+    state->column_types[entry->index] = column_type;
+    return entry->index;
+}
 
-        getTypeOutputInfo(val_type, &output_function_id, &is_varlena);
-        out_str = OidOutputFunctionCall(output_function_id, val);
+int 
+find_column_index(ColumnArrayState *state, text *column_name)
+{
+    char name[NAMEDATALEN];
+    column_index_entry *entry;
 
-        result->type = jbvString;
-        result->val.string.val = out_str;
-        result->val.string.len = strlen(out_str);
-        break;
-    }
-    }
+    text_to_cstring_buffer(column_name, name, NAMEDATALEN);
+    entry = hash_search(state->column_index, name, HASH_FIND, NULL);
+    return entry ? entry->index : -1;
 }
@@ -0,0 +1,155 @@
+#include "pg_hier_jsonb.h"
+
+#define HIER_JB_INITIAL_ITEMS 8
+
+static hier_jb *jb_container(hier_jb_kind kind);
+static void jb_grow(hier_jb *jb);
+static JsonbValue *jb_push(JsonbParseState **state, hier_jb *jb, JsonbIteratorToken seq);
+
+static hier_jb *
+jb_container(hier_jb_kind kind)
+{
+    hier_jb *jb = palloc0(sizeof(hier_jb));
+
+    jb->kind = kind;
+    return jb;
+}
+
+// Doubling keeps appends amortized O(1)
+static void
+jb_grow(hier_jb *jb)
+{
+    if (jb->count < jb->capacity)
+        return;
+
+    if (jb->capacity == 0)
+    {
+        jb->capacity = HIER_JB_INITIAL_ITEMS;
+        jb->items = palloc(jb->capacity * sizeof(hier_jb *));
+        if (jb->kind == HIER_JB_OBJECT)
+            jb->keys = palloc(jb->capacity * sizeof(JsonbValue));
+        return;
+    }
+
+    jb->capacity *= 2;
+    jb->items = repalloc(jb->items, jb->capacity * sizeof(hier_jb *));
+    if (jb->kind == HIER_JB_OBJECT)
+        jb->keys = repalloc(jb->keys, jb->capacity * sizeof(JsonbValue));
+}
+
+hier_jb *
+hier_jb_object(void)
+{
+    return jb_container(HIER_JB_OBJECT);
+}
+
+hier_jb *
+hier_jb_array(void)
+{
+    return jb_container(HIER_JB_ARRAY);
+}
+
+/**************************************
+ * Copies the value, strings, numerics
+ * and containers included, so v may
+ * point into a tuple about to go away.
+ **************************************/
+hier_jb *
+hier_jb_value(const JsonbValue *v)
+{
+    hier_jb *jb = jb_container(HIER_JB_SCALAR);
+
+    jb->scalar = *v;
+    switch (v->type)
+    {
+    case jbvString:
+        jb->scalar.val.string.val = pnstrdup(v->val.string.val, v->val.string.len);
+        break;
+    case jbvNumeric:
+        jb->scalar.val.numeric = palloc(VARSIZE(v->val.numeric));
+        memcpy(jb->scalar.val.numeric, v->val.numeric, VARSIZE(v->val.numeric));
+        break;
+    case jbvBinary:
+        jb->scalar.val.binary.data = palloc(v->val.binary.len);
+        memcpy(jb->scalar.val.binary.data, v->val.binary.data, v->val.binary.len);
+        break;
+    default:
+        break;
+    }
+    return jb;
+}
+
+hier_jb *
+hier_jb_null(void)
+{
+    hier_jb *jb = jb_container(HIER_JB_SCALAR);
+
+    jb->scalar.type = jbvNull;
+    return jb;
+}
+
+void
+hier_jb_put(hier_jb *obj, const char *key, hier_jb *value)
+{
+    Assert(obj->kind == HIER_JB_OBJECT);
+    jb_grow(obj);
+    obj->keys[obj->count].type = jbvString;
+    obj->keys[obj->count].val.string.val = (char *) key;
+    obj->keys[obj->count].val.string.len = strlen(key);
+    obj->items[obj->count++] = value;
+}
+
+void
+hier_jb_append(hier_jb *arr, hier_jb *value)
+{
+    Assert(arr->kind == HIER_JB_ARRAY);
+    jb_grow(arr);
+    arr->items[arr->count++] = value;
+}
+
+/**************************************
+ * One walk into a single parse state,
+ * pushJsonbValue sorts the keys of each
+ * object as it closes and unpacks
+ * jbvBinary values in place.
+ **************************************/
+static JsonbValue *
+jb_push(JsonbParseState **state, hier_jb *jb, JsonbIteratorToken seq)
+{
+    JsonbValue *res;
+
+    check_stack_depth();
+
+    switch (jb->kind)
+    {
+    case HIER_JB_OBJECT:
+        pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+        for (int i = 0; i < jb->count; i++)
+        {
+            pushJsonbValue(state, WJB_KEY, &jb->keys[i]);
+            jb_push(state, jb->items[i], WJB_VALUE);
+        }
+        res = pushJsonbValue(state, WJB_END_OBJECT, NULL);
+        break;
+    case HIER_JB_ARRAY:
+        pushJsonbValue(state, WJB_BEGIN_ARRAY, NULL);
+        for (int i = 0; i < jb->count; i++)
+            jb_push(state, jb->items[i], WJB_ELEM);
+        res = pushJsonbValue(state, WJB_END_ARRAY, NULL);
+        break;
+    default:
+        res = pushJsonbValue(state, seq, &jb->scalar);
+        break;
+    }
+    return res;
+}
+
+Jsonb *
+hier_jb_finish(hier_jb *root)
+{
+    JsonbParseState *state = NULL;
+
+    if (root->kind == HIER_JB_SCALAR)
+        return JsonbValueToJsonb(&root->scalar);
+    return JsonbValueToJsonb(jb_push(&state, root, WJB_ELEM));
+}
@@ -0,0 +1,674 @@
+#include "pg_hier_materialize.h"
+#include "pg_hier_helper.h"
+
+/**************************************
+ * A table whose rows feed a document,
+ * with the hops from it up to the root.
+ **************************************/
+typedef struct mat_chain
+{
+    char *table;
+    int nhops;
+    hier_hop *hops; // hops[0] leaves the table, the last one reaches the root
+} mat_chain;
+
+// Prepared marking statement of one trigger
+typedef struct mat_plan_entry
+{
+    Oid tgoid;
+    SPIPlanPtr plan;
+    int nkeys;
+    int *attnos; // key columns of the trigger's table
+} mat_plan_entry;
+
+static HTAB *mark_plans = NULL;
+
+static char **unique_key(const char *table, int *nkeys);
+static void root_key_columns(hier_ast *ast, char ***keys, int *nkeys);
+static hier_hop *concat_hops(hier_hop *lower, int nlower, hier_hop *upper, int nupper);
+static void collect_chains(hier_node *node, hier_hop *up, int nup, hier_header *hh,
+                           List **chains);
+static char *mark_sql(mat_chain *chain, const char *root, char **keys, int nkeys,
+                      string_array *columns);
+static void install_triggers(const char *name, List *chains, const char *root,
+                             char **keys, int nkeys);
+static ArrayType *strings_to_array(char **values, int count);
+static void exec_named(const char *sql, const char *name, int expected);
+static int64 build_documents(const char *name, hier_ast *ast, hier_header *hh,
+                             char **keys, int nkeys);
+static int64 refresh_dirty(const char *name, hier_ast *ast, hier_header *hh,
+                           char **keys, int nkeys);
+static mat_plan_entry *mark_plan(Trigger *trigger, Relation rel);
+static bool row_keys(mat_plan_entry *entry, HeapTuple row, TupleDesc tupdesc,
+                     Datum *values);
+
+/**************************************
+ * Columns of the first valid, immediate
+ * unique index of table over plain NOT
+ * NULL columns, NULL without one.
+ **************************************/
+static char **
+unique_key(const char *table, int *nkeys)
+{
+    Relation rel = table_openrv(pg_hier_rangevar(table), AccessShareLock);
+    TupleDesc desc = RelationGetDescr(rel);
+    List *indexes = RelationGetIndexList(rel);
+    char **keys = NULL;
+    ListCell *lc;
+
+    *nkeys = 0;
+    foreach(lc, indexes)
+    {
+        HeapTuple tuple = SearchSysCache1(INDEXRELID, ObjectIdGetDatum(lfirst_oid(lc)));
+        Form_pg_index index;
+        bool usable;
+
+        if (!HeapTupleIsValid(tuple))
+            elog(ERROR, "cache lookup failed for index %u", lfirst_oid(lc));
+        index = (Form_pg_index) GETSTRUCT(tuple);
+
+        usable = index->indisunique && index->indimmediate && index->indisvalid &&
+                 heap_attisnull(tuple, Anum_pg_index_indpred, NULL) &&
+                 heap_attisnull(tuple, Anum_pg_index_indexprs, NULL);
+        for (int i = 0; i < index->indnkeyatts && usable; i++)
+        {
+            AttrNumber attno = index->indkey.values[i];
+
+            usable = attno > 0 && TupleDescAttr(desc, attno - 1)->attnotnull;
+        }
+
+        if (usable)
+        {
+            keys = palloc(index->indnkeyatts * sizeof(char *));
+            for (int i = 0; i < index->indnkeyatts; i++)
+            {
+                Form_pg_attribute attr = TupleDescAttr(desc, index->indkey.values[i] - 1);
+
+                keys[(*nkeys)++] = pstrdup(NameStr(attr->attname));
+            }
+        }
+        ReleaseSysCache(tuple);
+        if (keys != NULL)
+            break;
+    }
+
+    list_free(indexes);
+    table_close(rel, AccessShareLock);
+    return keys;
+}
+
+/**************************************
+ * Columns identifying a document: the
+ * root's primary key, or without one a
+ * unique key on NOT NULL columns. Any
+ * other key could give two documents
+ * the same root_key.
+ **************************************/
+static void
+root_key_columns(hier_ast *ast, char ***keys, int *nkeys)
+{
+    hier_node *root = ast->root;
+
+    if ((*keys = pg_hier_primary_key(root->table, nkeys)) != NULL)
+        return;
+    if ((*keys = unique_key(root->table, nkeys)) != NULL)
+        return;
+
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
+             errmsg("Root table %s has no primary key or unique key on NOT NULL columns",
+                    root->table)));
+}
+
+static hier_hop *
+concat_hops(hier_hop *lower, int nlower, hier_hop *upper, int nupper)
+{
+    hier_hop *hops = palloc((nlower + nupper) * sizeof(hier_hop));
+
+    memcpy(hops, lower, nlower * sizeof(hier_hop));
+    if (nupper > 0)
+        memcpy(hops + nlower, upper, nupper * sizeof(hier_hop));
+    return hops;
+}
+
+/**************************************
+ * One chain per table of the DSL and
+ * per intermediate table of the paths
+ * between them; changes to any of them
+ * alter a document.
+ **************************************/
+static void
+collect_chains(hier_node *node, hier_hop *up, int nup, hier_header *hh, List **chains)
+{
+    mat_chain *self = palloc(sizeof(mat_chain));
+
+    self->table = node->table;
+    self->hops = up;
+    self->nhops = nup;
+    *chains = lappend(*chains, self);
+
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_node *child = node->children[c];
+        hier_path *path = pg_hier_path(hh, node->table, child->table);
+
+        if (path->nhops == 0)
+            ereport(ERROR, (errmsg("No path found from %s to %s", node->table, child->table)));
+
+        for (int k = 1; k < path->nhops; k++)
+        {
+            mat_chain *chain = palloc(sizeof(mat_chain));
+
+            chain->table = path->hops[k].name;
+            chain->nhops = path->nhops - k + nup;
+            chain->hops = concat_hops(path->hops + k, path->nhops - k, up, nup);
+            *chains = lappend(*chains, chain);
+        }
+
+        collect_chains(child, concat_hops(path->hops, path->nhops, up, nup),
+                       path->nhops + nup, hh, chains);
+    }
+}
+
+/**************************************
+ * Statement run by a row trigger. $1 is
+ * the materialization, $2.. the row's
+ * values of the returned columns. The
+ * chain is joined from the root down to
+ * the row's parent, which is matched on
+ * the first hop's key:
+ *   INSERT INTO pg_hier_materialized_dirty
+ *   SELECT DISTINCT $1, ARRAY[root.k::text]
+ *   FROM root JOIN .. WHERE parent.pk = $2
+ **************************************/
+static char *
+mark_sql(mat_chain *chain, const char *root, char **keys, int nkeys, string_array *columns)
+{
+    StringInfoData sql;
+
+    initStringInfo(&sql);
+    appendStringInfoString(&sql, "INSERT INTO pg_hier_materialized_dirty (name, root_key) ");
+
+    if (chain->nhops == 0)
+    {
+        appendStringInfoString(&sql, "VALUES ($1, ARRAY[");
+        for (int j = 0; j < nkeys; j++)
+        {
+            appendStringInfo(&sql, "%s$%d::text", j > 0 ? ", " : "", j + 2);
+            add_string_to_array(columns, keys[j]);
+        }
+        appendStringInfoString(&sql, "])");
+    }
+    else
+    {
+        hier_hop *first = &chain->hops[0];
+
+        appendStringInfoString(&sql, "SELECT DISTINCT $1, ARRAY[");
+        for (int j = 0; j < nkeys; j++)
+            appendStringInfo(&sql, "%s%s.%s::text", j > 0 ? ", " : "", root,
+                             quote_identifier(keys[j]));
+        appendStringInfo(&sql, "] FROM %s", root);
+
+        for (int i = chain->nhops - 1; i >= 1; i--)
+            appendStringInfo(&sql, " JOIN %s ON (%s)", chain->hops[i].name,
+                             chain->hops[i].join_clause ? chain->hops[i].join_clause : "true");
+
+        for (int j = 0; j < first->nkeys; j++)
+        {
+            appendStringInfo(&sql, " %s %s.%s = $%d", j > 0 ? "AND" : "WHERE",
+                             first->parent_name, first->parent_keys[j], j + 2);
+            add_string_to_array(columns, first->child_keys[j]);
+        }
+    }
+
+    appendStringInfoString(&sql, " ON CONFLICT DO NOTHING");
+    return sql.data;
+}
+
+/**************************************
+ * Triggers are named pg_hier_<name>_<n>
+ * after the chain's position in the
+ * tables column, which is what
+ * pg_hier_drop_materialized drops by.
+ **************************************/
+static void
+install_triggers(const char *name, List *chains, const char *root, char **keys, int nkeys)
+{
+    StringInfoData sql;
+    ListCell *lc;
+    int n = 0;
+
+    initStringInfo(&sql);
+    foreach(lc, chains)
+    {
+        mat_chain *chain = (mat_chain *) lfirst(lc);
+        string_array *columns = create_string_array();
+        char *mark = mark_sql(chain, root, keys, nkeys, columns);
+        char *trigger = psprintf("pg_hier_%s_%d", name, ++n);
+        int ret;
+
+        resetStringInfo(&sql);
+        appendStringInfo(&sql,
+                         "CREATE TRIGGER %s AFTER INSERT OR UPDATE OR DELETE ON %s "
+                         "FOR EACH ROW EXECUTE FUNCTION pg_hier_materialized_changed(%s, %s",
+                         quote_identifier(trigger), chain->table,
+                         quote_literal_cstr(name), quote_literal_cstr(mark));
+        for (int j = 0; j < columns->size; j++)
+            appendStringInfo(&sql, ", %s", quote_literal_cstr(columns->data[j]));
+        appendStringInfoString(&sql, ")");
+
+        // TRUNCATE has no rows to walk from
+        appendStringInfo(&sql,
+                         "; CREATE TRIGGER %s AFTER TRUNCATE ON %s "
+                         "FOR EACH STATEMENT EXECUTE FUNCTION pg_hier_materialized_changed(%s)",
+                         quote_identifier(psprintf("%s_truncate", trigger)), chain->table,
+                         quote_literal_cstr(name));
+
+        ret = SPI_execute(sql.data, false, 0);
+        if (ret != SPI_OK_UTILITY)
+            elog(ERROR, "SPI_execute failed: %d", ret);
+    }
+}
+
+static ArrayType *
+strings_to_array(char **values, int count)
+{
+    Datum *elems = palloc(count * sizeof(Datum));
+
+    for (int i = 0; i < count; i++)
+        elems[i] = CStringGetTextDatum(values[i]);
+    return construct_array(elems, count, TEXTOID, -1, false, TYPALIGN_INT);
+}
+
+static void
+exec_named(const char *sql, const char *name, int expected)
+{
+    Oid type = TEXTOID;
+    Datum value = CStringGetTextDatum(name);
+    int ret = SPI_execute_with_args(sql, 1, &type, &value, NULL, false, 0);
+
+    if (ret != expected)
+        elog(ERROR, "SPI_execute_with_args failed: %d", ret);
+}
+
+// Every document of the materialization in one statement
+static int64
+build_documents(const char *name, hier_ast *ast, hier_header *hh, char **keys, int nkeys)
+{
+    StringInfoData sql;
+
+    initStringInfo(&sql);
+    appendStringInfoString(&sql, "INSERT INTO pg_hier_materialized_doc (name, root_key, document) "
+                                 "SELECT $1, k, d FROM (");
+    pg_hier_keyed_sql(&sql, ast, hh, keys, nkeys, false, 2);
+    appendStringInfoString(&sql, ") AS pg_hier_m(k, d)");
+
+    exec_named(sql.data, name, SPI_OK_INSERT);
+    return (int64) SPI_processed;
+}
+
+/**************************************
+ * Rebuilds the documents of the dirty
+ * root keys, one root-key lookup each.
+ * Keys are claimed by deleting them,
+ * rows marked later wait for the next
+ * refresh. A key whose root row is gone
+ * or filtered out just loses its
+ * document.
+ **************************************/
+static int64
+refresh_dirty(const char *name, hier_ast *ast, hier_header *hh, char **keys, int nkeys)
+{
+    Oid relid = RangeVarGetRelid(pg_hier_rangevar(ast->root->table), AccessShareLock, false);
+    Oid *types = palloc((nkeys + 1) * sizeof(Oid));
+    Oid *inputs = palloc(nkeys * sizeof(Oid));
+    Oid *ioparams = palloc(nkeys * sizeof(Oid));
+    Datum *values = palloc((nkeys + 1) * sizeof(Datum));
+    Oid delete_types[2] = {TEXTOID, TEXTARRAYOID};
+    SPITupleTable *dirty;
+    uint64 ndirty;
+    SPIPlanPtr delete_plan;
+    SPIPlanPtr insert_plan;
+    StringInfoData sql;
+    int64 count = 0;
+
+    exec_named("DELETE FROM pg_hier_materialized_dirty WHERE name = $1 RETURNING root_key",
+               name, SPI_OK_DELETE_RETURNING);
+    dirty = SPI_tuptable;
+    ndirty = SPI_processed;
+    if (ndirty == 0)
+        return 0;
+
+    types[0] = TEXTOID;
+    for (int j = 0; j < nkeys; j++)
+    {
+        AttrNumber attno = get_attnum(relid, keys[j]);
+
+        if (attno == InvalidAttrNumber)
+            ereport(ERROR, (errmsg("Column %s not found in %s", keys[j], ast->root->table)));
+        types[j + 1] = get_atttype(relid, attno);
+        getTypeInputInfo(types[j + 1], &inputs[j], &ioparams[j]);
+    }
+
+    delete_plan = SPI_prepare("DELETE FROM pg_hier_materialized_doc "
+                              "WHERE name = $1 AND root_key = $2", 2, delete_types);
+    if (delete_plan == NULL)
+        elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+
+    initStringInfo(&sql);
+    appendStringInfoString(&sql, "INSERT INTO pg_hier_materialized_doc (name, root_key, document) "
+                                 "SELECT $1, k, d FROM (");
+    pg_hier_keyed_sql(&sql, ast, hh, keys, nkeys, true, 2);
+    appendStringInfoString(&sql, ") AS pg_hier_m(k, d)");
+    insert_plan = SPI_prepare(sql.data, nkeys + 1, types);
+    if (insert_plan == NULL)
+        elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+
+    values[0] = CStringGetTextDatum(name);
+    for (uint64 i = 0; i < ndirty; i++)
+    {
+        bool isnull;
+        Datum key = SPI_getbinval(dirty->vals[i], dirty->tupdesc, 1, &isnull);
+        Datum delete_values[2] = {values[0], key};
+        Datum *elems;
+        bool *nulls;
+        int nelems;
+        bool usable = true;
+
+        if (SPI_execute_plan(delete_plan, delete_values, NULL, false, 0) != SPI_OK_DELETE)
+            elog(ERROR, "SPI_execute_plan failed");
+
+        deconstruct_array(DatumGetArrayTypeP(key), TEXTOID, -1, false, TYPALIGN_INT,
+                          &elems, &nulls, &nelems);
+        if (nelems != nkeys)
+            continue;
+        for (int j = 0; j < nkeys && usable; j++)
+        {
+            usable = !nulls[j];
+            if (usable)
+                values[j + 1] = OidInputFunctionCall(inputs[j], TextDatumGetCString(elems[j]),
+                                                     ioparams[j], -1);
+        }
+        if (!usable)
+            continue;
+
+        if (SPI_execute_plan(insert_plan, values, NULL, false, 0) != SPI_OK_INSERT)
+            elog(ERROR, "SPI_execute_plan failed");
+        count += SPI_processed;
+    }
+
+    SPI_freeplan(delete_plan);
+    SPI_freeplan(insert_plan);
+    return count;
+}
+
+/**************************************
+ * Registers name for dsl, installs the
+ * change triggers and builds every
+ * document. An existing materialization
+ * of the same name is replaced.
+ * Returns the number of documents.
+ **************************************/
+int64
+pg_hier_materialize_create(const char *name, const char *dsl)
+{
+    hier_ast *ast = pg_hier_parse_dsl(dsl);
+    hier_header *hh = CREATE_HIER_HEADER();
+    Oid types[5] = {TEXTOID, TEXTOID, TEXTOID, TEXTARRAYOID, TEXTARRAYOID};
+    Datum values[5];
+    List *chains = NIL;
+    char **tables;
+    char **keys;
+    int nkeys;
+    int64 count;
+    ListCell *lc;
+    int n = 0;
+    int ret;
+
+    pg_hier_find_hier(ast->tables, hh);
+    root_key_columns(ast, &keys, &nkeys);
+    collect_chains(ast->root, NULL, 0, hh, &chains);
+
+    // The longest trigger name must fit, truncated ones could collide
+    if (strlen(psprintf("pg_hier_%s_%d_truncate", name, list_length(chains))) >= NAMEDATALEN)
+        ereport(ERROR,
+                (errcode(ERRCODE_NAME_TOO_LONG),
+                 errmsg("Materialized hierarchy name %s is too long", name),
+                 errdetail("Trigger names pg_hier_%s_<n>_truncate must be shorter than %d bytes.",
+                           name, NAMEDATALEN)));
+
+    tables = palloc(list_length(chains) * sizeof(char *));
+    foreach(lc, chains)
+        tables[n++] = ((mat_chain *) lfirst(lc))->table;
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    exec_named("SELECT pg_hier_drop_materialized($1)", name, SPI_OK_SELECT);
+
+    values[0] = CStringGetTextDatum(name);
+    values[1] = CStringGetTextDatum(dsl);
+    values[2] = CStringGetTextDatum(ast->root->table);
+    values[3] = PointerGetDatum(strings_to_array(keys, nkeys));
+    values[4] = PointerGetDatum(strings_to_array(tables, n));
+    ret = SPI_execute_with_args("INSERT INTO pg_hier_materialized "
+                                "(name, dsl, root_table, root_key, tables) "
+                                "VALUES ($1, $2, $3, $4, $5)",
+                                5, types, values, NULL, false, 0);
+    if (ret != SPI_OK_INSERT)
+        elog(ERROR, "SPI_execute_with_args failed: %d", ret);
+
+    install_triggers(name, chains, ast->root->table, keys, nkeys);
+    count = build_documents(name, ast, hh, keys, nkeys);
+
+    pg_hier_arena_sample();
+    SPI_finish();
+    pg_hier_free_ast(ast);
+    return count;
+}
+
+/**************************************
+ * Rebuilds the dirty documents of name,
+ * or all of them after a TRUNCATE of a
+ * member table. Returns the number of
+ * documents written.
+ **************************************/
+int64
+pg_hier_materialize_refresh(const char *name)
+{
+    hier_header *hh = CREATE_HIER_HEADER();
+    hier_ast *ast;
+    HeapTuple row;
+    TupleDesc desc;
+    Datum *elems;
+    bool *nulls;
+    char **keys;
+    int nkeys;
+    bool stale;
+    bool isnull;
+    int64 count;
+    int ret;
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    // Row lock serializes concurrent refreshes of one name
+    exec_named("SELECT dsl, root_key, stale FROM pg_hier_materialized "
+               "WHERE name = $1 FOR UPDATE", name, SPI_OK_SELECT);
+    if (SPI_processed == 0)
+        ereport(ERROR, (errmsg("Materialized hierarchy %s does not exist", name)));
+
+    row = SPI_tuptable->vals[0];
+    desc = SPI_tuptable->tupdesc;
+    ast = pg_hier_parse_dsl(SPI_getvalue(row, desc, 1));
+    deconstruct_array(DatumGetArrayTypeP(SPI_getbinval(row, desc, 2, &isnull)),
+                      TEXTOID, -1, false, TYPALIGN_INT, &elems, &nulls, &nkeys);
+    keys = palloc(nkeys * sizeof(char *));
+    for (int j = 0; j < nkeys; j++)
+        keys[j] = TextDatumGetCString(elems[j]);
+    stale = DatumGetBool(SPI_getbinval(row, desc, 3, &isnull));
+
+    pg_hier_find_hier(ast->tables, hh);
+
+    if (stale)
+    {
+        exec_named("DELETE FROM pg_hier_materialized_doc WHERE name = $1", name, SPI_OK_DELETE);
+        exec_named("DELETE FROM pg_hier_materialized_dirty WHERE name = $1", name, SPI_OK_DELETE);
+        count = build_documents(name, ast, hh, keys, nkeys);
+        exec_named("UPDATE pg_hier_materialized SET stale = false WHERE name = $1",
+                   name, SPI_OK_UPDATE);
+    }
+    else
+        count = refresh_dirty(name, ast, hh, keys, nkeys);
+
+    pg_hier_arena_sample();
+    SPI_finish();
+    pg_hier_free_ast(ast);
+    return count;
+}
+
+/**************************************
+ * Marking statements are prepared once
+ * per trigger and kept for the backend.
+ * Recreated triggers get a new oid.
+ **************************************/
+static mat_plan_entry *
+mark_plan(Trigger *trigger, Relation rel)
+{
+    TupleDesc tupdesc = RelationGetDescr(rel);
+    mat_plan_entry *entry;
+    bool found;
+
+    if (mark_plans == NULL)
+    {
+        HASHCTL ctl;
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(mat_plan_entry);
+        mark_plans = hash_create("pg_hier mark plans", 16, &ctl, HASH_ELEM | HASH_BLOBS);
+    }
+
+    entry = hash_search(mark_plans, &trigger->tgoid, HASH_ENTER, &found);
+    if (!found)
+        entry->plan = NULL;
+
+    if (entry->plan == NULL)
+    {
+        int nkeys = trigger->tgnargs - 2;
+        Oid *types = palloc((nkeys + 1) * sizeof(Oid));
+        SPIPlanPtr plan;
+
+        entry->nkeys = nkeys;
+        entry->attnos = MemoryContextAlloc(TopMemoryContext, Max(nkeys, 1) * sizeof(int));
+        types[0] = TEXTOID;
+        for (int j = 0; j < nkeys; j++)
+        {
+            entry->attnos[j] = SPI_fnumber(tupdesc, trigger->tgargs[j + 2]);
+            if (entry->attnos[j] <= 0)
+                ereport(ERROR, (errmsg("Column %s not found in %s", trigger->tgargs[j + 2],
+                                       RelationGetRelationName(rel))));
+            types[j + 1] = SPI_gettypeid(tupdesc, entry->attnos[j]);
+        }
+
+        plan = SPI_prepare(trigger->tgargs[1], nkeys + 1, types);
+        if (plan == NULL)
+            elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+        SPI_keepplan(plan);
+        entry->plan = plan;
+    }
+    return entry;
+}
+
+// A row without a full key hangs under no root
+static bool
+row_keys(mat_plan_entry *entry, HeapTuple row, TupleDesc tupdesc, Datum *values)
+{
+    for (int j = 0; j < entry->nkeys; j++)
+    {
+        bool isnull;
+
+        values[j + 1] = SPI_getbinval(row, tupdesc, entry->attnos[j], &isnull);
+        if (isnull)
+            return false;
+    }
+    return true;
+}
+
+/**************************************
+ * Trigger body. Records the root keys
+ * of the old and new row, or flags the
+ * whole materialization stale on
+ * TRUNCATE.
+ **************************************/
+void
+pg_hier_materialize_mark(TriggerData *trigdata)
+{
+    Trigger *trigger = trigdata->tg_trigger;
+    TupleDesc tupdesc = RelationGetDescr(trigdata->tg_relation);
+    HeapTuple old_row = NULL;
+    HeapTuple new_row = NULL;
+    mat_plan_entry *entry;
+    Datum *old_values;
+    Datum *new_values;
+    bool old_usable;
+    bool new_usable;
+    int ret;
+
+    if (trigger->tgnargs < 1)
+        elog(ERROR, "pg_hier_materialized_changed: missing arguments");
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    if (TRIGGER_FIRED_BY_TRUNCATE(trigdata->tg_event))
+    {
+        exec_named("UPDATE pg_hier_materialized SET stale = true WHERE name = $1",
+                   trigger->tgargs[0], SPI_OK_UPDATE);
+        SPI_finish();
+        return;
+    }
+
+    if (!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event) || trigger->tgnargs < 2)
+        elog(ERROR, "pg_hier_materialized_changed: must be fired for each row");
+
+    if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+        new_row = trigdata->tg_trigtuple;
+    else if (TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+        old_row = trigdata->tg_trigtuple;
+    else
+    {
+        old_row = trigdata->tg_trigtuple;
+        new_row = trigdata->tg_newtuple;
+    }
+
+    entry = mark_plan(trigger, trigdata->tg_relation);
+    old_values = palloc((entry->nkeys + 1) * sizeof(Datum));
+    new_values = palloc((entry->nkeys + 1) * sizeof(Datum));
+    old_values[0] = new_values[0] = CStringGetTextDatum(trigger->tgargs[0]);
+
+    old_usable = old_row != NULL && row_keys(entry, old_row, tupdesc, old_values);
+    new_usable = new_row != NULL && row_keys(entry, new_row, tupdesc, new_values);
+
+    // An UPDATE that keeps the link key reaches the same root once
+    if (old_usable && new_usable)
+    {
+        bool same = true;
+
+        for (int j = 0; j < entry->nkeys && same; j++)
+        {
+            Form_pg_attribute attr = TupleDescAttr(tupdesc, entry->attnos[j] - 1);
+
+            same = datumIsEqual(old_values[j + 1], new_values[j + 1],
+                                attr->attbyval, attr->attlen);
+        }
+        old_usable = !same;
+    }
+
+    if (old_usable && SPI_execute_plan(entry->plan, old_values, NULL, false, 0) < 0)
+        elog(ERROR, "SPI_execute_plan failed");
+    if (new_usable && SPI_execute_plan(entry->plan, new_values, NULL, false, 0) < 0)
+        elog(ERROR, "SPI_execute_plan failed");
+
+    SPI_finish();
+}
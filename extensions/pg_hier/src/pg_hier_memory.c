@@ -0,0 +1,101 @@
+#include "pg_hier_memory.h"
+
+bool pg_hier_log_memory_usage = false;
+
+// Arena of the innermost running call, NULL outside of one
+static MemoryContext active_cxt = NULL;
+static Size active_peak = 0;
+
+static bool context_within(MemoryContext cxt, MemoryContext ancestor);
+
+// Only walks up from cxt, ancestor is never dereferenced
+static bool
+context_within(MemoryContext cxt, MemoryContext ancestor)
+{
+    if (ancestor == NULL)
+        return false;
+    for (; cxt != NULL; cxt = MemoryContextGetParent(cxt))
+        if (cxt == ancestor)
+            return true;
+    return false;
+}
+
+/**************************************
+ * Creates the call arena under the
+ * caller's context and switches to it.
+ **************************************/
+void
+pg_hier_arena_begin(hier_call_arena *arena, const char *name)
+{
+    // A call that failed leaves active_cxt behind, only
+    // keep it when it really encloses this one
+    if (!context_within(CurrentMemoryContext, active_cxt))
+    {
+        active_cxt = NULL;
+        active_peak = 0;
+    }
+
+    arena->name = name;
+    arena->cxt = AllocSetContextCreate(CurrentMemoryContext, "pg_hier call",
+                                       ALLOCSET_DEFAULT_SIZES);
+    arena->oldcxt = MemoryContextSwitchTo(arena->cxt);
+
+    arena->outer_cxt = active_cxt;
+    arena->outer_peak = active_peak;
+    active_cxt = arena->cxt;
+    active_peak = 0;
+}
+
+/**************************************
+ * Records the current footprint of the
+ * running call. SPI allocates outside
+ * the arena, so when the current
+ * context is not inside it (an SPI
+ * connection) it is added on top. Call
+ * before releasing memory the arena
+ * would not see at its end.
+ **************************************/
+void
+pg_hier_arena_sample(void)
+{
+    Size size;
+
+    if (!pg_hier_log_memory_usage || active_cxt == NULL)
+        return;
+
+    size = MemoryContextMemAllocated(active_cxt, true);
+    if (!context_within(CurrentMemoryContext, active_cxt))
+        size += MemoryContextMemAllocated(CurrentMemoryContext, true);
+    active_peak = Max(active_peak, size);
+}
+
+/**************************************
+ * Switches back to the caller's
+ * context, copies the varlena result
+ * out of the arena and releases
+ * everything else at once.
+ **************************************/
+Datum
+pg_hier_arena_end(hier_call_arena *arena, Datum result, bool is_null)
+{
+    MemoryContextSwitchTo(arena->oldcxt);
+
+    if (!is_null)
+        result = datumCopy(result, false, -1);
+
+    if (pg_hier_log_memory_usage)
+    {
+        // Allocation sets keep their blocks until reset,
+        // what is held now is the high-water mark
+        Size peak = Max(active_peak, MemoryContextMemAllocated(arena->cxt, true));
+
+        ereport(LOG,
+                (errmsg("%s: peak memory %zu bytes", arena->name, peak),
+                 errhidestmt(true)));
+    }
+
+    MemoryContextDelete(arena->cxt);
+    active_cxt = arena->outer_cxt;
+    active_peak = arena->outer_peak;
+    return result;
+}
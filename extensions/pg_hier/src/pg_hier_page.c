@@ -0,0 +1,157 @@
+#include "pg_hier_page.h"
+#include "pg_hier_helper.h"
+
+static char *page_token_encode(char **values, int nkeys);
+static char **page_token_decode(const char *token, int nkeys);
+
+/**************************************
+ * Token layout before encoding, per key
+ * column: <length>:<text value>
+ **************************************/
+static char *
+page_token_encode(char **values, int nkeys)
+{
+    StringInfoData raw;
+    char *token;
+    int len;
+
+    initStringInfo(&raw);
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(&raw, "%zu:%s", strlen(values[j]), values[j]);
+
+    len = pg_b64_enc_len(raw.len);
+    token = palloc(len + 1);
+    len = pg_b64_encode((void *) raw.data, raw.len, token, len);
+    if (len < 0)
+        elog(ERROR, "could not encode pg_hier_page token");
+    token[len] = '\0';
+    return token;
+}
+
+static char **
+page_token_decode(const char *token, int nkeys)
+{
+    int token_len = strlen(token);
+    int len = pg_b64_dec_len(token_len);
+    char *raw = palloc(len + 1);
+    char **values = palloc(nkeys * sizeof(char *));
+    char *pos;
+    char *end;
+
+    len = pg_b64_decode(token, token_len, (void *) raw, len);
+    if (len < 0)
+        ereport(ERROR, (errmsg("Invalid pg_hier_page token")));
+    raw[len] = '\0';
+    end = raw + len;
+    pos = raw;
+
+    for (int j = 0; j < nkeys; j++)
+    {
+        char *colon;
+        long value_len = strtol(pos, &colon, 10);
+
+        if (colon == pos || *colon != ':' || value_len < 0 || value_len > end - colon - 1)
+            ereport(ERROR, (errmsg("Invalid pg_hier_page token")));
+        values[j] = pnstrdup(colon + 1, value_len);
+        pos = colon + 1 + value_len;
+    }
+    if (pos != end)
+        ereport(ERROR, (errmsg("Invalid pg_hier_page token")));
+    return values;
+}
+
+/**************************************
+ * Fetches the page after token (the
+ * first page when NULL). The work is
+ * bounded by page_size: the keys come
+ * from a range scan on the primary key
+ * and only those roots get documents.
+ * next_token is NULL once a page comes
+ * back short.
+ **************************************/
+void
+pg_hier_page_fetch(const char *input, int64 page_size, const char *token,
+                   Datum *documents, char **next_token)
+{
+    hier_ast *ast = pg_hier_parse_dsl(input);
+    hier_header *hh = CREATE_HIER_HEADER();
+    StringInfoData sql;
+    char **keys;
+    int nkeys;
+    Oid relid;
+    Oid *types;
+    Datum *values;
+    int nargs = 1;
+    HeapTuple row;
+    TupleDesc desc;
+    bool isnull;
+    int ret;
+
+    if (page_size <= 0)
+        ereport(ERROR, (errmsg("Page size must be positive")));
+
+    pg_hier_find_hier(ast->tables, hh);
+    keys = pg_hier_primary_key(ast->root->table, &nkeys);
+    if (keys == NULL)
+        ereport(ERROR, (errmsg("Root table %s has no primary key", ast->root->table)));
+
+    types = palloc((nkeys + 1) * sizeof(Oid));
+    values = palloc((nkeys + 1) * sizeof(Datum));
+    types[0] = INT8OID;
+    values[0] = Int64GetDatum(page_size);
+
+    // Key values go back in typed, so the range scan uses the index
+    if (token != NULL)
+    {
+        char **after = page_token_decode(token, nkeys);
+
+        relid = RangeVarGetRelid(pg_hier_rangevar(ast->root->table), AccessShareLock, false);
+        for (int j = 0; j < nkeys; j++)
+        {
+            Oid input_fn;
+            Oid ioparam;
+
+            types[j + 1] = get_atttype(relid, get_attnum(relid, keys[j]));
+            getTypeInputInfo(types[j + 1], &input_fn, &ioparam);
+            values[j + 1] = OidInputFunctionCall(input_fn, after[j], ioparam, -1);
+        }
+        nargs += nkeys;
+    }
+
+    initStringInfo(&sql);
+    pg_hier_page_sql(&sql, ast, hh, keys, nkeys, token != NULL);
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    ret = SPI_execute_with_args(sql.data, nargs, types, values, NULL, true, 1);
+    if (ret != SPI_OK_SELECT)
+        elog(ERROR, "SPI_execute_with_args failed: %s", SPI_result_code_string(ret));
+    // The page query aggregates, it always yields exactly one row
+    if (SPI_processed != 1)
+        elog(ERROR, "pg_hier page query returned " UINT64_FORMAT " rows, expected 1",
+             (uint64) SPI_processed);
+
+    row = SPI_tuptable->vals[0];
+    desc = SPI_tuptable->tupdesc;
+    *documents = SPI_datumTransfer(SPI_getbinval(row, desc, 1, &isnull), false, -1);
+
+    *next_token = NULL;
+    if (DatumGetInt64(SPI_getbinval(row, desc, 2, &isnull)) == page_size)
+    {
+        char **last = palloc(nkeys * sizeof(char *));
+        char *encoded;
+
+        for (int j = 0; j < nkeys; j++)
+            last[j] = SPI_getvalue(row, desc, j + 3);
+        encoded = page_token_encode(last, nkeys);
+
+        // SPI_palloc keeps the token past SPI_finish
+        *next_token = SPI_palloc(strlen(encoded) + 1);
+        strcpy(*next_token, encoded);
+    }
+
+    pg_hier_arena_sample();
+    SPI_finish();
+    pg_hier_free_ast(ast);
+}
@@ -0,0 +1,282 @@
+#include "pg_hier_parser.h"
+#include "pg_hier_helper.h"
+
+#define HIER_DELIMITERS ", \n\r\t"
+
+static bool token_is(const char *input, hier_token token, const char *word);
+static bool token_is_identifier(const char *input, hier_token token);
+static bool token_is_column(const char *input, hier_token token, hier_node *node);
+static bool token_is_marker(const hier_lexer *lex, hier_token token, hier_token next,
+                            hier_node *parent);
+static void normalize_node(StringInfo buf, hier_node *node);
+
+/**************************************
+ * Lexer
+ **************************************/
+void
+hier_lexer_init(hier_lexer *lex, const char *input)
+{
+    lex->input = input;
+    lex->pos = 0;
+}
+
+/**************************************
+ * Returns the next token. Words run to
+ * the next delimiter, brace or ';',
+ * quoted sections are kept whole so
+ * WHERE literals may hold any of them.
+ **************************************/
+hier_token
+hier_lexer_next(hier_lexer *lex)
+{
+    const char *in = lex->input;
+    int pos = lex->pos;
+    hier_token token;
+
+    while (in[pos] != '\0' && strchr(HIER_DELIMITERS, in[pos]))
+        pos++;
+
+    token.offset = pos;
+    switch (in[pos])
+    {
+        case '\0':
+            token.type = HIER_TOKEN_END;
+            break;
+        case '{':
+            token.type = HIER_TOKEN_OPEN;
+            pos++;
+            break;
+        case '}':
+            token.type = HIER_TOKEN_CLOSE;
+            pos++;
+            break;
+        case ';':
+            token.type = HIER_TOKEN_SEMI;
+            pos++;
+            break;
+        default:
+            token.type = HIER_TOKEN_WORD;
+            while (in[pos] != '\0' && !strchr(HIER_DELIMITERS "{};", in[pos]))
+            {
+                if (in[pos] == '\'' || in[pos] == '"')
+                {
+                    char quote = in[pos++];
+
+                    while (in[pos] != '\0' && in[pos] != quote)
+                        pos++;
+                    if (in[pos] == '\0')
+                        ereport(ERROR, (errmsg("Unterminated quoted string in input")));
+                }
+                pos++;
+            }
+            break;
+    }
+
+    token.length = pos - token.offset;
+    lex->pos = pos;
+    return token;
+}
+
+static bool
+token_is(const char *input, hier_token token, const char *word)
+{
+    return token.type == HIER_TOKEN_WORD &&
+           token.length == (int) strlen(word) &&
+           pg_strncasecmp(input + token.offset, word, token.length) == 0;
+}
+
+// Plain, optionally schema-qualified name, no quotes or operators
+static bool
+token_is_identifier(const char *input, hier_token token)
+{
+    const char *word = input + token.offset;
+
+    if (token.type != HIER_TOKEN_WORD || !(isalpha((unsigned char) word[0]) || word[0] == '_'))
+        return false;
+    for (int i = 1; i < token.length; i++)
+        if (!isalnum((unsigned char) word[i]) && !strchr("_$.", word[i]))
+            return false;
+    return true;
+}
+
+static bool
+token_is_column(const char *input, hier_token token, hier_node *node)
+{
+    Oid relid = RangeVarGetRelid(pg_hier_rangevar(node->table), NoLock, true);
+    char *name = downcase_identifier(input + token.offset, token.length, false, false);
+
+    return OidIsValid(relid) && get_attnum(relid, name) != InvalidAttrNumber;
+}
+
+/**************************************
+ * INNER or REQUIRED right before a
+ * nested "table {" marks that block.
+ * Needs the token after next, read
+ * from a copy of the lexer. A column
+ * of the parent with that name stays
+ * a column.
+ **************************************/
+static bool
+token_is_marker(const hier_lexer *lex, hier_token token, hier_token next,
+                hier_node *parent)
+{
+    hier_lexer peek = *lex;
+
+    if (!token_is(lex->input, token, "INNER") && !token_is(lex->input, token, "REQUIRED"))
+        return false;
+    if (!token_is_identifier(lex->input, next) ||
+        hier_lexer_next(&peek).type != HIER_TOKEN_OPEN)
+        return false;
+    return !token_is_column(lex->input, token, parent);
+}
+
+/**************************************
+ * Parses the DSL
+ *   table { column ... [INNER] child { ... } WHERE cond ... } WHERE cond
+ * into a hier_node tree in one pass.
+ * The input is only read, names are
+ * copied once into the AST arena.
+ **************************************/
+hier_ast *
+pg_hier_parse_dsl(const char *input)
+{
+    MemoryContext arena = AllocSetContextCreate(CurrentMemoryContext,
+                                                "pg_hier ast",
+                                                ALLOCSET_DEFAULT_SIZES);
+    MemoryContext oldcxt = MemoryContextSwitchTo(arena);
+    hier_ast *ast = palloc0(sizeof(hier_ast));
+    List *stack = NIL;
+    hier_lexer lex;
+    hier_token token;
+    hier_token next;
+    bool required = false;
+
+    ast->arena = arena;
+    ast->tables = create_string_array();
+
+    hier_lexer_init(&lex, input);
+    token = hier_lexer_next(&lex);
+    next = hier_lexer_next(&lex);
+
+    while (token.type != HIER_TOKEN_END && token.type != HIER_TOKEN_SEMI)
+    {
+        if (stack != NIL &&
+            token_is_marker(&lex, token, next, (hier_node *) linitial(stack)))
+        {
+            required = true;
+            token = next;
+            next = hier_lexer_next(&lex);
+            continue;
+        }
+
+        if (token.type == HIER_TOKEN_WORD && next.type == HIER_TOKEN_OPEN)
+        {
+            hier_node *node = create_hier_node(input + token.offset, token.length);
+
+            if (stack == NIL)
+            {
+                if (ast->root != NULL)
+                    ereport(ERROR, (errmsg("Only one root table is allowed")));
+                ast->root = node;
+            }
+            else
+                add_hier_node_child((hier_node *) linitial(stack), node);
+            node->required = required;
+            required = false;
+
+            push_string_array(ast->tables, node->table);
+            stack = lcons(node, stack);
+            token = hier_lexer_next(&lex);
+            next = hier_lexer_next(&lex);
+            continue;
+        }
+
+        if (token.type == HIER_TOKEN_CLOSE)
+        {
+            hier_node *node;
+
+            if (stack == NIL)
+                ereport(ERROR, (errmsg("Unmatched closing brace in input")));
+            node = (hier_node *) linitial(stack);
+            stack = list_delete_first(stack);
+
+            token = next;
+            next = hier_lexer_next(&lex);
+
+            // The condition is kept as written, up to the next } or ;
+            if (token_is(input, token, "WHERE"))
+            {
+                hier_token first = next;
+                hier_token last = next;
+
+                token = next;
+                next = hier_lexer_next(&lex);
+                while (token.type == HIER_TOKEN_WORD)
+                {
+                    last = token;
+                    token = next;
+                    next = hier_lexer_next(&lex);
+                }
+                if (first.type == HIER_TOKEN_WORD)
+                    node->where = pnstrdup(input + first.offset,
+                                           last.offset + last.length - first.offset);
+            }
+            continue;
+        }
+
+        if (stack == NIL || token.type != HIER_TOKEN_WORD)
+            ereport(ERROR, (errmsg("Expected table name")));
+
+        push_string_array(((hier_node *) linitial(stack))->columns,
+                          pnstrdup(input + token.offset, token.length));
+        token = next;
+        next = hier_lexer_next(&lex);
+    }
+
+    if (ast->root == NULL)
+        ereport(ERROR, (errmsg("No tables found in input string.")));
+    if (stack != NIL)
+        ereport(ERROR, (errmsg("Unmatched opening brace in input")));
+
+    list_free(stack);
+    MemoryContextSwitchTo(oldcxt);
+    return ast;
+}
+
+/**************************************
+ * Canonical text of the AST, used as
+ * the plan cache key. Layout and
+ * delimiters of the input do not
+ * matter, columns come before children.
+ **************************************/
+static void
+normalize_node(StringInfo buf, hier_node *node)
+{
+    appendStringInfo(buf, "%s%s {", node->required ? "INNER " : "", node->table);
+    for (int i = 0; i < node->columns->size; i++)
+        appendStringInfo(buf, " %s", node->columns->data[i]);
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        appendStringInfoChar(buf, ' ');
+        normalize_node(buf, node->children[c]);
+    }
+    appendStringInfoString(buf, " }");
+    if (node->where)
+        appendStringInfo(buf, " WHERE %s", node->where);
+}
+
+char *
+pg_hier_ast_normalize(hier_ast *ast)
+{
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    normalize_node(&buf, ast->root);
+    return buf.data;
+}
+
+void
+pg_hier_free_ast(hier_ast *ast)
+{
+    MemoryContextDelete(ast->arena);
+}
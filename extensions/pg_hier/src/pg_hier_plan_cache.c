@@ -0,0 +1,176 @@
+#include "pg_hier_plan_cache.h"
+#include "pg_hier_helper.h"
+
+int pg_hier_plan_cache_size = 128;
+
+static MemoryContext plan_cache_cxt = NULL;
+static HTAB *plan_cache = NULL;
+static dlist_head plan_lru = DLIST_STATIC_INIT(plan_lru); // most recent first
+
+static void plan_cache_init(void);
+static void plan_entry_release(hier_plan_entry *entry);
+static void plan_cache_evict(void);
+
+static void
+plan_cache_init(void)
+{
+    HASHCTL ctl;
+
+    if (CacheMemoryContext == NULL)
+        CreateCacheMemoryContext();
+    plan_cache_cxt = AllocSetContextCreate(CacheMemoryContext,
+                                           "pg_hier plan cache",
+                                           ALLOCSET_SMALL_SIZES);
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(uint64);
+    ctl.entrysize = sizeof(hier_plan_entry);
+    ctl.hcxt = plan_cache_cxt;
+    plan_cache = hash_create("pg_hier plan cache", 64, &ctl,
+                             HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+// Frees what the entry owns, the hash slot stays
+static void
+plan_entry_release(hier_plan_entry *entry)
+{
+    if (entry->plan)
+        SPI_freeplan(entry->plan);
+    pfree(entry->dsl);
+    if (entry->argtypes)
+        pfree(entry->argtypes);
+}
+
+// Drops the least recently used plan
+static void
+plan_cache_evict(void)
+{
+    hier_plan_entry *entry;
+
+    entry = dlist_tail_element(hier_plan_entry, lru, &plan_lru);
+    dlist_delete(&entry->lru);
+    plan_entry_release(entry);
+    hash_search(plan_cache, &entry->key, HASH_REMOVE, NULL);
+}
+
+/**************************************
+ * Drops every cached plan.
+ **************************************/
+void
+pg_hier_plan_cache_reset(void)
+{
+    HASH_SEQ_STATUS status;
+    hier_plan_entry *entry;
+
+    if (plan_cache == NULL)
+        return;
+
+    hash_seq_init(&status, plan_cache);
+    while ((entry = hash_seq_search(&status)) != NULL)
+    {
+        plan_entry_release(entry);
+        hash_search(plan_cache, &entry->key, HASH_REMOVE, NULL);
+    }
+    dlist_init(&plan_lru);
+}
+
+/**************************************
+ * Returns a plan for the DSL, building
+ * and preparing the SQL only on a miss
+ * or after the catalog changed
+ * underneath the entry. Bind parameter
+ * types are part of the key, their
+ * values are supplied at execution.
+ * Must be called
+ * inside an SPI connection; with the
+ * cache disabled the plan lives until
+ * that connection finishes.
+ **************************************/
+SPIPlanPtr
+pg_hier_plan_get(const char *input, hier_params *params, hier_output_mode mode)
+{
+    hier_ast *ast = pg_hier_parse_dsl(input);
+    char *dsl = pg_hier_ast_normalize(ast);
+    uint64 key = hash_bytes_extended((const unsigned char *) dsl, strlen(dsl), 0);
+    Size types_size = params->nargs * sizeof(Oid);
+    // Both only grow, so the sum moves whenever either does
+    uint64 generation = pg_hier_catalog_generation() + pg_hier_join_generation();
+    hier_plan_entry *entry = NULL;
+    StringInfoData sql;
+    SPIPlanPtr plan;
+    bool found;
+    int ret;
+
+    key = hash_combine64(key, (uint64) mode);
+    key = hash_combine64(key, (uint64) pg_hier_sql_shape);
+    if (params->nargs > 0)
+        key = hash_combine64(key,
+            hash_bytes_extended((const unsigned char *) params->types, types_size, 0));
+
+    if (plan_cache == NULL)
+        plan_cache_init();
+
+    if (pg_hier_plan_cache_size > 0)
+    {
+        entry = hash_search(plan_cache, &key, HASH_FIND, NULL);
+        if (entry && entry->generation == generation &&
+            entry->mode == mode &&
+            entry->shape == pg_hier_sql_shape &&
+            strcmp(entry->dsl, dsl) == 0 &&
+            entry->nargs == params->nargs &&
+            (types_size == 0 || memcmp(entry->argtypes, params->types, types_size) == 0))
+        {
+            dlist_move_head(&plan_lru, &entry->lru);
+            pfree(dsl);
+            pg_hier_free_ast(ast);
+            return entry->plan;
+        }
+    }
+
+    initStringInfo(&sql);
+    pg_hier_ast_sql(&sql, ast, mode);
+    pg_hier_free_ast(ast);
+
+    plan = SPI_prepare(sql.data, params->nargs, params->types);
+    if (plan == NULL)
+        elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+    pfree(sql.data);
+
+    if (pg_hier_plan_cache_size <= 0)
+    {
+        pfree(dsl);
+        return plan;
+    }
+
+    if ((ret = SPI_keepplan(plan)) != 0)
+        elog(ERROR, "SPI_keepplan failed: %d", ret);
+
+    // A stale entry under the same key is replaced in place
+    entry = hash_search(plan_cache, &key, HASH_FIND, NULL);
+    while (entry == NULL && !dlist_is_empty(&plan_lru) &&
+           hash_get_num_entries(plan_cache) >= pg_hier_plan_cache_size)
+        plan_cache_evict();
+
+    entry = hash_search(plan_cache, &key, HASH_ENTER, &found);
+    if (found)
+    {
+        plan_entry_release(entry);
+        dlist_delete(&entry->lru);
+    }
+    dlist_push_head(&plan_lru, &entry->lru);
+    entry->dsl = MemoryContextStrdup(plan_cache_cxt, dsl);
+    entry->mode = mode;
+    entry->shape = pg_hier_sql_shape;
+    entry->nargs = params->nargs;
+    entry->argtypes = NULL;
+    if (types_size > 0)
+    {
+        entry->argtypes = MemoryContextAlloc(plan_cache_cxt, types_size);
+        memcpy(entry->argtypes, params->types, types_size);
+    }
+    entry->plan = plan;
+    entry->generation = generation;
+
+    pfree(dsl);
+    return plan;
+}
@@ -0,0 +1,593 @@
+#include "pg_hier_result_cache.h"
+#include "pg_hier_helper.h"
+
+int pg_hier_result_cache_size = 64; // MB, 0 disables
+bool pg_hier_result_cache = false;
+
+// Slot 0 is a global epoch, bumped when a prepared transaction commits
+#define HIER_RC_EPOCH 0
+
+// Settings that change how a result is rendered or what it covers
+static const char *const rc_settings[] = {
+    "TimeZone",
+    "DateStyle",
+    "IntervalStyle",
+    "extra_float_digits",
+    "bytea_output",
+    "search_path",
+    "pg_hier.tree_max_depth",
+    NULL
+};
+
+typedef struct hier_rc_shared
+{
+    LWLock *lock; // guards creation of the area
+    int tranche;
+    dsa_handle area;
+    dshash_table_handle table;
+    pg_atomic_uint64 counters[HIER_RC_SLOTS];
+} hier_rc_shared;
+
+typedef struct hier_rc_key
+{
+    Oid dbid;
+    Oid userid;
+    uint64 hash;
+} hier_rc_key;
+
+typedef struct hier_rc_entry
+{
+    hier_rc_key key;
+    dsa_pointer data; // stamps, then key bytes, then the result
+    int nstamps;
+    Size keylen;
+    Size resultlen;
+    bool is_null;
+} hier_rc_entry;
+
+static hier_rc_shared *rc_shared = NULL;
+static dsa_area *rc_area = NULL;
+static dshash_table *rc_table = NULL;
+static List *rc_written = NIL; // relids written by this transaction
+
+static dshash_parameters rc_params = {
+    sizeof(hier_rc_key),
+    sizeof(hier_rc_entry),
+    dshash_memcmp,
+    dshash_memhash,
+    0 // tranche, set on attach
+};
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ExecutorStart_hook_type prev_executor_start = NULL;
+static ProcessUtility_hook_type prev_process_utility = NULL;
+
+static void rc_shmem_request(void);
+static void rc_shmem_startup(void);
+static void rc_executor_start(QueryDesc *queryDesc, int eflags);
+static void rc_process_utility(PlannedStmt *pstmt, const char *queryString,
+                               bool readOnlyTree, ProcessUtilityContext context,
+                               ParamListInfo params, QueryEnvironment *queryEnv,
+                               DestReceiver *dest, QueryCompletion *qc);
+static void rc_xact_callback(XactEvent event, void *arg);
+static void rc_note_write(Oid relid);
+static uint32 rc_slot(Oid relid);
+static bool rc_attach(void);
+static bool rc_note_table(List **relids, const char *table);
+static bool rc_collect(hier_node *node, hier_header *hh, List **relids);
+static bool rc_build_key(hier_rc_probe *probe, const char *input, hier_params *params);
+static bool rc_current(hier_rc_stamp *stamps, int nstamps);
+static void rc_sweep(bool all);
+
+/**************************************
+ * Installs the hooks, called from
+ * _PG_init while shared_preload_libraries
+ * is processed.
+ **************************************/
+void
+pg_hier_result_cache_init(void)
+{
+    if (pg_hier_result_cache_size == 0)
+        return;
+
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = rc_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = rc_shmem_startup;
+    prev_executor_start = ExecutorStart_hook;
+    ExecutorStart_hook = rc_executor_start;
+    prev_process_utility = ProcessUtility_hook;
+    ProcessUtility_hook = rc_process_utility;
+    RegisterXactCallback(rc_xact_callback, NULL);
+}
+
+static void
+rc_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(MAXALIGN(sizeof(hier_rc_shared)));
+    RequestNamedLWLockTranche("pg_hier_result_cache", 1);
+}
+
+static void
+rc_shmem_startup(void)
+{
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    rc_shared = ShmemInitStruct("pg_hier result cache", sizeof(hier_rc_shared), &found);
+    if (!found)
+    {
+        rc_shared->lock = &(GetNamedLWLockTranche("pg_hier_result_cache"))->lock;
+        rc_shared->tranche = LWLockNewTrancheId();
+        rc_shared->area = DSA_HANDLE_INVALID;
+        rc_shared->table = DSHASH_HANDLE_INVALID;
+        for (int i = 0; i < HIER_RC_SLOTS; i++)
+            pg_atomic_init_u64(&rc_shared->counters[i], 0);
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/**************************************
+ * Remembers the tables a statement
+ * writes. Their counters are bumped
+ * once the transaction has committed.
+ **************************************/
+static void
+rc_executor_start(QueryDesc *queryDesc, int eflags)
+{
+    ListCell *lc;
+
+    // Also covers data-modifying CTEs of a SELECT
+    foreach(lc, queryDesc->plannedstmt->resultRelations)
+        rc_note_write(rt_fetch(lfirst_int(lc), queryDesc->plannedstmt->rtable)->relid);
+
+    if (prev_executor_start)
+        prev_executor_start(queryDesc, eflags);
+    else
+        standard_ExecutorStart(queryDesc, eflags);
+}
+
+// TRUNCATE and COPY FROM write without going through the executor
+static void
+rc_process_utility(PlannedStmt *pstmt, const char *queryString, bool readOnlyTree,
+                   ProcessUtilityContext context, ParamListInfo params,
+                   QueryEnvironment *queryEnv, DestReceiver *dest, QueryCompletion *qc)
+{
+    Node *parsetree = pstmt->utilityStmt;
+
+    if (IsA(parsetree, TruncateStmt))
+    {
+        ListCell *lc;
+
+        foreach(lc, ((TruncateStmt *) parsetree)->relations)
+            rc_note_write(RangeVarGetRelid((RangeVar *) lfirst(lc), NoLock, true));
+    }
+    else if (IsA(parsetree, CopyStmt) && ((CopyStmt *) parsetree)->is_from &&
+             ((CopyStmt *) parsetree)->relation != NULL)
+        rc_note_write(RangeVarGetRelid(((CopyStmt *) parsetree)->relation, NoLock, true));
+
+    if (prev_process_utility)
+        prev_process_utility(pstmt, queryString, readOnlyTree, context, params,
+                             queryEnv, dest, qc);
+    else
+        standard_ProcessUtility(pstmt, queryString, readOnlyTree, context, params,
+                                queryEnv, dest, qc);
+
+    // The writes of a prepared transaction are not known here,
+    // every entry is invalidated instead
+    if (IsA(parsetree, TransactionStmt) &&
+        ((TransactionStmt *) parsetree)->kind == TRANS_STMT_COMMIT_PREPARED &&
+        rc_shared != NULL)
+        pg_atomic_fetch_add_u64(&rc_shared->counters[HIER_RC_EPOCH], 1);
+}
+
+/**************************************
+ * Bumps after commit, when the writes
+ * are visible to new snapshots. A
+ * reader that stamped earlier holds an
+ * older counter and misses from then on.
+ **************************************/
+static void
+rc_xact_callback(XactEvent event, void *arg)
+{
+    ListCell *lc;
+
+    switch (event)
+    {
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_PARALLEL_COMMIT:
+        case XACT_EVENT_PREPARE:
+            if (rc_shared != NULL)
+                foreach(lc, rc_written)
+                    pg_atomic_fetch_add_u64(&rc_shared->counters[rc_slot(lfirst_oid(lc))], 1);
+            list_free(rc_written);
+            rc_written = NIL;
+            break;
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PARALLEL_ABORT:
+            list_free(rc_written);
+            rc_written = NIL;
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+rc_note_write(Oid relid)
+{
+    MemoryContext oldcxt;
+
+    if (!OidIsValid(relid))
+        return;
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    rc_written = list_append_unique_oid(rc_written, relid);
+    MemoryContextSwitchTo(oldcxt);
+}
+
+// Collisions only cost extra misses
+static uint32
+rc_slot(Oid relid)
+{
+    uint32 hash = hash_combine(hash_bytes_uint32(MyDatabaseId), hash_bytes_uint32(relid));
+
+    return 1 + hash % (HIER_RC_SLOTS - 1);
+}
+
+/**************************************
+ * The first backend to use the cache
+ * creates the area and the table, the
+ * others attach. Mappings are kept for
+ * the life of the backend.
+ **************************************/
+static bool
+rc_attach(void)
+{
+    MemoryContext oldcxt;
+
+    if (rc_table != NULL)
+        return true;
+    if (rc_shared == NULL)
+        return false;
+
+    LWLockRegisterTranche(rc_shared->tranche, "pg_hier_result_cache");
+    rc_params.tranche_id = rc_shared->tranche;
+
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    LWLockAcquire(rc_shared->lock, LW_EXCLUSIVE);
+    if (rc_shared->area == DSA_HANDLE_INVALID)
+    {
+        rc_area = dsa_create(rc_shared->tranche);
+        dsa_pin(rc_area);
+        dsa_set_size_limit(rc_area, (size_t) pg_hier_result_cache_size * 1024 * 1024);
+        rc_table = dshash_create(rc_area, &rc_params, NULL);
+        rc_shared->area = dsa_get_handle(rc_area);
+        rc_shared->table = dshash_get_hash_table_handle(rc_table);
+    }
+    else
+    {
+        rc_area = dsa_attach(rc_shared->area);
+        rc_table = dshash_attach(rc_area, &rc_params, rc_shared->table, NULL);
+    }
+    dsa_pin_mapping(rc_area);
+    LWLockRelease(rc_shared->lock);
+    MemoryContextSwitchTo(oldcxt);
+    return true;
+}
+
+/**************************************
+ * Only tables whose writes reach the
+ * executor hook under their own relid.
+ * A view, foreign table or matview
+ * changes without its relid being
+ * written. A partitioned table is
+ * stamped with its partitions, which
+ * take direct writes too. Row level
+ * security reads inputs the key does
+ * not hold, those tables are skipped.
+ **************************************/
+static bool
+rc_note_table(List **relids, const char *table)
+{
+    Oid relid = RangeVarGetRelid(pg_hier_rangevar(table), NoLock, true);
+    List *members;
+    ListCell *lc;
+
+    if (!OidIsValid(relid))
+        return false;
+
+    if (get_rel_relkind(relid) == RELKIND_PARTITIONED_TABLE)
+        members = find_all_inheritors(relid, NoLock, NULL);
+    else
+        members = list_make1_oid(relid);
+
+    foreach(lc, members)
+    {
+        Oid member = lfirst_oid(lc);
+        char relkind = get_rel_relkind(member);
+
+        if ((relkind != RELKIND_RELATION && relkind != RELKIND_PARTITIONED_TABLE) ||
+            check_enable_rls(member, InvalidOid, true) != RLS_NONE)
+        {
+            list_free(members);
+            return false;
+        }
+        *relids = list_append_unique_oid(*relids, member);
+    }
+    list_free(members);
+    return true;
+}
+
+/**************************************
+ * Every table the generated SQL reads,
+ * intermediates included. A WHERE may
+ * read other tables or call volatile
+ * functions, such DSLs are not cached.
+ **************************************/
+static bool
+rc_collect(hier_node *node, hier_header *hh, List **relids)
+{
+    if (node->where != NULL || !rc_note_table(relids, node->table))
+        return false;
+
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_path *path = pg_hier_path(hh, node->table, node->children[c]->table);
+
+        for (int k = 1; k < path->nhops; k++)
+            if (!rc_note_table(relids, path->hops[k].name))
+                return false;
+        if (!rc_collect(node->children[c], hh, relids))
+            return false;
+    }
+    return true;
+}
+
+/**************************************
+ * Key bytes are the normalized DSL, the
+ * relids it resolved to under the
+ * current search_path, the current user,
+ * the output settings and the bound
+ * parameters. The stamps cover those
+ * relids plus the pg_hier metadata,
+ * pg_hier_tree included.
+ **************************************/
+static bool
+rc_build_key(hier_rc_probe *probe, const char *input, hier_params *params)
+{
+    hier_ast *ast = pg_hier_parse_dsl(input);
+    hier_header *hh = CREATE_HIER_HEADER();
+    List *relids = NIL;
+    char *dsl;
+    Oid userid;
+    ListCell *lc;
+    int n = 0;
+
+    // A single table is a tree, it has no hierarchy to find
+    if (ast->tables->size > 1)
+        pg_hier_find_hier(ast->tables, hh);
+    if (!rc_collect(ast->root, hh, &relids) ||
+        !rc_note_table(&relids, "pg_hier_header") ||
+        !rc_note_table(&relids, "pg_hier_detail") ||
+        !rc_note_table(&relids, "pg_hier_tree"))
+    {
+        pg_hier_free_ast(ast);
+        return false;
+    }
+
+    initStringInfo(&probe->key);
+    dsl = pg_hier_ast_normalize(ast);
+    appendBinaryStringInfo(&probe->key, dsl, strlen(dsl) + 1);
+    foreach(lc, relids)
+    {
+        Oid relid = lfirst_oid(lc);
+
+        appendBinaryStringInfo(&probe->key, (char *) &relid, sizeof(Oid));
+    }
+
+    userid = GetUserId();
+    appendBinaryStringInfo(&probe->key, (char *) &userid, sizeof(Oid));
+    for (int i = 0; rc_settings[i] != NULL; i++)
+    {
+        const char *value = GetConfigOption(rc_settings[i], true, false);
+
+        appendStringInfoString(&probe->key, value ? value : "");
+        appendStringInfoChar(&probe->key, '\0');
+    }
+
+    for (int i = 0; i < params->nargs; i++)
+    {
+        bool isnull = params->nulls[i] == 'n';
+        int16 typlen;
+        bool typbyval;
+
+        appendBinaryStringInfo(&probe->key, (char *) &params->types[i], sizeof(Oid));
+        appendBinaryStringInfo(&probe->key, (char *) &isnull, sizeof(bool));
+        if (isnull)
+            continue;
+
+        get_typlenbyval(params->types[i], &typlen, &typbyval);
+        if (typbyval)
+            appendBinaryStringInfo(&probe->key, (char *) &params->values[i], sizeof(Datum));
+        else if (typlen == -1)
+        {
+            struct varlena *value = pg_detoast_datum((struct varlena *) DatumGetPointer(params->values[i]));
+
+            appendBinaryStringInfo(&probe->key, (char *) value, VARSIZE(value));
+        }
+        else if (typlen == -2)
+            appendStringInfoString(&probe->key, DatumGetCString(params->values[i]));
+        else
+            appendBinaryStringInfo(&probe->key, DatumGetPointer(params->values[i]), typlen);
+    }
+    probe->hash = hash_bytes_extended((const unsigned char *) probe->key.data,
+                                      probe->key.len, 0);
+
+    probe->nstamps = list_length(relids) + 1;
+    probe->stamps = palloc(probe->nstamps * sizeof(hier_rc_stamp));
+    probe->stamps[n].slot = HIER_RC_EPOCH;
+    probe->stamps[n++].counter = pg_atomic_read_u64(&rc_shared->counters[HIER_RC_EPOCH]);
+    foreach(lc, relids)
+    {
+        probe->stamps[n].slot = rc_slot(lfirst_oid(lc));
+        probe->stamps[n].counter = pg_atomic_read_u64(&rc_shared->counters[probe->stamps[n].slot]);
+        n++;
+    }
+
+    pg_hier_free_ast(ast);
+    return true;
+}
+
+static bool
+rc_current(hier_rc_stamp *stamps, int nstamps)
+{
+    for (int i = 0; i < nstamps; i++)
+        if (pg_atomic_read_u64(&rc_shared->counters[stamps[i].slot]) != stamps[i].counter)
+            return false;
+    return true;
+}
+
+/**************************************
+ * Looks the call up. On a miss with a
+ * usable probe the caller computes the
+ * result under a fresh snapshot, taken
+ * after the stamps were read.
+ **************************************/
+bool
+pg_hier_result_cache_get(hier_rc_probe *probe, const char *input, hier_params *params,
+                         Datum *result, bool *is_null)
+{
+    hier_rc_key key;
+    hier_rc_entry *entry;
+    bool hit = false;
+
+    probe->usable = false;
+    // Other isolation levels see an older snapshot, and a
+    // transaction that wrote sees rows no one else does
+    if (!pg_hier_result_cache || rc_shared == NULL ||
+        XactIsoLevel != XACT_READ_COMMITTED ||
+        TransactionIdIsValid(GetTopTransactionIdIfAny()) || rc_written != NIL)
+        return false;
+    if (!rc_attach() || !rc_build_key(probe, input, params))
+        return false;
+
+    memset(&key, 0, sizeof(key));
+    key.dbid = MyDatabaseId;
+    key.userid = GetUserId();
+    key.hash = probe->hash;
+
+    entry = dshash_find(rc_table, &key, false);
+    if (entry != NULL)
+    {
+        char *data = dsa_get_address(rc_area, entry->data);
+        hier_rc_stamp *stamps = (hier_rc_stamp *) data;
+        char *key_bytes = data + entry->nstamps * sizeof(hier_rc_stamp);
+
+        if (entry->keylen == (Size) probe->key.len &&
+            memcmp(key_bytes, probe->key.data, entry->keylen) == 0 &&
+            rc_current(stamps, entry->nstamps))
+        {
+            *is_null = entry->is_null;
+            if (!entry->is_null)
+            {
+                char *copy = palloc(entry->resultlen);
+
+                memcpy(copy, key_bytes + entry->keylen, entry->resultlen);
+                *result = PointerGetDatum(copy);
+            }
+            hit = true;
+        }
+        dshash_release_lock(rc_table, entry);
+    }
+    if (hit)
+        return true;
+
+    probe->usable = true;
+    return false;
+}
+
+/**************************************
+ * Stores the computed result. When the
+ * area is full stale entries go first,
+ * then everything.
+ **************************************/
+void
+pg_hier_result_cache_put(hier_rc_probe *probe, Datum result, bool is_null)
+{
+    Size stamps_len;
+    Size result_len = 0;
+    struct varlena *value = NULL;
+    dsa_pointer data;
+    char *dest;
+    hier_rc_key key;
+    hier_rc_entry *entry;
+    bool found;
+
+    if (!probe->usable)
+        return;
+    probe->usable = false;
+
+    if (!is_null)
+    {
+        value = pg_detoast_datum_packed((struct varlena *) DatumGetPointer(result));
+        result_len = VARSIZE_ANY(value);
+    }
+    stamps_len = probe->nstamps * sizeof(hier_rc_stamp);
+
+    data = dsa_allocate_extended(rc_area, stamps_len + probe->key.len + result_len,
+                                 DSA_ALLOC_NO_OOM);
+    for (int pass = 0; !DsaPointerIsValid(data) && pass < 2; pass++)
+    {
+        rc_sweep(pass == 1);
+        data = dsa_allocate_extended(rc_area, stamps_len + probe->key.len + result_len,
+                                     DSA_ALLOC_NO_OOM);
+    }
+    if (!DsaPointerIsValid(data))
+        return;
+
+    dest = dsa_get_address(rc_area, data);
+    memcpy(dest, probe->stamps, stamps_len);
+    memcpy(dest + stamps_len, probe->key.data, probe->key.len);
+    if (value != NULL)
+        memcpy(dest + stamps_len + probe->key.len, value, result_len);
+
+    memset(&key, 0, sizeof(key));
+    key.dbid = MyDatabaseId;
+    key.userid = GetUserId();
+    key.hash = probe->hash;
+
+    entry = dshash_find_or_insert(rc_table, &key, &found);
+    if (found)
+        dsa_free(rc_area, entry->data);
+    entry->data = data;
+    entry->nstamps = probe->nstamps;
+    entry->keylen = probe->key.len;
+    entry->resultlen = result_len;
+    entry->is_null = is_null;
+    dshash_release_lock(rc_table, entry);
+}
+
+static void
+rc_sweep(bool all)
+{
+    dshash_seq_status status;
+    hier_rc_entry *entry;
+
+    dshash_seq_init(&status, rc_table, true);
+    while ((entry = dshash_seq_next(&status)) != NULL)
+    {
+        if (!all &&
+            rc_current((hier_rc_stamp *) dsa_get_address(rc_area, entry->data), entry->nstamps))
+            continue;
+        dsa_free(rc_area, entry->data);
+        dshash_delete_current(&status);
+    }
+    dshash_seq_term(&status);
+}
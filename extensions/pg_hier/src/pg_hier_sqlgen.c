@@ -0,0 +1,537 @@
+#include "pg_hier_sqlgen.h"
+#include "pg_hier_helper.h"
+
+// Rough cost of one correlated index probe, in rows
+#define HIER_PROBE_COST 4.0
+// Fraction of the root kept by a WHERE clause we cannot estimate
+#define HIER_WHERE_SELECTIVITY 0.005
+// Distinct values assumed when a key column has no statistics
+#define HIER_DEFAULT_DISTINCT 200.0
+
+int pg_hier_sql_shape = HIER_SQL_SHAPE_CORRELATED;
+
+const struct config_enum_entry pg_hier_sql_shape_options[] = {
+    {"auto", HIER_SQL_SHAPE_AUTO, false},
+    {"correlated", HIER_SQL_SHAPE_CORRELATED, false},
+    {"grouped", HIER_SQL_SHAPE_GROUPED, false},
+    {NULL, 0, false}
+};
+
+static void correlated_object(StringInfo buf, hier_node *node, hier_header *hh);
+static bool required_exists(StringInfo buf, hier_node *node, hier_header *hh, bool has_where);
+static bool grouped_usable(hier_node *node, hier_header *hh, List *ancestors);
+static void grouped_object(StringInfo obj, StringInfo joins, hier_node *node,
+                           hier_header *hh, int *next_alias);
+static int grouped_child(StringInfo joins, hier_node *parent, hier_node *node,
+                         hier_header *hh, int *next_alias);
+static double table_rows(const char *table, Oid *relid);
+static double key_distinct(Oid relid, double reltuples, hier_hop *hop);
+static bool shape_cost(hier_node *node, double outer_rows, hier_header *hh,
+                       double *correlated, double *grouped);
+
+/**************************************
+ * Builds the SQL for a parsed DSL into
+ * buf. HIER_OUTPUT_ROWS drops the outer
+ * jsonb_agg so every root row is its
+ * own document. pg_hier.sql_shape picks
+ * between the correlated and grouped
+ * shapes.
+ **************************************/
+void
+pg_hier_ast_sql(StringInfo buf, hier_ast *ast, hier_output_mode mode)
+{
+    hier_node *root = ast->root;
+    hier_header *hh;
+
+    if (ast->tables->size < 2)
+        ereport(ERROR, (errmsg("At least two tables are needed for hierarchical query.")));
+
+    hh = CREATE_HIER_HEADER();
+    pg_hier_find_hier(ast->tables, hh);
+
+    appendStringInfoString(buf, "SELECT ");
+
+    if (pg_hier_sql_shape != HIER_SQL_SHAPE_CORRELATED &&
+        (pg_hier_sql_shape == HIER_SQL_SHAPE_GROUPED ||
+         pg_hier_choose_shape(root, hh) == HIER_SQL_SHAPE_GROUPED) &&
+        pg_hier_grouped_sql(buf, root, hh, mode))
+        return;
+
+    if (mode == HIER_OUTPUT_ROWS)
+        correlated_object(buf, root, hh);
+    else
+    {
+        appendStringInfoString(buf, "jsonb_agg(");
+        correlated_object(buf, root, hh);
+        appendStringInfoChar(buf, ')');
+    }
+
+    appendStringInfo(buf, " FROM %s", root->table);
+    if (root->where)
+        appendStringInfo(buf, " WHERE (%s)", root->where);
+    required_exists(buf, root, hh, root->where != NULL);
+}
+
+/**************************************
+ * Root documents with their key, for
+ * materialization:
+ *   SELECT ARRAY[root.k::text, ..], doc FROM root
+ * by_key adds root.k = $n for each key
+ * column, numbered from first_param.
+ * Uses the correlated shape, refreshes
+ * touch a handful of roots.
+ **************************************/
+void
+pg_hier_keyed_sql(StringInfo buf, hier_ast *ast, hier_header *hh,
+                  char **keys, int nkeys, bool by_key, int first_param)
+{
+    hier_node *root = ast->root;
+    bool has_where;
+
+    appendStringInfoString(buf, "SELECT ARRAY[");
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(buf, "%s%s.%s::text", j > 0 ? ", " : "", root->table,
+                         quote_identifier(keys[j]));
+    appendStringInfoString(buf, "]::text[], ");
+
+    correlated_object(buf, root, hh);
+    appendStringInfo(buf, " FROM %s", root->table);
+    if (root->where)
+        appendStringInfo(buf, " WHERE (%s)", root->where);
+    has_where = required_exists(buf, root, hh, root->where != NULL);
+
+    for (int j = 0; by_key && j < nkeys; j++)
+        appendStringInfo(buf, " %s %s.%s = $%d",
+                         (j > 0 || has_where) ? "AND" : "WHERE",
+                         root->table, quote_identifier(keys[j]), first_param + j);
+}
+
+/**************************************
+ * One page of root documents in key
+ * order. Root keys are picked first by
+ * an index range scan, the documents are
+ * only built for those rows:
+ *   SELECT jsonb_agg(doc ORDER BY k), count(*), last k
+ *   FROM (SELECT root.pk AS k1 FROM root
+ *         WHERE (root.pk) > ($2) ORDER BY root.pk LIMIT $1) AS pg_hier_keys
+ *   JOIN root ON root.pk = pg_hier_keys.k1
+ * With after set, $2.. hold the last
+ * key of the previous page.
+ **************************************/
+void
+pg_hier_page_sql(StringInfo buf, hier_ast *ast, hier_header *hh,
+                 char **keys, int nkeys, bool after)
+{
+    hier_node *root = ast->root;
+    StringInfoData order;
+    StringInfoData order_desc;
+    StringInfoData root_keys;
+    bool has_where;
+
+    initStringInfo(&order);
+    initStringInfo(&order_desc);
+    initStringInfo(&root_keys);
+    for (int j = 0; j < nkeys; j++)
+    {
+        appendStringInfo(&order, "%spg_hier_keys.k%d", j > 0 ? ", " : "", j + 1);
+        appendStringInfo(&order_desc, "%spg_hier_keys.k%d DESC", j > 0 ? ", " : "", j + 1);
+        appendStringInfo(&root_keys, "%s%s.%s", j > 0 ? ", " : "", root->table,
+                         quote_identifier(keys[j]));
+    }
+
+    appendStringInfoString(buf, "SELECT coalesce(jsonb_agg(");
+    correlated_object(buf, root, hh);
+    appendStringInfo(buf, " ORDER BY %s), '[]'), count(*)", order.data);
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(buf, ", (array_agg(pg_hier_keys.k%d::text ORDER BY %s))[1]",
+                         j + 1, order_desc.data);
+
+    appendStringInfoString(buf, " FROM (SELECT ");
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(buf, "%s%s.%s AS k%d", j > 0 ? ", " : "", root->table,
+                         quote_identifier(keys[j]), j + 1);
+    appendStringInfo(buf, " FROM %s", root->table);
+    if (root->where)
+        appendStringInfo(buf, " WHERE (%s)", root->where);
+    has_where = required_exists(buf, root, hh, root->where != NULL);
+    if (after)
+    {
+        // Row comparison, one btree range scan on the key
+        appendStringInfo(buf, " %s (%s) > (", has_where ? "AND" : "WHERE", root_keys.data);
+        for (int j = 0; j < nkeys; j++)
+            appendStringInfo(buf, "%s$%d", j > 0 ? ", " : "", j + 2);
+        appendStringInfoChar(buf, ')');
+    }
+    appendStringInfo(buf, " ORDER BY %s LIMIT $1) AS pg_hier_keys JOIN %s ON ",
+                     root_keys.data, root->table);
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(buf, "%s%s.%s = pg_hier_keys.k%d", j > 0 ? " AND " : "",
+                         root->table, quote_identifier(keys[j]), j + 1);
+}
+
+/**************************************
+ * Correlated shape, one jsonb_agg
+ * subquery per child evaluated for
+ * every parent row.
+ **************************************/
+static void
+correlated_object(StringInfo buf, hier_node *node, hier_header *hh)
+{
+    bool first = true;
+
+    appendStringInfoString(buf, "jsonb_build_object(");
+    for (int i = 0; i < node->columns->size; i++)
+    {
+        appendStringInfo(buf, "%s'%s', %s.%s", first ? "" : ", ",
+                         node->columns->data[i], node->table, node->columns->data[i]);
+        first = false;
+    }
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_node *child = node->children[c];
+        bool correlated;
+
+        appendStringInfo(buf, "%s'%s', (SELECT jsonb_agg(", first ? "" : ", ", child->table);
+        correlated_object(buf, child, hh);
+        appendStringInfoString(buf, ") FROM ");
+        correlated = pg_hier_from_clause(buf, hh, node->table, child->table, child->where);
+        if (child->where)
+            appendStringInfo(buf, " %s (%s)", correlated ? "AND" : "WHERE", child->where);
+        required_exists(buf, child, hh, correlated || child->where != NULL);
+        appendStringInfoChar(buf, ')');
+        first = false;
+    }
+    appendStringInfoChar(buf, ')');
+}
+
+/**************************************
+ * Appends one EXISTS semi-join per
+ * INNER child of node, nesting the
+ * child's own INNER children, so rows
+ * without a match are dropped before
+ * anything is aggregated for them.
+ * Returns whether buf now has a WHERE.
+ **************************************/
+static bool
+required_exists(StringInfo buf, hier_node *node, hier_header *hh, bool has_where)
+{
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_node *child = node->children[c];
+        bool correlated;
+
+        if (!child->required)
+            continue;
+
+        appendStringInfo(buf, " %s EXISTS (SELECT 1 FROM ", has_where ? "AND" : "WHERE");
+        correlated = pg_hier_from_clause(buf, hh, node->table, child->table, child->where);
+        if (child->where)
+            appendStringInfo(buf, " %s (%s)", correlated ? "AND" : "WHERE", child->where);
+        required_exists(buf, child, hh, correlated || child->where != NULL);
+        appendStringInfoChar(buf, ')');
+        has_where = true;
+    }
+    return has_where;
+}
+
+/**************************************
+ * Grouped shape
+ *
+ * A child's derived table only has its
+ * own hop tables in scope, so a child
+ * WHERE naming the parent or another
+ * ancestor keeps the correlated shape.
+ **************************************/
+static bool
+grouped_usable(hier_node *node, hier_header *hh, List *ancestors)
+{
+    ListCell *lc;
+    bool usable = true;
+
+    foreach(lc, ancestors)
+        if (pg_hier_where_mentions(node->where, ((hier_node *) lfirst(lc))->table))
+            return false;
+
+    ancestors = lappend(ancestors, node);
+    for (int c = 0; c < node->nchildren && usable; c++)
+    {
+        hier_path *path = pg_hier_catalog_path(hh->hier_id, node->table,
+                                               node->children[c]->table);
+
+        if (path->nhops == 0)
+            usable = false;
+        for (int h = 0; h < path->nhops && usable; h++)
+            if (path->hops[h].nkeys == 0 || path->hops[h].join_clause == NULL)
+                usable = false;
+        if (usable)
+            usable = grouped_usable(node->children[c], hh, ancestors);
+    }
+    ancestors = list_delete_last(ancestors);
+    return usable;
+}
+
+/**************************************
+ * Emits the jsonb_build_object for one
+ * level into obj, and the LEFT JOINs of
+ * its children's derived tables into
+ * joins.
+ **************************************/
+static void
+grouped_object(StringInfo obj, StringInfo joins, hier_node *node,
+               hier_header *hh, int *next_alias)
+{
+    bool first = true;
+
+    appendStringInfoString(obj, "jsonb_build_object(");
+    for (int i = 0; i < node->columns->size; i++)
+    {
+        appendStringInfo(obj, "%s'%s', %s.%s", first ? "" : ", ",
+                         node->columns->data[i], node->table, node->columns->data[i]);
+        first = false;
+    }
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        int alias = grouped_child(joins, node, node->children[c], hh, next_alias);
+
+        appendStringInfo(obj, "%s'%s', pg_hier_g%d.doc", first ? "" : ", ",
+                         node->children[c]->table, alias);
+        first = false;
+    }
+    appendStringInfoChar(obj, ')');
+}
+
+/**************************************
+ * Emits
+ *   LEFT JOIN (SELECT keys, jsonb_agg(..) AS doc
+ *              FROM child ... GROUP BY keys) AS pg_hier_gN
+ *   ON (pg_hier_gN.k0 = parent.pk0 AND ...)
+ * and returns N. An INNER child uses a
+ * plain JOIN, the derived table has one
+ * row per key so it acts as a semi-join.
+ **************************************/
+static int
+grouped_child(StringInfo joins, hier_node *parent, hier_node *node,
+              hier_header *hh, int *next_alias)
+{
+    hier_path *path = pg_hier_join_path(hh, parent->table, node->table, node->where);
+    hier_hop *last = &path->hops[path->nhops - 1];
+    int alias = (*next_alias)++;
+    StringInfoData obj;
+    StringInfoData inner_joins;
+
+    initStringInfo(&obj);
+    initStringInfo(&inner_joins);
+    grouped_object(&obj, &inner_joins, node, hh, next_alias);
+
+    appendStringInfo(joins, " %s (SELECT ", node->required ? "JOIN" : "LEFT JOIN");
+    for (int j = 0; j < last->nkeys; j++)
+        appendStringInfo(joins, "%s.%s AS k%d, ", last->name, last->child_keys[j], j);
+    appendStringInfo(joins, "jsonb_agg(%s) AS doc FROM %s", obj.data, node->table);
+
+    for (int h = 0; h < path->nhops - 1; h++)
+    {
+        appendStringInfo(joins, " JOIN %s ON (%s)",
+                         path->hops[h].parent_name, path->hops[h].join_clause);
+        if (path->hops[h].exists_clause)
+            appendStringInfo(joins, " AND %s", path->hops[h].exists_clause);
+    }
+    appendStringInfoString(joins, inner_joins.data);
+
+    if (node->where && last->exists_clause)
+        appendStringInfo(joins, " WHERE (%s) AND %s", node->where, last->exists_clause);
+    else if (node->where)
+        appendStringInfo(joins, " WHERE (%s)", node->where);
+    else if (last->exists_clause)
+        appendStringInfo(joins, " WHERE %s", last->exists_clause);
+
+    appendStringInfoString(joins, " GROUP BY ");
+    for (int j = 0; j < last->nkeys; j++)
+        appendStringInfo(joins, "%s%s.%s", j > 0 ? ", " : "",
+                         last->name, last->child_keys[j]);
+
+    appendStringInfo(joins, ") AS pg_hier_g%d ON (", alias);
+    for (int j = 0; j < last->nkeys; j++)
+        appendStringInfo(joins, "%spg_hier_g%d.k%d = %s.%s", j > 0 ? " AND " : "",
+                         alias, j, parent->table, last->parent_keys[j]);
+    appendStringInfoChar(joins, ')');
+
+    pfree(obj.data);
+    pfree(inner_joins.data);
+    return alias;
+}
+
+/**************************************
+ * Appends the grouped shape of the tree
+ * to buf, which already holds "SELECT ".
+ * Returns false, leaving buf untouched,
+ * when a level cannot be linked to its
+ * parent by key columns.
+ **************************************/
+bool
+pg_hier_grouped_sql(StringInfo buf, hier_node *tree, hier_header *hh,
+                    hier_output_mode mode)
+{
+    StringInfoData obj;
+    StringInfoData joins;
+    int next_alias = 0;
+
+    if (hh->hier_id < 0 || !grouped_usable(tree, hh, NIL))
+        return false;
+
+    initStringInfo(&obj);
+    initStringInfo(&joins);
+    grouped_object(&obj, &joins, tree, hh, &next_alias);
+
+    if (mode == HIER_OUTPUT_ROWS)
+        appendStringInfo(buf, "%s FROM %s%s", obj.data, tree->table, joins.data);
+    else
+        appendStringInfo(buf, "jsonb_agg(%s) FROM %s%s", obj.data, tree->table, joins.data);
+
+    if (tree->where)
+        appendStringInfo(buf, " WHERE %s", tree->where);
+
+    pfree(obj.data);
+    pfree(joins.data);
+    return true;
+}
+
+/**************************************
+ * Statistics helpers. Return -1 when a
+ * table was never analyzed.
+ **************************************/
+static double
+table_rows(const char *table, Oid *relid)
+{
+    HeapTuple tuple;
+    double reltuples;
+
+    *relid = RangeVarGetRelid(pg_hier_rangevar(table), NoLock, true);
+    if (!OidIsValid(*relid))
+        return -1;
+
+    tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(*relid));
+    if (!HeapTupleIsValid(tuple))
+        return -1;
+    reltuples = ((Form_pg_class) GETSTRUCT(tuple))->reltuples;
+    ReleaseSysCache(tuple);
+
+    return reltuples;
+}
+
+// Distinct link keys on the table the hop starts from
+static double
+key_distinct(Oid relid, double reltuples, hier_hop *hop)
+{
+    double ndistinct = 1;
+
+    for (int j = 0; j < hop->nkeys; j++)
+    {
+        const char *key = hop->child_keys[j];
+        char *attname = downcase_identifier(key, strlen(key), false, false);
+        AttrNumber attnum = get_attnum(relid, attname);
+        double column_distinct = HIER_DEFAULT_DISTINCT;
+        HeapTuple tuple;
+
+        if (attnum != InvalidAttrNumber)
+        {
+            tuple = SearchSysCache3(STATRELATTINH, ObjectIdGetDatum(relid),
+                                    Int16GetDatum(attnum), BoolGetDatum(false));
+            if (HeapTupleIsValid(tuple))
+            {
+                float4 stadistinct = ((Form_pg_statistic) GETSTRUCT(tuple))->stadistinct;
+
+                // Negative values are a fraction of the row count
+                if (stadistinct > 0)
+                    column_distinct = stadistinct;
+                else if (stadistinct < 0)
+                    column_distinct = -stadistinct * reltuples;
+                ReleaseSysCache(tuple);
+            }
+        }
+        ndistinct *= Max(column_distinct, 1);
+    }
+
+    return Min(ndistinct, Max(reltuples, 1));
+}
+
+/**************************************
+ * Adds the cost of the levels below
+ * node, in rows touched, for both
+ * shapes. Correlated pays a probe per
+ * outer row, grouped reads every row of
+ * the level once. Returns false when a
+ * table has no statistics.
+ **************************************/
+static bool
+shape_cost(hier_node *node, double outer_rows, hier_header *hh,
+           double *correlated, double *grouped)
+{
+    for (int c = 0; c < node->nchildren; c++)
+    {
+        hier_node *child = node->children[c];
+        hier_path *path = pg_hier_join_path(hh, node->table, child->table, child->where);
+        hier_hop *last = &path->hops[path->nhops - 1];
+        Oid relid;
+        Oid link_relid;
+        double rows = table_rows(child->table, &relid);
+        double link_rows = table_rows(last->name, &link_relid);
+        double matched;
+
+        if (rows < 0 || link_rows < 0)
+            return false;
+
+        // Intermediate tables are read in full by the grouped shape
+        for (int h = 0; h < path->nhops - 1; h++)
+        {
+            Oid hop_relid;
+            double hop_rows = table_rows(path->hops[h].parent_name, &hop_relid);
+
+            if (hop_rows < 0)
+                return false;
+            *grouped += hop_rows;
+        }
+
+        matched = Min(outer_rows * rows / key_distinct(link_relid, link_rows, last), rows);
+        *correlated += outer_rows * HIER_PROBE_COST + matched;
+        *grouped += rows;
+
+        if (!shape_cost(child, matched, hh, correlated, grouped))
+            return false;
+    }
+    return true;
+}
+
+/**************************************
+ * Picks the shape from pg_class
+ * reltuples and pg_statistic n_distinct
+ * of the link keys. Broad queries over
+ * large levels favour grouped, a
+ * filtered root favours correlated.
+ * Falls back to correlated without
+ * statistics.
+ **************************************/
+hier_sql_shape
+pg_hier_choose_shape(hier_node *tree, hier_header *hh)
+{
+    Oid relid;
+    double root_rows;
+    double correlated = 0;
+    double grouped = 0;
+
+    if (hh->hier_id < 0)
+        return HIER_SQL_SHAPE_CORRELATED;
+
+    root_rows = table_rows(tree->table, &relid);
+    if (root_rows < 0)
+        return HIER_SQL_SHAPE_CORRELATED;
+    if (tree->where)
+        root_rows = Max(root_rows * HIER_WHERE_SELECTIVITY, 1);
+
+    if (!shape_cost(tree, root_rows, hh, &correlated, &grouped))
+        return HIER_SQL_SHAPE_CORRELATED;
+
+    elog(DEBUG1, "pg_hier shape cost: correlated %.0f, grouped %.0f",
+         correlated, grouped);
+
+    return grouped < correlated ? HIER_SQL_SHAPE_GROUPED : HIER_SQL_SHAPE_CORRELATED;
+}
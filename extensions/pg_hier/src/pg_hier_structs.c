@@ -15,13 +15,20 @@ create_string_array(void)
 
 void 
 add_string_to_array(string_array *arr, char *value)
+{
+    push_string_array(arr, pstrdup(value));
+}
+
+// Stores value without copying it
+void 
+push_string_array(string_array *arr, char *value)
 {
     if ((arr->size + 1) >= arr->capacity)
     {
         arr->capacity = arr->capacity > 0 ? arr->capacity * 2 : 4;
         arr->data = arr->data ? repalloc(arr->data, arr->capacity * sizeof(char *)) : palloc(arr->capacity * sizeof(char *));
     }
-    arr->data[arr->size++] = pstrdup(value);
+    arr->data[arr->size++] = value;
 }
 
 void 
@@ -53,48 +60,96 @@ free_string_array(string_array *arr)
 }
 
 /**************************************
- * Table stack functions
+ * DSL tree functions
  **************************************/
-table_stack *
-create_table_stack_entry(char *table_name, table_stack *next)
+hier_node *
+create_hier_node(const char *table, int length)
 {
-    table_stack *new_entry = palloc(sizeof(table_stack));
-    new_entry->table_name = pstrdup(table_name);
-    new_entry->next = next;
-    return new_entry;
+    hier_node *node = palloc0(sizeof(hier_node));
+    node->table = pnstrdup(table, length);
+    node->columns = create_string_array();
+    return node;
 }
 
-char *
-peek_table_stack(table_stack **stack)
+void 
+add_hier_node_child(hier_node *parent, hier_node *child)
 {
-    return (stack && *stack) ? pstrdup((*stack)->table_name) : NULL;
+    if (parent->nchildren >= parent->capacity)
+    {
+        parent->capacity = parent->capacity > 0 ? parent->capacity * 2 : 4;
+        parent->children = parent->children ? 
+            repalloc(parent->children, parent->capacity * sizeof(hier_node *)) : 
+            palloc(parent->capacity * sizeof(hier_node *));
+    }
+    parent->children[parent->nchildren++] = child;
 }
 
-char *
-pop_table_stack(table_stack **stack)
+/**************************************
+ * Bind parameter functions
+ **************************************/
+hier_params *
+create_hier_params(FunctionCallInfo fcinfo, int first_arg)
 {
-    char *table_name = NULL;
-    if (stack && *stack)
+    hier_params *params = palloc0(sizeof(hier_params));
+
+    if (PG_NARGS() <= first_arg)
+        return params;
+
+    // Called as pg_hier(dsl, VARIADIC array)
+    if (get_fn_expr_variadic(fcinfo->flinfo))
     {
-        table_stack *top = *stack;
-        *stack = top->next;
-        table_name = pstrdup(top->table_name);
-        pfree(top->table_name);
-        pfree(top);
+        ArrayType *arr;
+        Oid elemtype;
+        int16 typlen;
+        bool typbyval;
+        char typalign;
+        bool *elem_nulls;
+
+        if (PG_ARGISNULL(first_arg))
+            return params;
+
+        arr = PG_GETARG_ARRAYTYPE_P(first_arg);
+        elemtype = ARR_ELEMTYPE(arr);
+        get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+        deconstruct_array(arr, elemtype, typlen, typbyval, typalign,
+                          &params->values, &elem_nulls, &params->nargs);
+
+        params->types = palloc(Max(params->nargs, 1) * sizeof(Oid));
+        params->nulls = palloc(Max(params->nargs, 1) * sizeof(char));
+        for (int i = 0; i < params->nargs; i++)
+        {
+            params->types[i] = elemtype;
+            params->nulls[i] = elem_nulls[i] ? 'n' : ' ';
+        }
+        return params;
     }
-    return table_name;
-}
 
-void 
-free_table_stack(table_stack **stack)
-{
-    while (*stack)
+    params->nargs = PG_NARGS() - first_arg;
+    params->types = palloc(params->nargs * sizeof(Oid));
+    params->values = palloc(params->nargs * sizeof(Datum));
+    params->nulls = palloc(params->nargs * sizeof(char));
+
+    for (int i = 0; i < params->nargs; i++)
     {
-        table_stack *next = (*stack)->next;
-        pfree((*stack)->table_name);
-        pfree(*stack);
-        *stack = next;
+        int arg = first_arg + i;
+        Oid type = get_fn_expr_argtype(fcinfo->flinfo, arg);
+
+        if (!OidIsValid(type))
+            elog(ERROR, "could not determine data type of bind parameter $%d", i + 1);
+
+        params->nulls[i] = PG_ARGISNULL(arg) ? 'n' : ' ';
+        params->values[i] = PG_ARGISNULL(arg) ? (Datum) 0 : PG_GETARG_DATUM(arg);
+
+        // Untyped literals arrive as cstrings, bind them as text
+        if (type == UNKNOWNOID)
+        {
+            type = TEXTOID;
+            if (!PG_ARGISNULL(arg))
+                params->values[i] = CStringGetTextDatum(DatumGetCString(params->values[i]));
+        }
+        params->types[i] = type;
     }
+    return params;
 }
 
 /**************************************
@@ -123,7 +178,7 @@ create_hier_header2(char *hier, int hier_id)
 void 
 update_hier_header(hier_header *hh, char *hier, int hier_id)
 {
-    strcpy(hh->hier, hier);
+    strlcpy(hh->hier, hier, sizeof(hh->hier));
     hh->hier_id = hier_id;
 }
 
@@ -131,6 +186,6 @@ void
 free_hier_header(hier_header *hh)
 {
     if (hh)
-        free(hh);
+        pfree(hh);
     hh = NULL;
 }
\ No newline at end of file
@@ -0,0 +1,480 @@
+#include "pg_hier_tree.h"
+#include "pg_hier_helper.h"
+
+// Statements shared by every indexed tree, $1 table, $2 node, $3 parent
+typedef enum tree_stmt
+{
+    TREE_SELF,   // the node is its own ancestor at depth 0
+    TREE_CYCLE,  // is $3 inside the subtree of $2
+    TREE_ATTACH, // ancestors of $3 x subtree of $2
+    TREE_DETACH, // pairs linking the subtree of $2 to anything above it
+    TREE_FORGET, // pairs naming $2
+    TREE_NSTMTS
+} tree_stmt;
+
+static const char *const tree_sql[TREE_NSTMTS] = {
+    "INSERT INTO pg_hier_tree_closure VALUES ($1, $2, $2, 0) ON CONFLICT DO NOTHING",
+
+    "SELECT 1 FROM pg_hier_tree_closure "
+    "WHERE table_name = $1 AND ancestor = $2 AND descendant = $3",
+
+    "INSERT INTO pg_hier_tree_closure "
+    "SELECT $1, a.ancestor, d.descendant, a.depth + d.depth + 1 "
+    "FROM pg_hier_tree_closure a JOIN pg_hier_tree_closure d "
+    "ON d.table_name = $1 AND d.ancestor = $2 "
+    "WHERE a.table_name = $1 AND a.descendant = $3 ON CONFLICT DO NOTHING",
+
+    "DELETE FROM pg_hier_tree_closure c USING pg_hier_tree_closure d "
+    "WHERE d.table_name = $1 AND d.ancestor = $2 "
+    "AND c.table_name = $1 AND c.descendant = d.descendant AND c.depth > d.depth",
+
+    "DELETE FROM pg_hier_tree_closure "
+    "WHERE table_name = $1 AND (ancestor = $2 OR descendant = $2)"
+};
+
+static SPIPlanPtr tree_plans[TREE_NSTMTS];
+
+// Per trigger, the adopt statement and key columns
+typedef struct tree_plan_entry
+{
+    Oid tgoid;
+    SPIPlanPtr adopt;
+    int nkeys;
+    int *id_attnos;
+    int *parent_attnos;
+} tree_plan_entry;
+
+static HTAB *adopt_plans = NULL;
+
+static char **key_types(const char *table, char **keys, int nkeys);
+static char *key_array(const char *alias, char **keys, int nkeys);
+static char *adopt_sql(const char *table, char **id_keys, char **parent_keys, int nkeys);
+static void install_triggers(const char *table, char **id_keys, char **parent_keys,
+                             int nkeys);
+static tree_plan_entry *tree_plan(Trigger *trigger, Relation rel);
+static Datum row_key(HeapTuple row, TupleDesc tupdesc, int *attnos, int nkeys,
+                     bool *isnull);
+static bool run_stmt(tree_stmt stmt, Datum table, Datum node, Datum parent);
+static void insert_node(tree_plan_entry *entry, Datum table, Datum node,
+                        Datum parent, bool has_parent);
+static void attach_node(Datum table, Datum node, Datum parent);
+
+/**************************************
+ * Type names of the key columns, the
+ * text[] keys are cast back to them so
+ * lookups on the tree use its indexes.
+ **************************************/
+static char **
+key_types(const char *table, char **keys, int nkeys)
+{
+    Oid relid = RangeVarGetRelid(pg_hier_rangevar(table), AccessShareLock, false);
+    char **types = palloc(nkeys * sizeof(char *));
+
+    for (int j = 0; j < nkeys; j++)
+    {
+        AttrNumber attnum = get_attnum(relid, keys[j]);
+
+        if (attnum == InvalidAttrNumber)
+            ereport(ERROR, (errmsg("Column %s not found in %s", keys[j], table)));
+        types[j] = format_type_be(get_atttype(relid, attnum));
+    }
+    return types;
+}
+
+// ARRAY[alias.k1::text, ..]
+static char *
+key_array(const char *alias, char **keys, int nkeys)
+{
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    appendStringInfoString(&buf, "ARRAY[");
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(&buf, "%s%s.%s::text", j > 0 ? ", " : "", alias,
+                         quote_identifier(keys[j]));
+    appendStringInfoChar(&buf, ']');
+    return buf.data;
+}
+
+/**************************************
+ * Links the existing children of a new
+ * node ($2) to it, for rows inserted
+ * before their parent:
+ *   INSERT .. SELECT $1, $2, c.descendant, c.depth + 1
+ *   FROM tree JOIN closure c ON c.ancestor = ARRAY[tree.id::text]
+ *   WHERE tree.parent = ($2)[1]::type
+ **************************************/
+static char *
+adopt_sql(const char *table, char **id_keys, char **parent_keys, int nkeys)
+{
+    char **types = key_types(table, parent_keys, nkeys);
+    StringInfoData sql;
+
+    initStringInfo(&sql);
+    appendStringInfo(&sql,
+                     "INSERT INTO pg_hier_tree_closure "
+                     "SELECT $1, $2, c.descendant, c.depth + 1 FROM %s AS pg_hier_t "
+                     "JOIN pg_hier_tree_closure c ON c.table_name = $1 AND c.ancestor = %s "
+                     "WHERE ",
+                     table, key_array("pg_hier_t", id_keys, nkeys));
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(&sql, "%spg_hier_t.%s = ($2)[%d]::%s", j > 0 ? " AND " : "",
+                         quote_identifier(parent_keys[j]), j + 1, types[j]);
+    appendStringInfoString(&sql, " ON CONFLICT DO NOTHING");
+    return sql.data;
+}
+
+/**************************************
+ * Triggers are named pg_hier_tree and
+ * pg_hier_tree_truncate, one pair per
+ * table. Arguments: table name, adopt
+ * statement, id keys, parent keys.
+ **************************************/
+static void
+install_triggers(const char *table, char **id_keys, char **parent_keys, int nkeys)
+{
+    StringInfoData sql;
+    int ret;
+
+    initStringInfo(&sql);
+    appendStringInfo(&sql,
+                     "DROP TRIGGER IF EXISTS pg_hier_tree ON %s; "
+                     "DROP TRIGGER IF EXISTS pg_hier_tree_truncate ON %s; "
+                     "CREATE TRIGGER pg_hier_tree AFTER INSERT OR UPDATE OR DELETE ON %s "
+                     "FOR EACH ROW EXECUTE FUNCTION pg_hier_tree_changed(%s, %s",
+                     table, table, table, quote_literal_cstr(table),
+                     quote_literal_cstr(adopt_sql(table, id_keys, parent_keys, nkeys)));
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(&sql, ", %s", quote_literal_cstr(id_keys[j]));
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(&sql, ", %s", quote_literal_cstr(parent_keys[j]));
+    appendStringInfo(&sql,
+                     "); CREATE TRIGGER pg_hier_tree_truncate AFTER TRUNCATE ON %s "
+                     "FOR EACH STATEMENT EXECUTE FUNCTION pg_hier_tree_changed(%s)",
+                     table, quote_literal_cstr(table));
+
+    ret = SPI_execute(sql.data, false, 0);
+    if (ret != SPI_OK_UTILITY)
+        elog(ERROR, "SPI_execute failed: %d", ret);
+}
+
+/**************************************
+ * Rebuilds the closure of a registered
+ * tree with one recursive query and
+ * installs the maintenance triggers.
+ * A cycle fails the build, as the
+ * triggers refuse to create one: its
+ * rows would be each other's ancestors.
+ * Returns the pairs stored.
+ **************************************/
+int64
+pg_hier_tree_build(const char *table)
+{
+    Oid type = TEXTOID;
+    Datum value = CStringGetTextDatum(table);
+    StringInfoData sql;
+    char **id_keys;
+    char **parent_keys;
+    int nkeys;
+    bool closure;
+    int64 count;
+    bool isnull;
+    int ret;
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    // Row lock serializes concurrent rebuilds of one table
+    if (!pg_hier_tree_keys(table, true, &id_keys, &parent_keys, &nkeys, &closure))
+        ereport(ERROR, (errmsg("Tree %s is not registered, see pg_hier_create_tree", table)));
+
+    ret = SPI_execute_with_args("DELETE FROM pg_hier_tree_closure WHERE table_name = $1",
+                                1, &type, &value, NULL, false, 0);
+    if (ret != SPI_OK_DELETE)
+        elog(ERROR, "SPI_execute_with_args failed: %d", ret);
+
+    initStringInfo(&sql);
+    appendStringInfo(&sql,
+                     "WITH RECURSIVE pg_hier_walk(ancestor, descendant, depth) AS ("
+                     "SELECT %s, %s, 0 FROM %s AS pg_hier_t "
+                     "UNION ALL "
+                     "SELECT w.ancestor, %s, w.depth + 1 FROM pg_hier_walk w "
+                     "JOIN %s AS pg_hier_t ON %s = w.descendant"
+                     ") CYCLE descendant SET pg_hier_cycle USING pg_hier_path, "
+                     "pg_hier_stored AS (INSERT INTO pg_hier_tree_closure "
+                     "SELECT $1, ancestor, descendant, depth FROM pg_hier_walk "
+                     "WHERE NOT pg_hier_cycle ON CONFLICT DO NOTHING RETURNING 1) "
+                     "SELECT (SELECT count(*) FROM pg_hier_stored), "
+                     "EXISTS (SELECT 1 FROM pg_hier_walk WHERE pg_hier_cycle)",
+                     key_array("pg_hier_t", id_keys, nkeys),
+                     key_array("pg_hier_t", id_keys, nkeys), table,
+                     key_array("pg_hier_t", id_keys, nkeys), table,
+                     key_array("pg_hier_t", parent_keys, nkeys));
+
+    ret = SPI_execute_with_args(sql.data, 1, &type, &value, NULL, false, 0);
+    if (ret != SPI_OK_SELECT || SPI_processed != 1)
+        elog(ERROR, "SPI_execute_with_args failed: %d", ret);
+    if (DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull)))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_RECURSION),
+                 errmsg("Rows of tree %s form a cycle", table),
+                 errhint("Break the cycle before indexing the tree.")));
+    count = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1,
+                                        &isnull));
+
+    install_triggers(table, id_keys, parent_keys, nkeys);
+
+    ret = SPI_execute_with_args("UPDATE pg_hier_tree SET closure = true WHERE table_name = $1",
+                                1, &type, &value, NULL, false, 0);
+    if (ret != SPI_OK_UPDATE)
+        elog(ERROR, "SPI_execute_with_args failed: %d", ret);
+
+    pg_hier_arena_sample();
+    SPI_finish();
+    return count;
+}
+
+static tree_plan_entry *
+tree_plan(Trigger *trigger, Relation rel)
+{
+    TupleDesc tupdesc = RelationGetDescr(rel);
+    tree_plan_entry *entry;
+    bool found;
+
+    if (tree_plans[0] == NULL)
+    {
+        Oid types[3] = {TEXTOID, TEXTARRAYOID, TEXTARRAYOID};
+
+        for (int s = 0; s < TREE_NSTMTS; s++)
+        {
+            SPIPlanPtr plan = SPI_prepare(tree_sql[s], 3, types);
+
+            if (plan == NULL)
+                elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+            SPI_keepplan(plan);
+            tree_plans[s] = plan;
+        }
+    }
+
+    if (adopt_plans == NULL)
+    {
+        HASHCTL ctl;
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(tree_plan_entry);
+        adopt_plans = hash_create("pg_hier tree plans", 16, &ctl, HASH_ELEM | HASH_BLOBS);
+    }
+
+    entry = hash_search(adopt_plans, &trigger->tgoid, HASH_ENTER, &found);
+    if (!found)
+        entry->adopt = NULL;
+
+    if (entry->adopt == NULL)
+    {
+        int nkeys = (trigger->tgnargs - 2) / 2;
+        Oid types[2] = {TEXTOID, TEXTARRAYOID};
+        SPIPlanPtr plan;
+
+        entry->nkeys = nkeys;
+        entry->id_attnos = MemoryContextAlloc(TopMemoryContext, Max(nkeys, 1) * sizeof(int));
+        entry->parent_attnos = MemoryContextAlloc(TopMemoryContext, Max(nkeys, 1) * sizeof(int));
+        for (int j = 0; j < nkeys; j++)
+        {
+            entry->id_attnos[j] = SPI_fnumber(tupdesc, trigger->tgargs[j + 2]);
+            entry->parent_attnos[j] = SPI_fnumber(tupdesc, trigger->tgargs[j + 2 + nkeys]);
+            if (entry->id_attnos[j] <= 0 || entry->parent_attnos[j] <= 0)
+                ereport(ERROR, (errmsg("Key columns of %s not found",
+                                       RelationGetRelationName(rel))));
+        }
+
+        plan = SPI_prepare(trigger->tgargs[1], 2, types);
+        if (plan == NULL)
+            elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+        SPI_keepplan(plan);
+        entry->adopt = plan;
+    }
+    return entry;
+}
+
+// Key as text[], NULL when any column is, a NULL parent means a root
+static Datum
+row_key(HeapTuple row, TupleDesc tupdesc, int *attnos, int nkeys, bool *isnull)
+{
+    Datum *elems = palloc(nkeys * sizeof(Datum));
+
+    for (int j = 0; j < nkeys; j++)
+    {
+        char *value = SPI_getvalue(row, tupdesc, attnos[j]);
+
+        if (value == NULL)
+        {
+            *isnull = true;
+            return (Datum) 0;
+        }
+        elems[j] = CStringGetTextDatum(value);
+    }
+    *isnull = false;
+    return PointerGetDatum(construct_array(elems, nkeys, TEXTOID, -1, false, TYPALIGN_INT));
+}
+
+// Returns whether the statement touched or found a row
+static bool
+run_stmt(tree_stmt stmt, Datum table, Datum node, Datum parent)
+{
+    Datum values[3] = {table, node, parent};
+    char nulls[3] = {' ', ' ', parent == (Datum) 0 ? 'n' : ' '};
+
+    if (SPI_execute_plan(tree_plans[stmt], values, nulls, stmt == TREE_CYCLE, 0) < 0)
+        elog(ERROR, "SPI_execute_plan failed");
+    return SPI_processed > 0;
+}
+
+// Refuses moves under the node's own subtree
+static void
+attach_node(Datum table, Datum node, Datum parent)
+{
+    if (run_stmt(TREE_CYCLE, table, node, parent))
+        ereport(ERROR, (errmsg("Row of tree %s would become its own ancestor",
+                               TextDatumGetCString(table))));
+    run_stmt(TREE_ATTACH, table, node, parent);
+}
+
+static void
+insert_node(tree_plan_entry *entry, Datum table, Datum node, Datum parent, bool has_parent)
+{
+    Datum values[2] = {table, node};
+
+    run_stmt(TREE_SELF, table, node, (Datum) 0);
+    if (SPI_execute_plan(entry->adopt, values, NULL, false, 0) < 0)
+        elog(ERROR, "SPI_execute_plan failed");
+    if (has_parent)
+        attach_node(table, node, parent);
+}
+
+/**************************************
+ * Trigger body. An insert adds the
+ * node, adopts rows already pointing
+ * at it and hangs it under its parent.
+ * A parent change detaches the whole
+ * subtree and attaches it again, a key
+ * change or delete drops the node's
+ * pairs. TRUNCATE empties the closure.
+ **************************************/
+void
+pg_hier_tree_mark(TriggerData *trigdata)
+{
+    Trigger *trigger = trigdata->tg_trigger;
+    TupleDesc tupdesc = RelationGetDescr(trigdata->tg_relation);
+    tree_plan_entry *entry;
+    Datum table;
+    Datum old_id = (Datum) 0;
+    Datum old_parent = (Datum) 0;
+    Datum new_id = (Datum) 0;
+    Datum new_parent = (Datum) 0;
+    bool old_id_null = true;
+    bool old_parent_null = true;
+    bool new_id_null = true;
+    bool new_parent_null = true;
+    int ret;
+
+    if (trigger->tgnargs < 1)
+        elog(ERROR, "pg_hier_tree_changed: missing arguments");
+
+    if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed: %d", ret);
+
+    table = CStringGetTextDatum(trigger->tgargs[0]);
+
+    if (TRIGGER_FIRED_BY_TRUNCATE(trigdata->tg_event))
+    {
+        Oid type = TEXTOID;
+
+        ret = SPI_execute_with_args("DELETE FROM pg_hier_tree_closure WHERE table_name = $1",
+                                    1, &type, &table, NULL, false, 0);
+        if (ret != SPI_OK_DELETE)
+            elog(ERROR, "SPI_execute_with_args failed: %d", ret);
+        SPI_finish();
+        return;
+    }
+
+    if (!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event) || trigger->tgnargs < 4)
+        elog(ERROR, "pg_hier_tree_changed: must be fired for each row");
+
+    entry = tree_plan(trigger, trigdata->tg_relation);
+
+    if (!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+    {
+        old_id = row_key(trigdata->tg_trigtuple, tupdesc, entry->id_attnos,
+                         entry->nkeys, &old_id_null);
+        old_parent = row_key(trigdata->tg_trigtuple, tupdesc, entry->parent_attnos,
+                             entry->nkeys, &old_parent_null);
+    }
+    if (!TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+    {
+        HeapTuple row = TRIGGER_FIRED_BY_INSERT(trigdata->tg_event) ?
+            trigdata->tg_trigtuple : trigdata->tg_newtuple;
+
+        new_id = row_key(row, tupdesc, entry->id_attnos, entry->nkeys, &new_id_null);
+        new_parent = row_key(row, tupdesc, entry->parent_attnos, entry->nkeys,
+                             &new_parent_null);
+    }
+
+    // Same key, only the parent may have moved
+    if (!old_id_null && !new_id_null &&
+        datumIsEqual(old_id, new_id, false, -1))
+    {
+        bool moved = old_parent_null != new_parent_null ||
+            (!new_parent_null &&
+             !datumIsEqual(old_parent, new_parent, false, -1));
+
+        if (moved)
+        {
+            run_stmt(TREE_DETACH, table, new_id, (Datum) 0);
+            if (!new_parent_null)
+                attach_node(table, new_id, new_parent);
+        }
+        SPI_finish();
+        return;
+    }
+
+    // Children of a removed key stay linked among themselves
+    if (!old_id_null)
+    {
+        run_stmt(TREE_DETACH, table, old_id, (Datum) 0);
+        run_stmt(TREE_FORGET, table, old_id, (Datum) 0);
+    }
+    if (!new_id_null)
+        insert_node(entry, table, new_id, new_parent, !new_parent_null);
+
+    SPI_finish();
+}
+
+/**************************************
+ * Restricts a read of an indexed tree
+ * to the subtrees of the rows matching
+ * where, down to max_depth levels:
+ *   WHERE (tree.id) IN (SELECT (c.descendant)[1]::type
+ *     FROM pg_hier_tree_closure c
+ *     WHERE c.ancestor IN (SELECT ARRAY[tree.id::text]
+ *                          FROM tree WHERE (where)))
+ **************************************/
+void
+pg_hier_tree_subtree(StringInfo buf, const char *table, char **id_keys, int nkeys,
+                     const char *where, int max_depth)
+{
+    char **types = key_types(table, id_keys, nkeys);
+
+    appendStringInfoString(buf, " WHERE (");
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(buf, "%s%s.%s", j > 0 ? ", " : "", table,
+                         quote_identifier(id_keys[j]));
+    appendStringInfoString(buf, ") IN (SELECT ");
+    for (int j = 0; j < nkeys; j++)
+        appendStringInfo(buf, "%s(c.descendant)[%d]::%s", j > 0 ? ", " : "", j + 1, types[j]);
+    appendStringInfo(buf,
+                     " FROM pg_hier_tree_closure c WHERE c.table_name = %s AND c.depth < %d"
+                     " AND c.ancestor IN (SELECT %s FROM %s WHERE (%s)))",
+                     quote_literal_cstr(table), max_depth,
+                     key_array(table, id_keys, nkeys), table, where);
+}
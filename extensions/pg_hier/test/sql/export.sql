@@ -0,0 +1,17 @@
+SET client_min_messages = warning;
+\set VERBOSITY terse
+
+-- Members and projects hang off teams in two hierarchies
+CREATE TABLE exp_team (id int PRIMARY KEY, name text);
+CREATE TABLE exp_member (id int PRIMARY KEY, team_id int, name text);
+CREATE TABLE exp_project (id int PRIMARY KEY, team_id int, title text);
+INSERT INTO exp_team VALUES (1, 'red'), (2, 'blue');
+INSERT INTO exp_member VALUES (1, 1, 'ann'), (2, 1, 'bob');
+INSERT INTO exp_project VALUES (1, 1, 'launch'), (2, 1, 'fix, ship');
+SELECT pg_hier_create_hier(ARRAY['exp_team', 'exp_member'], ARRAY['', 'id'], ARRAY['', 'team_id']);
+SELECT pg_hier_create_hier(ARRAY['exp_team', 'exp_project'], ARRAY['', 'id'], ARRAY['', 'team_id']);
+
+-- Sibling branches get rows of their own, a team without either is one row
+SELECT * FROM pg_hier_export_rows('exp_team { name exp_member { name } exp_project { title } }', 'csv');
+
+SELECT * FROM pg_hier_export_rows('exp_team { name exp_member { name } exp_project { title } }', 'xml');
@@ -0,0 +1,47 @@
+SET client_min_messages = warning;
+\set VERBOSITY terse
+
+CREATE TABLE mat_customer (id int PRIMARY KEY, name text);
+CREATE TABLE mat_order (id int PRIMARY KEY, customer_id int, total int);
+CREATE TABLE mat_item (id int PRIMARY KEY, order_id int, sku text);
+INSERT INTO mat_customer VALUES (1, 'ann'), (2, 'bob');
+INSERT INTO mat_order VALUES (10, 1, 5);
+INSERT INTO mat_item VALUES (100, 10, 'pen');
+SELECT pg_hier_create_hier(ARRAY['mat_customer', 'mat_order', 'mat_item'],
+                           ARRAY['', 'id', 'id'],
+                           ARRAY['', 'customer_id', 'order_id']);
+
+SELECT pg_hier_materialize(repeat('x', 50), 'mat_customer { name mat_order { total mat_item { sku } } }');
+SELECT pg_hier_materialize('mat_doc', 'mat_customer { name mat_order { total mat_item { sku } } }');
+SELECT pg_hier_document('mat_doc', ARRAY['1']);
+SELECT pg_hier_document('mat_doc', ARRAY['2']);
+
+-- DML on each member table queues the root keys it reaches
+UPDATE mat_customer SET name = 'bea' WHERE id = 2;
+INSERT INTO mat_order VALUES (20, 2, 7);
+UPDATE mat_item SET sku = 'ink' WHERE id = 100;
+SELECT root_key FROM pg_hier_materialized_dirty WHERE name = 'mat_doc' ORDER BY root_key;
+SELECT pg_hier_refresh('mat_doc');
+SELECT pg_hier_document('mat_doc', ARRAY['1']);
+SELECT pg_hier_document('mat_doc', ARRAY['2']);
+
+-- Moving a row marks both its old and its new root
+UPDATE mat_order SET customer_id = 1 WHERE id = 20;
+SELECT root_key FROM pg_hier_materialized_dirty WHERE name = 'mat_doc' ORDER BY root_key;
+SELECT pg_hier_refresh('mat_doc');
+SELECT pg_hier_document('mat_doc', ARRAY['1']);
+SELECT pg_hier_document('mat_doc', ARRAY['2']);
+
+-- A deleted root loses its document
+DELETE FROM mat_customer WHERE id = 2;
+SELECT pg_hier_refresh('mat_doc');
+SELECT pg_hier_document('mat_doc', ARRAY['2']) IS NULL AS gone;
+
+-- TRUNCATE flags the materialization stale, refresh rebuilds it
+TRUNCATE mat_item;
+SELECT stale FROM pg_hier_materialized WHERE name = 'mat_doc';
+SELECT pg_hier_refresh('mat_doc');
+SELECT pg_hier_document('mat_doc', ARRAY['1']);
+
+SELECT pg_hier_drop_materialized('mat_doc');
+SELECT count(*) AS triggers FROM pg_trigger WHERE tgname LIKE 'pg_hier_mat_doc_%';
@@ -0,0 +1,22 @@
+SET client_min_messages = warning;
+\set VERBOSITY terse
+
+-- The primary key runs (b, a), the reverse of the column order
+CREATE TABLE page_root (a int, b int, name text, PRIMARY KEY (b, a));
+CREATE TABLE page_leaf (id int PRIMARY KEY, root_b int, root_a int, v text);
+INSERT INTO page_root VALUES (2, 1), (1, 2), (1, 3), (1, 1), (2, 2);
+INSERT INTO page_leaf VALUES (1, 1, 1, 'x'), (2, 2, 1, 'y');
+SELECT pg_hier_create_hier(ARRAY['page_root', 'page_leaf'],
+                           ARRAY['', 'b:a'],
+                           ARRAY['', 'root_b:root_a']);
+
+SELECT documents, next_token FROM pg_hier_page('page_root { a b page_leaf { v } }', 2);
+SELECT next_token AS token FROM pg_hier_page('page_root { a b page_leaf { v } }', 2) \gset
+SELECT documents, next_token FROM pg_hier_page('page_root { a b page_leaf { v } }', 2, :'token');
+SELECT next_token AS token FROM pg_hier_page('page_root { a b page_leaf { v } }', 2, :'token') \gset
+
+-- A short page ends the walk
+SELECT documents, next_token IS NULL AS last FROM pg_hier_page('page_root { a b page_leaf { v } }', 2, :'token');
+
+SELECT documents FROM pg_hier_page('page_root { a b page_leaf { v } }', 0);
+SELECT documents FROM pg_hier_page('page_root { a b page_leaf { v } }', 2, 'bm90IGEgdG9rZW4=');
@@ -0,0 +1,6 @@
+SET client_min_messages = warning;
+
+-- Install the first release and upgrade, as an existing database would
+CREATE EXTENSION pg_hier VERSION '0.1';
+ALTER EXTENSION pg_hier UPDATE TO '0.2';
+SELECT extversion FROM pg_extension WHERE extname = 'pg_hier';
@@ -0,0 +1,42 @@
+SET client_min_messages = warning;
+\set VERBOSITY terse
+
+CREATE TABLE tree_node (id int PRIMARY KEY, parent_id int, name text);
+SELECT pg_hier_create_tree('tree_node', 'id', 'parent_id');
+SELECT pg_hier_tree_index('tree_node');
+
+-- A child inserted before its parent is adopted by it
+INSERT INTO tree_node VALUES (2, 1, 'b');
+INSERT INTO tree_node VALUES (1, NULL, 'a');
+INSERT INTO tree_node VALUES (3, 2, 'c');
+SELECT descendant, depth FROM pg_hier_descendants('tree_node', ARRAY['1']) ORDER BY depth;
+SELECT ancestor, depth FROM pg_hier_ancestors('tree_node', ARRAY['3']);
+
+-- The triggers keep what a rebuild would store
+SELECT pg_hier_tree_index('tree_node');
+
+-- Moves carry the whole subtree
+UPDATE tree_node SET parent_id = NULL WHERE id = 2;
+SELECT ancestor, depth FROM pg_hier_ancestors('tree_node', ARRAY['3']);
+INSERT INTO tree_node VALUES (4, NULL, 'd');
+UPDATE tree_node SET parent_id = 4 WHERE id = 2;
+SELECT ancestor, depth FROM pg_hier_ancestors('tree_node', ARRAY['3']);
+
+-- No row may move under its own subtree
+UPDATE tree_node SET parent_id = 3 WHERE id = 4;
+SELECT ancestor, depth FROM pg_hier_ancestors('tree_node', ARRAY['3']);
+
+-- A deleted row takes its pairs along, its children become roots
+DELETE FROM tree_node WHERE id = 2;
+SELECT ancestor, depth FROM pg_hier_ancestors('tree_node', ARRAY['3']);
+SELECT count(*) AS pairs FROM pg_hier_tree_closure WHERE table_name = 'tree_node';
+
+TRUNCATE tree_node;
+SELECT count(*) AS pairs FROM pg_hier_tree_closure WHERE table_name = 'tree_node';
+
+-- Rows already forming a cycle fail the build
+CREATE TABLE tree_cycle (id int PRIMARY KEY, parent_id int);
+INSERT INTO tree_cycle VALUES (1, 2), (2, 1), (3, NULL);
+SELECT pg_hier_create_tree('tree_cycle', 'id', 'parent_id');
+SELECT pg_hier_tree_index('tree_cycle');
+SELECT closure FROM pg_hier_tree WHERE table_name = 'tree_cycle';